@@ -10,14 +10,27 @@
 
 */
 
+#define _GNU_SOURCE			// CPU_SET(), pthread_setaffinity_np()
 #include <stdio.h>
+#include <stdarg.h>
+#include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-//#include <fcntl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
 #include <math.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 
 #define CYGWIN
 #ifdef CYGWIN
@@ -25,6 +38,7 @@
 #else
 #include <netinet/in.h>
 #endif
+#include <netinet/tcp.h>
 
 //#define GALILIP	"192.168.1.2"		// Generic private IP address
 #define GALILIP 	"192.91.178.197"	// Jorge's sodium
@@ -33,6 +47,7 @@
 #define XAXIS		1
 #define YAXIS		2
 #define ZAXIS		3
+#define LASTAXIS	ZAXIS		// Highest motor axis in axisTable[]
 #define Y1AXIS		4
 #define Y2AXIS		5
 #define	SAXIS		6
@@ -84,67 +99,904 @@
 #define ZDECEL		128000
 #define ZLIMITHYSTER	2700
 
+//Speed/acceleration characterization (characterize())
+#define CHARSTEPS	3000		// Length of each test move
+#define CHARTOL		2.0		// Allowed step error before calling it lost
+#define CHARMARGIN	0.8		// Fraction of the fastest passing profile to use
+#define CHARMAXSPEED	8000		// Fastest speed tried
+#define CHARSPEEDSTEP	250		// Speed increment
+#define CHARACCELS	4		// Acceleration levels (XYACCEL, x2, x4, x8)
+
+#define CALFILE		"aoguider.cal"	// Saved calibration and motion profiles
+
+//Readiness probes (resetGalil(), motorPower(), characterizeBrake())
+#define RESETTIMEOUT	10.0		// Seconds to wait for the controller after RS
+#define RESETPOLL	0.05		// Seconds between pings while it resets
+#define BRAKETIME	0.25		// Brake engage and release time until characterized
+#define HOLDSETTLE	0.05		// Seconds for hold current to build after SH
+#define BRAKESTEP	0.02		// Delay increment characterizeBrake() tries
+#define BRAKEMAXTIME	0.30		// Longest delay it tries
+#define BRAKEMARGIN	1.5		// Times the shortest working delay to use
+#define BRAKESTEPS	200		// Test move after releasing the brake
+#define BRAKEWATCH	0.1		// Seconds the encoder is watched after MO
+
+//Controller soft limits (softLimits())
+#define SOFTMARGIN	0.5		// Turns past the calibrated ends, into the one-turn back-off
+#define SOFTFWDOFF	2147483647.0	// FL and BL when off (the controller's defaults)
+#define SOFTREVOFF	-2147483648.0
+
+//Move time prediction (profileTime(), waitAxes())
+#define GALILSAMPLE	0.001		// Controller sample period (TM 1000), seconds
+#define KSLAG		4.0		// Step smoothing time constants until done
+#define WAITGUARD	0.02		// Seconds before the predicted end to start polling
+#define WAITMAXSLEEP	0.5		// Longest sleep between checks for an early stop
+
+//Motion supervision (superviseMove())
+#define SUPERRCOUNTS	24		// Encoder counts of following error always allowed
+#define SUPLAG		0.02		// Seconds of smoothing lag allowed at speed
+#define SUPMINCOUNTS	8		// Commanded counts per sample worth checking
+#define SUPSTALLFRAC	0.25		// Encoder/commanded travel ratio that looks stalled
+#define SUPSTALLN	3		// Consecutive stalled samples before aborting
+#define SUPPERIOD	0.05		// Seconds between supervision samples
+#define SUPMAXFAIL	20		// Failed queries in a row before giving up
+
+//Settle detection (settleWait())
+#define SETTLEBAND	2		// Encoder counts the stage may wander and be still
+#define SETTLEWINDOW	0.05		// Seconds it must stay in the band
+#define SETTLEPERIOD	0.002		// Seconds between encoder samples
+#define SETTLETIMEOUT	1.0		// Seconds of watching before giving up
+
+//Position estimator (estimateMove(), estimateStep(), estimateEncoder(), positionEstimate())
+#define ESTDRIFT	0.01		// Bias variance growth at rest, steps squared per second
+#define ESTLOSS		0.0001		// Variance added per step moved (steps lost or gained)
+#define ESTTIMING	0.002		// Seconds a move's start or a reading's time may be off
+#define ESTENCNOISE	0.5		// Encoder noise beyond its resolution, steps
+#define ESTMAXSLIP	0.05		// Most seconds one _RP reading may shift a move's start
+#define ESTDT		0.001		// Seconds the profile velocity is differenced over
+
+//Field-dependent focus map (focusMapFit())
+#define MAXFOCUSSAMPLES	64		// Most (x, y, best focus) samples kept
+#define FOCUSTERMS	6		// 1, x, y, x*x, x*y, y*y
+
+//Autofocus sweep (autofocus())
+#define MAXAFPOINTS	64		// Most focus positions in a sweep
+#define AFBACKLASH	400		// Focus steps of overtravel to take up backlash
+
+//Multi-target acquisition (acquireTargets())
+#define MAXTARGETS	256		// Most targets in one acquisition list
+
+//Detector to stage transform (pixelMapFit(), pixelsToInches())
+#define MAXPIXELSAMPLES	64		// Most (pixel, stage position) samples kept
+#define PIXELTERMS	5		// 1, u, v, u*r*r, v*r*r for each stage axis
+
+//Real-time guide thread (guideStart())
+#define GUIDEPERIOD	0.005		// Seconds between guide thread wakeups
+#define GUIDERING	64		// Corrections that can be queued (power of 2)
+#define GUIDEPRIO	80		// SCHED_FIFO priority of the guide thread
+#define STATBINS	20		// Latency histogram bins, the last one open
+#define STATBINWIDTH	0.0001		// Seconds per histogram bin
+
+//Guiding control law (guideFrame())
+#define GUIDEPI		0		// Laws: proportional plus integral
+#define GUIDEPREDICT	1		// the same, leading the star's drift by a frame
+#define GUIDEKP		0.7		// Proportional gain
+#define GUIDEKI		0.1		// Integral gain, per frame
+#define GUIDEDEADBAND	0.5		// Steps of correction below which none is sent
+#define GUIDESMOOTH	0.2		// Weight of a new frame interval or drift rate
+
+//Background jobs (jobStart())
+#define JOBHOME		1		// homeAxes()
+#define JOBCALIBRATE	2		// calibrate()
+#define JOBSELFCHECK	3		// selfCheck()
+#define JOBDEMO		4		// demo()
+
+//Controller clock and time-tagged moves (clockSync(), scheduleAxes())
+#define CLOCKRATE	1024.0		// Nominal TIME counts per second (TM 1000)
+#define CLOCKPINGS	8		// TIME queries per sync, the fastest one is used
+#define CLOCKHISTORY	16		// Syncs kept for the rate fit
+#define CLOCKMINSPAN	30.0		// Seconds of history before the rate is fitted
+#define CLOCKPERIOD	10.0		// Seconds before scheduleAxes() syncs again
+#define CLOCKJUMP	50.0		// TIME counts off the prediction that mean a reset
+#define TTAGLEAD	20.0		// Fewest TIME counts ahead a move can be scheduled
+
+//Batch scripts (batchLoad(), batchRun())
+#define MAXBATCHCMDS	1024		// Most commands in one script
+#define BATCHLINE	128		// Longest script line
+#define BATCHGUIDER	1		// Operations, indexes into batchVerbs[]
+#define BATCHINIT	2
+#define BATCHHOME	3
+#define BATCHCALIBRATE	4
+#define BATCHMOVE	5
+#define BATCHMOVEREL	6
+#define BATCHFOCUS	7
+#define BATCHFOCUSREL	8
+#define BATCHCONFIG	9
+#define BATCHSTATUS	10
+#define BATCHWAIT	11
+
+//Daemon mode (daemonMain())
+#define MAXCLIENTS	16		// Most clients connected at once
+#define MAXQUEUE	32		// Commands queued per guider (power of 2)
+#define SNAPPERIOD	0.2		// Seconds between status snapshots
+
+//Connection supervision (telnetToGalil(), galilReconnect())
+#define CONNECTTIMEOUT	2.0		// Seconds connect() may take
+#define READTIMEOUT	5.0		// Seconds without a reply that mean the link is down
+#define KEEPIDLE	5		// Idle seconds before TCP keepalive probes start
+#define KEEPINTVL	1		// Seconds between probes
+#define KEEPCNT		3		// Unanswered probes that drop the connection
+#define RECONNECTMIN	0.25		// First reconnect backoff, seconds; it doubles
+#define RECONNECTMAX	8.0		// Longest backoff
+#define RECONNECTLIMIT	30.0		// Seconds one command waits for the link to return
+
+//Transcripts and replay (transcriptOpen(), replayOpen())
+#define REPLAYWINDOW	64		// Exchanges searched ahead for an unexpected command
+#define REPLAYLINE	4096		// Longest transcript line
+
+//Logging (logPrint(), logWriter())
+#define LOGRING		1024		// Records queued for the writer (power of 2)
+#define LOGTEXT		120		// Longest record text
+#define LOGPERIOD	0.05		// Seconds the writer sleeps when the ring is empty
+#define LOGERROR	0		// Levels, most severe first
+#define LOGWARN		1
+#define LOGINFO		2
+#define LOGDEBUG	3
+#define LOGMOTION	0		// Categories, indexing logLevel[]
+#define LOGCONFIG	1
+#define LOGCALIB	2
+#define LOGFOCUS	3
+#define LOGCLOCK	4
+#define LOGIO		5
+#define LOGGUIDE	6
+#define NLOGCATS	7
+
+/*
+	Logs a record if category cat is logging level; otherwise
+	costs one load and compare, with the arguments not evaluated.
+*/
+#define LOG(g, cat, level, ...)	do { if ((level) <= logLevel[cat]) \
+	logPrint(g, cat, level, __VA_ARGS__); } while (0)
+
 //Positions
 #define XCENTER		3.5
 #define YCENTER		7.5
 
+#define GALILLINE	72		// Longest command line built for batched queries
+#define MAXPARAMVALS	3		// Most values a configuration parameter carries
+#define MAXGALILPARAMS	16		// Size of a guider's copy of defaultConfig[]
+#define MAXGUIDERS	4		// Most controllers one process drives
+
+/*
+	Fixed properties of a motor axis; see axisTable[].
+*/
+struct axisDesc {
+	char	letter;			// Galil axis letter
+	char	name;			// Our name for it, for messages
+	long int speed;			// Default motion profile (axisProfile[])
+	long int accel;
+	long int decel;
+	long int maxSteps;		// Travel after homing
+	long int stepsPerTurn;		// Motor steps in 360 degrees
+	long int encPerTurn;		// Encoder pulses per turn, 0 if no encoder
+	double	pitch;			// Lead screw pitch, inches
+	int	brakeOut;		// Digital output that releases the brake, 0 if none
+	long int limitHyster;		// Limit switch hysteresis, steps
+};
+
+/*
+	Speed, acceleration and deceleration used for an axis.
+*/
+struct motionProfile {
+	long int speed;
+	long int accel;
+	long int decel;
+};
+
+/*
+	The last move commanded on an axis, for predicting where it
+	is and when it will finish. See profileTime().
+*/
+struct moveRecord {
+	double	start;			// hostSeconds() when BG was sent
+	double	duration;		// Predicted seconds to complete
+	long int from;			// Commanded position at BG (if known)
+	long int steps;
+	struct motionProfile prof;	// Speed, acceleration, deceleration used
+	double	ks;			// Step smoothing (KS) in effect
+};
+
+/*
+	How the X-Y stage came to rest after the last move; see
+	settleWait().
+*/
+struct settleRecord {
+	double	moveEnd;		// hostSeconds() the motion ended
+	double	settled;		// hostSeconds() the stage was still, 0 if it never was
+	double	residual[LASTAXIS + 1];	// Encoder counts off the commanded position
+	int	axes;			// Axes watched, (1 << axis) bits
+};
+
+/*
+	The host's estimate of where one axis is: the commanded
+	trajectory of its last move (the motion profile, kept in step
+	with _RP readings) plus a bias, the actual position's offset
+	from it, which a one-state Kalman filter fits to the encoder
+	readings. See positionEstimate().
+*/
+struct axisEstimate {
+	double	start;			// hostSeconds() the move began
+	long int from;			// Commanded position then
+	long int steps;
+	struct motionProfile prof;
+	double	ks;
+	int	known;			// from is absolute, not relative to an unknown start
+	double	bias;			// Actual minus commanded position, steps
+	double	var;			// Variance of bias, steps squared
+	double	t;			// hostSeconds() var is for
+};
+
+/*
+	A guider's axis estimates. Writers take lock and bump seq
+	before and after changing them (estimateLock()), so readers
+	need no lock: positionEstimate() copies an axis and retries
+	if seq was odd or changed meanwhile.
+*/
+struct positionEstimator {
+	pthread_mutex_t lock;
+	unsigned int seq;
+	struct axisEstimate axis[LASTAXIS + 1];
+};
+
+/*
+	A measured best focus (mils) at a stage position (inches).
+*/
+struct focusSample {
+	float	x;
+	float	y;
+	long int z;
+};
+
+/*
+	How autofocus() takes its exposures. expose() takes an exposure
+	at focus z (mils) and returns once the shutter has closed, so
+	the focus can move again. readout() then returns the image's
+	focus metric (smaller is better, e.g. FWHM) while the next
+	focus move runs. Both return 1 on success, 0 to abort.
+	pipeHookOpen() fills this in for an external program.
+*/
+struct exposureHook {
+	int	(*expose)(struct exposureHook *, long int);
+	int	(*readout)(struct exposureHook *, double *);
+	FILE	*toCmd;			// Pipe to the external program
+	FILE	*fromCmd;		// Pipe from it
+	int	pid;
+};
+
+/*
+	A star seen at detector pixel (px, py) with the stage at
+	(x, y) inches.
+*/
+struct pixelSample {
+	float	px;
+	float	py;
+	float	x;
+	float	y;
+};
+
+/*
+	One Galil configuration parameter. "names" lists the axis or
+	field letters the values belong to ("ABC", "S" for the vector
+	coordinate system, "0" for the first field of CN). Parameters
+	with names == NULL cannot be read back and are always sent.
+	"known" caches what the controller holds, one bit of
+	knownMask per value.
+*/
+struct galilParam {
+	char	*cmd;				// Galil command, e.g. "SP"
+	char	*names;				// Readback letters, NULL if write-only
+	double	value[MAXPARAMVALS];		// Desired (configured) values
+	double	known[MAXPARAMVALS];		// Last value read back or sent
+	int	knownMask;
+};
+
+/*
+	Latency statistics kept by the guide thread, in seconds.
+*/
+struct latencyStats {
+	long int n;
+	double	sum;
+	double	max;
+	long int hist[STATBINS];	// STATBINWIDTH bins, last one is everything longer
+};
+
+/*
+	A guide correction in motor steps, stamped with hostSeconds()
+	when guideOffset() queued it.
+*/
+struct guideCorrection {
+	double	t;
+	long int dx;
+	long int dy;
+};
+
+/*
+	The guide thread and the single-producer, single-consumer ring
+	of corrections it applies. guideOffset() only writes head, the
+	guide thread only writes tail.
+*/
+struct guideLoop {
+	pthread_t tid;
+	volatile int run;		// Cleared by guideStop()
+	int	cpu;			// CPU it is pinned to, -1 if not pinned
+	int	realtime;		// 1 if it got SCHED_FIFO
+	int	locked;			// 1 if memory is locked (mlockall())
+	struct guideCorrection ring[GUIDERING];
+	unsigned int head;		// Next slot guideOffset() fills
+	unsigned int tail;		// Next slot the guide thread takes
+	long int applied;		// Moves the guide thread started
+	long int dropped;		// Corrections refused because the ring was full
+	struct latencyStats wake;	// Wakeup lateness of the guide thread
+	struct latencyStats latency;	// guideOffset() to BG sent
+};
+
+/*
+	The guiding control law and its statistics; see guideFrame().
+	mode, kp, ki, deadband and ref are settings (guideUser());
+	guideStart() clears the rest. Pixel errors are the star's
+	centroid minus ref, x and y.
+*/
+struct guideControl {
+	int	mode;			// GUIDEPI or GUIDEPREDICT
+	double	kp;			// Proportional gain
+	double	ki;			// Integral gain, per frame
+	double	deadband;		// Steps; smaller corrections aren't sent
+	float	ref[2];			// Pixel the star is held at
+	int	refSet;			// ref given, else the pixel map center
+	double	target[LASTAXIS + 1];	// Where the corrections sent take the stage, steps
+	double	origin[LASTAXIS + 1];	// Where it was when guiding started
+	double	integral[LASTAXIS + 1];	// Sum of the errors, steps
+	double	rate[LASTAXIS + 1];	// Star's drift, steps per second (GUIDEPREDICT)
+	double	drift[LASTAXIS + 1];	// Star's drift since guiding started, steps
+	double	lastT;			// Time of the last frame, 0 before the first
+	double	period;			// Smoothed frame interval, seconds
+	double	busyUntil;		// hostSeconds() the last correction should be done
+	long int frames;
+	long int moves;			// Frames that sent a correction
+	long int held;			// Frames that sent none (deadband, or no time)
+	long int trimmed;		// Corrections cut to finish before the next frame
+	double	errSum[2];		// Pixel errors, x and y
+	double	errSumSq[2];
+	double	errMax;			// Largest error, pixels
+	struct latencyStats latency;	// Frame time to correction queued
+};
+
+/*
+	A log record. seq says whose turn the slot is: the writer's
+	when it is one more than the slot's position, a producer's
+	when it equals it.
+*/
+struct logRecord {
+	unsigned int seq;
+	double	t;			// hostSeconds()
+	struct guider *g;		// NULL if not about one guider
+	int	cat;
+	int	level;
+	char	text[LOGTEXT];
+};
+
+/*
+	The multiple-producer, single-consumer ring of log records
+	and the thread writing them out; see logOpen().
+*/
+struct logRing {
+	struct logRecord rec[LOGRING];
+	unsigned int head;		// Next slot a producer claims
+	unsigned int tail;		// Next slot the writer takes
+	unsigned int dropped;		// Records lost to a full ring
+	FILE	*fp;			// Where records go
+	double	start;			// Record times are relative to this
+	pthread_t tid;
+	volatile int run;		// Cleared by logFlush()
+};
+
+/*
+	A batch script verb; see batchVerbs[].
+*/
+struct batchVerb {
+	char	*name;
+	int	minArgs;
+	int	maxArgs;
+};
+
+/*
+	One validated batch script command. batchLoad() resolves the
+	guider, the axis and config field so batchRun() only acts.
+*/
+struct batchCmd {
+	int	line;			// Script line number
+	int	op;			// BATCHMOVE, ...
+	int	guider;			// Index into guiders[]
+	int	axis;			// config only
+	int	nArgs;
+	double	arg[3];
+	char	text[BATCHLINE];	// The line, for the timing report
+};
+
+/*
+	A daemonMain() client connection. serial changes with every
+	new connection in the slot, so a reply to a client that has
+	gone is not sent to the next one.
+*/
+struct daemonClient {
+	int	fd;			// -1 if the slot is free
+	unsigned int serial;
+	int	guider;			// Where its commands go ("guider n")
+	int	len;			// Bytes in buf
+	char	buf[BATCHLINE + 32];	// Partial request line
+};
+
+/*
+	A queued daemon request and where its reply goes.
+*/
+struct daemonRequest {
+	struct batchCmd cmd;
+	int	client;			// Index into clients[]
+	unsigned int serial;		// clients[client].serial when queued
+	char	tag[16];		// Echoed in the reply
+};
+
+/*
+	What daemonSnapshot() last read from the controller, so status
+	requests don't each cost a controller query.
+*/
+struct guiderSnapshot {
+	pthread_mutex_t lock;
+	double	t;			// hostSeconds() it was read, 0 if never
+	long int step[LASTAXIS + 1];	// Reference position (_RP)
+	long int enc[LASTAXIS + 1];	// Encoder (_TP), 0 for axes without one
+	int	moving;			// (1 << axis) bits
+};
+
+/*
+	A guider's daemon command queue, run in order by
+	daemonWorker(). daemonStop() empties it.
+*/
+struct cmdQueue {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct daemonRequest req[MAXQUEUE];
+	unsigned int head;		// Next slot daemonLine() fills
+	unsigned int tail;		// Next slot daemonWorker() takes
+	int	busy;			// BATCH... op running, 0 if idle
+	struct guiderSnapshot snap;
+};
+
+/*
+	How host time maps to the controller's TIME clock: TIME is
+	time0 + rate * (hostSeconds() - host0). clockSync() keeps it
+	up to date. loaded is set once the #TTAG program is in the
+	controller (clockProgram()).
+*/
+struct clockMap {
+	double	host0;			// hostSeconds() of the latest sync
+	double	time0;			// Controller TIME then
+	double	rate;			// TIME counts per host second
+	double	roundTrip;		// Of the query time0 came from, seconds
+	double	host[CLOCKHISTORY];	// Sync history for the rate fit (ring)
+	double	time[CLOCKHISTORY];
+	int	nSyncs;			// Syncs since the last reset
+	int	loaded;
+};
+
+/*
+	The state of a guider's connection to its controller; see
+	galilReconnect().
+*/
+struct galilLink {
+	double	downSince;		// hostSeconds() it was lost, 0 if up
+	double	retryAt;		// Earliest next connect attempt
+	double	backoff;		// Seconds to wait after the next failure
+	int	resyncing;		// galilResync() is running; don't reconnect
+	int	connecting;		// galilReconnect() is trying, without ioLock
+	int	resetting;		// resetGalil() is waiting out an RS; don't resync
+	int	drops;			// Times the connection was lost
+	int	reconnects;		// Times it was restored
+	int	resets;			// Reconnects that found the controller reset
+};
+
+/*
+	A guider's transcript of controller traffic, if recording; see
+	transcriptOpen().
+*/
+struct transcript {
+	FILE	*fp;			// NULL if not recording
+	char	file[128];
+	double	start;			// hostSeconds() times are relative to this
+	long int nSends;		// Commands recorded
+};
+
+/*
+	One recorded exchange: what was sent in one write and
+	everything read back before the next one.
+*/
+struct replayEntry {
+	char	*cmd;
+	int	cmdLen;
+	char	*reply;
+	int	replyLen;
+	double	latency;		// Seconds from the command to the first reply
+};
+
+/*
+	A transcript being played back as a controller; see
+	replayOpen().
+*/
+struct replay {
+	char	file[128];
+	int	fd;			// replayThread()'s end of the socket pair
+	double	speed;			// Latency divisor, 0 for no latency
+	struct replayEntry *e;
+	int	n;
+	int	next;			// The entry expected next
+	long int inOrder;		// Commands that matched the next entry
+	long int skipped;		// Entries passed over to find a match
+	long int reused;		// Commands answered from an earlier entry
+	long int unknown;		// Commands answered "?"
+	double	recorded;		// Recorded latency of the replies given
+	double	start;			// hostSeconds() when opened
+	struct replay *link;		// transcriptReport()'s list
+};
+
+/*
+	A long operation running in the background; see jobStart().
+	phase, step and nSteps are for progress reports only.
+*/
+struct guiderJob {
+	pthread_t tid;			// Set by jobThread() itself
+	volatile int active;		// Running
+	volatile int cancel;		// jobCancel() asked it to stop
+	int	which;			// JOBHOME, JOBCALIBRATE, ...
+	char	phase[64];		// What it's doing now (jobPhase())
+	int	step;			// Progress, step of nSteps
+	int	nSteps;
+	double	start;			// hostSeconds() when it started
+	int	result;			// selfCheck()'s PASS or FAIL
+};
+
+/*
+	Everything known about one guider and its Galil controller.
+	Every LIBRARY function takes one of these first, so one process
+	can drive several guiders. guiderInit() sets it up.
+*/
+struct guider {
+	char	name[16];			// For messages, e.g. "G1"
+	char	ipaddress[80];
+	char	calFile[128];			// Calibration file (CALFILE)
+	int	galilfd;			// file descriptor to Galil, -1 while disconnected
+	struct galilLink link;			// galilReconnect()
+	struct transcript log;			// transcriptOpen()
+	pthread_mutex_t ioLock;			// One command/reply exchange at a time
+	int	ioDepth;			// galilLock() nesting, guarded by ioLock
+	int	isCalibrated;
+	long int homeTime;			// Galil TIME that axes were homed
+	long int encOffset[LASTAXIS + 1];	// Encoder values at home position
+	long int encMin[LASTAXIS + 1];		// Minimum legal encoder value
+	float	encPerStep[LASTAXIS + 1];	// Encoder pulses per motor step
+	float	maxInches[LASTAXIS + 1];	// Calibrated travel
+	long int stepMin[LASTAXIS + 1];		// Calibrated reverse end of travel, motor steps
+	int	softLimited;			// Axes softLimits() set FL and BL on, (1 << axis) bits
+	int	sAxisStatus;			// cylinder() SAXIS, which has no sensor
+	int	ledStatus;			// led()
+	int	ledInOutStatus;			// ledInOut()
+	int	stalledAxes;			// Axes superviseMove() aborted, (1 << axis) bits
+	struct moveRecord axisMove[LASTAXIS + 1];	// Last move on each axis (moveOneAxis())
+	struct settleRecord settle;		// settleWait()
+	struct positionEstimator estimate;	// positionEstimate()
+	long int cmdPosition[LASTAXIS + 1];	// Host copy of each axis's commanded position
+	int	cmdKnown;			// Axes whose cmdPosition is valid, (1 << axis) bits
+	int	poweredAxes;			// Axes motorPower() turned on, (1 << axis) bits
+	double	brakeEngage[LASTAXIS + 1];	// Seconds a brake takes to hold (characterizeBrake())
+	double	brakeRelease[LASTAXIS + 1];	// and to let go
+	struct motionProfile axisProfile[LASTAXIS + 1];	// Starts as axisTable[]'s
+	struct galilParam galilConfig[MAXGALILPARAMS];	// See defaultConfig[]
+	struct focusSample focusSamples[MAXFOCUSSAMPLES];
+	int	nFocusSamples;
+	double	focusMap[FOCUSTERMS];		// Fitted focus surface coefficients
+	int	focusMapTerms;			// Terms fitted, 0 if there's no map
+	struct pixelSample pixelSamples[MAXPIXELSAMPLES];
+	int	nPixelSamples;
+	double	pixelMapX[PIXELTERMS];		// Fitted pixel to stage X coefficients
+	double	pixelMapY[PIXELTERMS];		// Fitted pixel to stage Y coefficients
+	double	pixelMapCenter[3];		// Pixel center and scale the map is fitted in
+	int	pixelMapTerms;			// Terms fitted, 0 if there's no map
+	struct guideLoop guide;			// guideStart()
+	struct guideControl control;		// guideFrame()
+	struct guiderJob job;			// jobStart()
+	struct clockMap clock;			// clockSync()
+	struct cmdQueue queue;			// daemonMain()
+};
+
+/*
+	A one-key command for one guider, run in its own thread by
+	cmdLoop() when all guiders are selected.
+*/
+struct guiderCmd {
+	struct guider *g;
+	int	cmd;
+};
+
 // Function prototypes
-void	backOff();
-void	demo();
+void	backOff(struct guider *);
+void	beginAxes(struct guider *, int);
+void	demo(struct guider *);
 void	fakeHome(void);
-void	askGalil(char *, char *, int);
-int	askGalilForInt(char *);
-long int askGalilForLong(char *);
-int	limitSwitch(int);
-int	brake(int, int);
-void	calibrate(void);
-void	centerField(void);
+int	absSteps(struct guider *, float, float, long int, long int *, long int *, long int *);
+int	acquireTargets(struct guider *, int, float *, float *, int *, int (*)(int, float, float));
+void	applyConfig(struct guider *);
+long int autofocus(struct guider *, long int, long int, int, struct exposureHook *);
+void	autofocusUser(struct guider *);
+void	askGalil(struct guider *, char *, char *, int);
+int	askGalilForInt(struct guider *, char *);
+long int askGalilForLong(struct guider *, char *);
+int	askGalilForValues(struct guider *, char **, int, double *);
+int	axesMoving(struct guider *, int);
+int	batchExec(struct batchCmd *, int *);
+int	batchLoad(FILE *, char *, struct batchCmd *, int);
+int	batchOpen(char *, struct batchCmd *, int);
+char	*batchParse(char *, struct batchCmd *, int *);
+int	batchRun(struct batchCmd *, int);
+int	batchSettle(struct guider *, int *);
+int	limitSwitch(struct guider *, int);
+int	brake(struct guider *, int, int);
+void	calibrate(struct guider *);
+int	characterize(struct guider *, int);
+int	characterizeBrake(struct guider *, int);
+int	characterizeRun(struct guider *, int, long int, long int, long int, double *);
+void	centerField(struct guider *);
+int	clockProgram(struct guider *);
+int	clockSync(struct guider *);
 void	cmdLoop(void);
-int	creepToLimits(int, int, int);
-int	cylinder(int, int);
+int	creepToLimits(struct guider *, int, int, int);
+int	consoleExpose(struct exposureHook *, long int);
+int	consoleReadout(struct exposureHook *, double *);
+int	cylinder(struct guider *, int, int);
+void	daemonClose(int);
+void	daemonLine(int, char *);
+int	daemonMain(char *);
+void	daemonReply(int, unsigned int, char *, char *);
+void	*daemonSnapshot(void *);
+void	daemonStatus(struct guider *, char *);
+void	daemonStop(struct guider *);
+void	*daemonWorker(void *);
 void	debug(void);
-long int encPosition(int);
-int	fieldCam(void);
-int	fieldLens(void);
-void	focus(int);
-void	focusAbs(long int);
-void	focusRel(long int);
+long int encPosition(struct guider *, int);
+long int encoderTarget(struct guider *, int, float);
+void	estimateAge(struct axisEstimate *, double);
+void	estimateEncoder(struct guider *, int, double, long int);
+void	estimateLock(struct guider *);
+void	estimateMove(struct guider *, int);
+double	estimatePredict(struct axisEstimate *, double, double *);
+void	estimateReset(struct guider *);
+void	estimateStep(struct guider *, int, double, long int);
+void	estimateUnlock(struct guider *);
+int	fieldCam(struct guider *);
+int	fieldLens(struct guider *);
+struct galilParam *findParam(struct guider *, char *);
+int	galilConnect(struct guider *);
+void	galilDrop(struct guider *, char *);
+void	galilLock(struct guider *);
+int	galilReconnect(struct guider *);
+int	galilRecv(struct guider *, char *, int);
+void	galilResync(struct guider *);
+int	galilSend(struct guider *, char *, int);
+double	galilToHost(struct guider *, double);
+void	galilUnlock(struct guider *);
+void	focus(struct guider *, int);
+void	focusAbs(struct guider *, long int);
+int	focusMapAdd(struct guider *, float, float, long int);
+void	focusMapClear(struct guider *);
+int	focusMapFit(struct guider *);
+void	focusMapUser(struct guider *);
+int	focusMapZ(struct guider *, float, float, long int *);
+int	focusOffset(struct guider *, long int, long int *);
+long int focusPosition(struct guider *);
+void	focusRel(struct guider *, long int);
+void	forgetConfig(struct guider *);
 int	getKey(void);
+char	*getLine(char *, int);
+int	guideFrame(struct guider *, double, float, float);
+int	guideOffset(struct guider *, long int, long int);
+int	guideStart(struct guider *, int);
+void	guideStop(struct guider *);
+void	*guideThread(void *);
+void	guideUser(struct guider *);
+void	guiderCommand(struct guider *, int);
+void	guiderInit(struct guider *, char *, char *);
+void	*guiderThread(void *);
 void	help(void);
-void	homeAxes(void);
-float	inchPosition(int);
-void	initGuider(void);
-int	isHomed(void);
-int	isMoving(int);
-int	led(int);
-int	ledInOut(int);
-int	motorPower(int, int);
-void	move(int);
-int	moveAbs(float, float);
-void	moveOneAxis(int, int, int);
-void	moveRel(long int, long int);
-void	passthru(void);
-void	resetGalil(void);
-int	shCam(void);
-int	selfCheck();
+void	homeAxes(struct guider *);
+double	hostSeconds(void);
+double	hostToGalil(struct guider *, double);
+float	inchPosition(struct guider *, int);
+void	inchesToEncoder(struct guider *, int, float *, float *, long int *, long int *);
+void	initGuider(struct guider *);
+int	isHomed(struct guider *);
+int	isMoving(struct guider *, int);
+void	jobCancel(struct guider *);
+int	jobPhase(struct guider *, char *, int, int);
+void	jobPrint(struct guider *);
+int	jobStart(struct guider *, int);
+void	*jobThread(void *);
+int	led(struct guider *, int);
+int	loadCalibration(struct guider *, char *);
+int	ledInOut(struct guider *, int);
+void	logFlush(void);
+int	logOpen(char *, char *);
+void	logPrint(struct guider *, int, int, char *, ...);
+void	*logWriter(void *);
+int	motorPower(struct guider *, int, int);
+void	move(struct guider *, int);
+int	moveAbs(struct guider *, float, float);
+int	moveAbsXYZ(struct guider *, float, float, long int);
+double	moveDuration(struct guider *, int, long int);
+double	moveETA(struct guider *, int);
+void	moveOneAxis(struct guider *, int, int, int);
+void	moveRel(struct guider *, long int, long int);
+void	moveRelXYZ(struct guider *, long int, long int, long int);
+void	noteBegin(struct guider *, int, double);
+void	passthru(struct guider *);
+int	pixelMapAdd(struct guider *, float, float, float, float);
+void	pixelMapClear(struct guider *);
+int	pixelMapFit(struct guider *);
+void	pixelMapUser(struct guider *);
+void	pixelsToInches(struct guider *, int, float *, float *, float *, float *);
+void	pipeHookClose(struct exposureHook *);
+int	pipeHookExpose(struct exposureHook *, long int);
+int	pipeHookOpen(struct exposureHook *, char *);
+int	pipeHookReadout(struct exposureHook *, double *);
+double	planTargets(struct guider *, int, float *, float *, int *);
+int	positionEstimate(struct guider *, int, double, double *, double *);
+double	predictPosition(struct guider *, int, double);
+void	prepareMove(struct guider *, int, int, int);
+double	profileDistance(long int, struct motionProfile *, double, double);
+double	profileTime(long int, struct motionProfile *, double);
+int	readGalil(struct guider *, char *, int, int);
+int	replayFind(struct replay *, char *, int);
+int	replayLoad(struct replay *);
+int	replayOpen(char *);
+void	*replayThread(void *);
+void	resetGalil(struct guider *);
+int	saveCalibration(struct guider *, char *);
+int	scheduleAxes(struct guider *, double, int, int, int);
+int	scheduleMoveRel(struct guider *, double, long int, long int, int, int);
+void	scheduleUser(struct guider *);
+int	shCam(struct guider *);
+int	selfCheck(struct guider *);
+int	sendParam(struct guider *, struct galilParam *, int, double);
+int	setGalilParam(struct guider *, char *, int, long int);
 void	setMode(int);
-int	smallAp(void);
-void	statusPrint(void);
-long int stepPosition(int);
-void	stopMotors(void);
-char	*tellGalil(char *);
+int	settleWait(struct guider *, int, double);
+int	smallAp(struct guider *);
+int	softLimitCheck(struct guider *, int, long int);
+void	softLimits(struct guider *, int);
+int	solveLinear(int, double *, double *);
+void	statusPrint(struct guider *);
+int	startRelXYZ(struct guider *, long int, long int, long int);
+void	statAdd(struct latencyStats *, double);
+void	statPrint(char *, struct latencyStats *);
+long int stepPosition(struct guider *, int);
+int	superviseMove(struct guider *, int);
+void	targetListUser(struct guider *);
+double	targetTime(struct guider *, double, double, double);
+int	targetVisitUser(int, float, float);
+void	stopMotors(struct guider *);
+int	tellGalil(struct guider *, char *);
 int	telnetToGalil(char *);
-void	testFunction(void);
+void	testFunction(struct guider *);
+void	transcriptAdd(struct guider *, int, char *, int);
+int	transcriptOpen(struct guider *, char *);
+void	transcriptReport(void);
+int	transformCheck(struct guider *);
+int	waitAxes(struct guider *, int);
+
+/*
+	Run in controller thread 1 by scheduleAxes(). Sleeps (WT, in
+	milliseconds, a little longer than TIME counts) until just
+	before ttime, spins on TIME for the rest, then begins the axes
+	in ttbg (1 A, 2 B, 4 C) and sets output ttout (if not 0) to
+	ttval. ttfired records when that happened.
+*/
+char *ttagProgram[] = {
+	"#TTAG",
+	"ttw=(ttime-TIME-20)*0.95",
+	"IF (ttw>0);WT ttw;ENDIF",
+	"#TTSPIN",
+	"JP #TTSPIN,(TIME<ttime)",
+	"IF (ttbg&1);BGA;ENDIF",
+	"IF (ttbg&2);BGB;ENDIF",
+	"IF (ttbg&4);BGC;ENDIF",
+	"IF (ttout>0);OB ttout,ttval;ENDIF",
+	"ttfired=TIME",
+	"ttdone=1",
+	"EN",
+	NULL
+};
+
+/*
+	Batch script verbs, indexed by BATCHGUIDER .. BATCHWAIT, with
+	the number of arguments each takes. See batchParse().
+*/
+struct batchVerb batchVerbs[] = {
+	{NULL, 0, 0},
+	{"guider", 1, 1},		// n (1 ..), the guider later lines go to
+	{"init", 0, 0},
+	{"home", 0, 0},
+	{"calibrate", 0, 0},
+	{"move", 2, 3},			// x y inches [focus mils]
+	{"moverel", 2, 3},		// dx dy [dz] steps
+	{"focus", 1, 1},		// mils
+	{"focusrel", 1, 1},		// steps
+	{"config", 3, 3},		// axis speed|accel|decel value
+	{"status", 0, 0},
+	{"wait", 0, 1},			// [seconds], no argument waits for motion
+	{NULL, 0, 0}
+};
 
 /* Globals */
-int galilfd = -1;			// file descriptor to Galil
-int debugFlag = 0;			// Turn on debug print statements
-int isCalibrated = 0;
-long int homeTime = -9999;		// Galil TIME that axes were homed
-long int xEncOffset, yEncOffset;	// Encoder values at home position
-long int xEncMin, yEncMin;		// Minimum legal encoder value
-float xEncPerStep, yEncPerStep;		// Encoder pulses per motor step
-float xMaxInches, yMaxInches, zMaxInches;
+int logLevel[NLOGCATS] = {LOGWARN, LOGWARN, LOGWARN, LOGWARN, LOGWARN, LOGWARN, LOGWARN};
+int logBase = LOGWARN;			// Level debug() returns the categories to
+struct logRing logRing;			// logPrint() to logWriter()
+char *logCategories[] = {"motion", "config", "calib", "focus", "clock", "io", "guide"};
+char *logLevels[] = {"error", "warn", "info", "debug"};
+struct guider guiders[MAXGUIDERS];	// The guiders main() connected to
+int nGuiders = 0;
+int currentGuider = 0;			// cmdLoop() commands go to this one (-1: all)
+struct daemonClient clients[MAXCLIENTS];	// daemonMain()'s connections
+pthread_mutex_t clientLock = PTHREAD_MUTEX_INITIALIZER;	// clients[] against worker replies
+struct replay *replays = NULL;		// Transcripts replayOpen() is playing
+
+/*
+	The motor axes, indexed by XAXIS .. LASTAXIS (entry 0 is
+	unused). Everything axis-specific comes from here, so adding
+	an axis means adding a row and raising LASTAXIS. guiderInit()
+	copies the speeds to the guider's axisProfile[]; moveOneAxis()
+	uses the acceleration and deceleration, moveRel() and focusRel()
+	the speed, and characterize() replaces the X and Y profiles with
+	measured values saved in the guider's calibration file.
+*/
+struct axisDesc axisTable[] = {
+	{0},
+	{'A', 'X', XYSPEED, XYACCEL, XYDECEL, XMAXSTEPS, XSTEPSPERTURN,
+		XENCPULSPERTURN, XSCREWPITCH, 1, XYLIMITHYSTER},
+	{'B', 'Y', XYSPEED, XYACCEL, XYDECEL, YMAXSTEPS, YSTEPSPERTURN,
+		YENCPULSPERTURN, YSCREWPITCH, 2, XYLIMITHYSTER},
+	{'C', 'Z', ZSPEED, ZACCEL, ZDECEL, ZMAXSTEPS, ZSTEPSPERTURN,
+		0, ZSCREWPITCH, 0, ZLIMITHYSTER}
+};
+
+/*
+	Controller configuration applied by initGuider(). Edit this
+	table rather than adding tellGalil() calls. guiderInit() copies
+	it to the guider's galilConfig[], whose SP, AC and DC entries
+	also cache the per-axis values moveOneAxis() last sent so
+	unchanged values are not sent again.
+*/
+struct galilParam defaultConfig[] = {
+	{"MT", "ABC", {-2, -2, -2}, {0}, 0},		// Stepper motors
+	{"CN", "0", {1}, {0}, 0},			// Limit switch configuration
+	{"SP", "ABC", {200, 200, 1000}, {0}, 0},	// Slow speed
+	{"AC", "ABC", {256000, 256000, 256000}, {0}, 0},	// These are defaults from Galil
+	{"DC", "ABC", {256000, 256000, 256000}, {0}, 0},
+	{"SD", "ABC", {256000, 256000, 256000}, {0}, 0},	// Deceleration after hitting a limit switch
+	{"VS", "S", {200}, {0}, 0},			// Slow vector speed
+	{"VA", "S", {256000}, {0}, 0},			// Default vector values
+	{"VD", "S", {256000}, {0}, 0},
+	{"KS", "ABC", {3, 3, 3}, {0}, 0},		// Step motor smoothing (not too sensitive)
+	{"FL", "ABC", {SOFTFWDOFF, SOFTFWDOFF, SOFTFWDOFF}, {0}, 0},	// Soft limits, off until
+	{"BL", "ABC", {SOFTREVOFF, SOFTREVOFF, SOFTREVOFF}, {0}, 0},	// calibrated (softLimits())
+	{"CAS", NULL, {0}, {0}, 0},			// S coordinate system for vector motion
+	{NULL, NULL, {0}, {0}, 0}
+};
 
 /*=================================================================*/
 int main(argv, argc)
@@ -152,17 +1004,77 @@ int argv;
 char *argc[];
 {
 
-	char ipaddress[80];
-
-	if (argv == 2) {
-		strcpy(ipaddress, argc[1]);
-	} else {
-		strcpy(ipaddress, GALILIP);
+	static struct batchCmd cmds[MAXBATCHCMDS];
+	int i, first, nCmds, status;
+	char calFile[128], *script, *sockPath, *record, *logFile, *verbose;
+	struct guider *g;
+
+	// aoguider [-b script | -s socket] [-t transcript] [-l logfile] [-v categories] [ipaddress ...],
+	// one guider per controller
+	script = sockPath = record = logFile = verbose = NULL;
+	for (first = 1; first < argv - 1 && argc[first][0] == '-'; first += 2) {
+		if (strcmp(argc[first], "-b") == 0) {
+			script = argc[first + 1];
+		} else if (strcmp(argc[first], "-s") == 0) {
+			sockPath = argc[first + 1];
+		} else if (strcmp(argc[first], "-t") == 0) {
+			record = argc[first + 1];
+		} else if (strcmp(argc[first], "-l") == 0) {
+			logFile = argc[first + 1];
+		} else if (strcmp(argc[first], "-v") == 0) {
+			verbose = argc[first + 1];
+		} else {
+			printf("usage: aoguider [-b script | -s socket] [-t transcript] [-l logfile] [-v category,...|all]\n"
+				"\t[ipaddress[:port] | replay:transcript[@speed] ...]\n");
+			return(1);
+		}
 	}
-	galilfd = telnetToGalil(ipaddress);
-	if (galilfd < 0) {
-		printf("Connection to %s failed (return code %d)\n", GALILIP, galilfd);
-		return(0);
+	if (!logOpen(logFile, verbose)) {
+		printf("can't write %s\n", logFile);
+		return(1);
+	}
+	for (i = first; i < argv && nGuiders < MAXGUIDERS; i++) {
+		if (argv - first == 1) {
+			strcpy(calFile, CALFILE);
+		} else {
+			sprintf(calFile, "aoguider-%.64s.cal", argc[i]);
+			if (strchr(calFile, ':')) {	// ip:port, not a Windows file name
+				*strchr(calFile, ':') = '-';
+			}
+		}
+		guiderInit(&guiders[nGuiders++], argc[i], calFile);
+	}
+	if (nGuiders == 0) {
+		guiderInit(&guiders[nGuiders++], GALILIP, CALFILE);
+	}
+	nCmds = 0;
+	if (script && (nCmds = batchOpen(script, cmds, MAXBATCHCMDS)) < 0) {
+		return(1);
+	}
+	for (i = 0; i < nGuiders; i++) {
+		g = &guiders[i];
+		sprintf(g->name, "G%d", i + 1);
+		if ((status = galilConnect(g)) < 0) {
+			printf("Connection to %s failed (return code %d)\n", g->ipaddress, status);
+			return(0);
+		}
+		loadCalibration(g, g->calFile);	// Motion profiles, if characterized
+		if (record) {
+			if (nGuiders == 1) {
+				snprintf(calFile, sizeof(calFile), "%s", record);
+			} else {
+				snprintf(calFile, sizeof(calFile), "%s-%s", record, g->name);
+			}
+			if (!transcriptOpen(g, calFile)) {
+				printf("can't write %s\n", calFile);
+			}
+		}
+	}
+	if (script) {
+		return(batchRun(cmds, nCmds));
+	}
+	if (sockPath) {
+		return(daemonMain(sockPath));
 	}
 	for (;;) {
 		cmdLoop();
@@ -172,1705 +1084,6877 @@ char *argc[];
 
 /*-------------------------------------------------------------------
 
-	askGalil(cmd, buf, n);  (LIBRARY)
-
-	askGalil sends a command string (cmd) to the Galil controller
-	and returns the controller's reply in buf. n is the available
-	space in buf.  The global variable galilfd must already be a
-	valid socket to the Galil controller.
+	int absSteps(g, x, y, z, xSteps, ySteps, zSteps) (LIBRARY)
 
-	cmd is a pointer to a NUL terminated string containing the
-	Galil command. For example, "TPA" (Galil command "Tell
-	Position, A axis. askGalil adds a carriage return ('\r') to
-	the command sent to the Galil. The reply string from the Galil
-	is returned in buf.
+	absSteps computes the relative motor steps that take the stage
+	from where it is now to (x, y) inches and the focus to z mils
+	(see moveAbs() and focusAbs()); a negative z gives zSteps = 0.
+	Returns 1 on success, 0 if not calibrated or out of range.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-void askGalil(cmd, buf, n)
-char *cmd, *buf;
-int n;
+int absSteps(g, x, y, z, xSteps, ySteps, zSteps)
+struct guider *g;
+float x, y;
+long int z, *xSteps, *ySteps, *zSteps;
 {
 
-	char cmdstr[80];
-
-	strcpy(cmdstr, cmd);
-	strcat(cmdstr, "\r");
-	write(galilfd, cmdstr, strlen(cmdstr));
-	memset(buf, 0, n);
-	read(galilfd, buf, n);
-
-}
-
-/*-------------------------------------------------------------------
-
-	int askGalilForInt(cmd); (LIBRARY)
+	long xEncOld, yEncOld, xEncNew, yEncNew, temp;
+	float xPulsPerStep, yPulsPerStep;
 
-	askGalilForInt sends the command string (cmd) to the Galil
-	controller and returns the Galil reply as an integer.
+	if (!g->isCalibrated) {
+		LOG(g, LOGMOTION, LOGDEBUG, "absSteps: not calibrated");
+		return(0);
+	}
 
-	cmd is a pointer to a NUL terminated string containing a
-	Galil command that returns an integer (as do most commands).
+	if (x > g->maxInches[XAXIS] || x < 0.0) {
+		return(0);
+	}
+	if (y > g->maxInches[YAXIS] || y < 0.0) {
+		return(0);
+	}
+	*zSteps = 0;
+	if (z >= 0 && !focusOffset(g, z, zSteps)) {
+		return(0);
+	}
+	xPulsPerStep = (float) axisTable[XAXIS].encPerTurn / (float) axisTable[XAXIS].stepsPerTurn;
+	yPulsPerStep = (float) axisTable[YAXIS].encPerTurn / (float) axisTable[YAXIS].stepsPerTurn;
 
-Checked 2012-04-30
--------------------------------------------------------------------*/
+	// save current encoder position
+	xEncOld = encPosition(g, XAXIS);
+	yEncOld = encPosition(g, YAXIS);
 
-int askGalilForInt(cmd)
-char *cmd;
-{
+	// compute target encoder position
+	xEncNew = encoderTarget(g, XAXIS, x);
+	yEncNew = encoderTarget(g, YAXIS, y);
 
-	char buf[80];
+	if ((xEncNew > g->encOffset[XAXIS]) || (xEncNew < g->encMin[XAXIS])) {
+		LOG(g, LOGMOTION, LOGINFO, "X target out of range (encoder %ld)", xEncNew);
+		return(0);
+	}
+	if ((yEncNew > g->encOffset[YAXIS]) || (yEncNew < g->encMin[YAXIS])) {
+		LOG(g, LOGMOTION, LOGINFO, "Y target out of range (encoder %ld)", yEncNew);
+		return(0);
+	}
 
-	askGalil(cmd, buf, 80);
-	return(atoi(buf));
+	// compute motor steps
+	temp = (xEncNew - xEncOld);
+	*xSteps = (temp >= 0) ? (long int) (((double) (temp + 0.5)) / xPulsPerStep) : (long int) (((double) (temp - 0.5)) / xPulsPerStep);
+	temp = (yEncNew - yEncOld);
+	*ySteps = (temp >= 0) ? (long int) (((double) (temp + 0.5)) / yPulsPerStep) : (long int) (((double) (temp - 0.5)) / yPulsPerStep);
+	return(1);
 
 }
 
 /*-------------------------------------------------------------------
 
-	long int askGalilForLong(cmd); (LIBRARY)
+	int acquireTargets(g, n, x, y, order, visit) (LIBRARY)
 
-	askGalilForLong sends the command string (cmd) to the Galil
-	controller and returns the Galil reply as a long integer.
+	acquireTargets visits n stage positions (x[i], y[i]) inches in
+	the order planTargets() finds quickest, calling visit(i, x, y)
+	at each one once the stage has stopped (e.g. to take an
+	exposure). visit may be NULL; if it returns 0 the list is
+	abandoned. So is the rest of the list if superviseMove()
+	fails, without visiting the target it was moving to. The visiting order is returned in order[] if it
+	is not NULL.
 
-	cmd is a pointer to a NUL terminated string containing a
-	Galil command that returns an integer (as do most commands).
+	The motors stay powered, with the brakes released, between
+	targets and are only powered down at the end. If a focus map
+	exists the focus follows it, as in moveAbs().
+
+	Returns the number of targets visited.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-long int askGalilForLong(cmd)
-char *cmd;
+int acquireTargets(g, n, x, y, order, visit)
+struct guider *g;
+int n;
+float *x, *y;
+int *order;
+int (*visit)(int, float, float);
 {
 
-	char buf[80];
+	int i, k, axes, visited, *plan;
+	long int xSteps, ySteps, zSteps, z;
 
-	askGalil(cmd, buf, 80);
-	return(atol(buf));
+	if (n <= 0 || n > MAXTARGETS || !g->isCalibrated) {
+		return(0);
+	}
+	if ((plan = (int *) malloc(n * sizeof(int))) == NULL) {
+		return(0);
+	}
+	planTargets(g, n, x, y, plan);
+
+	axes = 0;
+	visited = 0;
+	for (k = 0; k < n; k++) {
+		i = plan[k];
+		if (!focusMapZ(g, x[i], y[i], &z)) {
+			z = -1L;
+		}
+		if (!absSteps(g, x[i], y[i], z, &xSteps, &ySteps, &zSteps)) {
+			continue;		// Out of range, skip it
+		}
+		axes |= startRelXYZ(g, xSteps, ySteps, zSteps);
+		if (superviseMove(g, axes) == FAIL) {
+			LOG(g, LOGMOTION, LOGWARN, "target %d not reached, tour abandoned", i);
+			break;			// Stalled; the stage isn't at x[i], y[i]
+		}
+		visited++;
+		if (visit && !visit(i, x[i], y[i])) {
+			break;
+		}
+	}
+
+	for (i = XAXIS; i <= LASTAXIS; i++) {
+		if (axes & (1 << i)) {
+			motorPower(g, i, OFF);
+		}
+	}
+	if (order) {
+		memcpy(order, plan, n * sizeof(int));
+	}
+	free(plan);
+	return(visited);
 
 }
 
 /*-------------------------------------------------------------------
 
-	int limitSwitch(axis) (LIBRARY)
+	void applyConfig(struct guider *g); (LIBRARY)
 
-	limitSwitch returns an integer with bits 0 and 1 indicating
-	the reverse and forward limit switch states respectively.
-	If the limit is engaged, the bit is 1 and motion is diabled
-	in that direction. If the limit is not engaged the bit is 0.
+	applyConfig brings the controller in line with the galilConfig[]
+	table. It reads back every readable parameter in one batched
+	query and then sends only the values that differ from the
+	table. Write-only entries (names == NULL) are always sent.
+
+	If the readback fails the cache is cleared and every value is
+	sent, which is what initGuider() used to do unconditionally.
 
-Checked 2012-04-26
 -------------------------------------------------------------------*/
-int limitSwitch(axis)
+void applyConfig(g)
+struct guider *g;
 {
 
-	int temp, limitVal;
-
-	switch (axis) {
-
-		case XAXIS:
-			temp = askGalilForInt("TSA");
-			break;
-
-		case YAXIS:
-			temp = askGalilForInt("TSB");
-			break;
-
-		case ZAXIS:
-			temp = askGalilForInt("TSC");
-			break;
+	char *operands[64], names[64][8];
+	double vals[64];
+	int j, n, nsent;
+	struct galilParam *p;
 
-		default:
-			return(BADAXIS);
+	// Build the readback list, e.g. "_SPA", "_VSS", "_CN0"
+	n = 0;
+	for (p = g->galilConfig; p->cmd; p++) {
+		if (p->names == NULL) {
+			continue;
+		}
+		for (j = 0; p->names[j] && n < 64; j++) {
+			sprintf(names[n], "_%s%c", p->cmd, p->names[j]);
+			operands[n] = names[n];
+			n++;
+		}
 	}
 
-
-	limitVal = 0;
-	if ((temp>>2 & 0x01) == 0) {			// Reverse limit
-		limitVal |= 0x01;
+	if (askGalilForValues(g, operands, n, vals) == n) {
+		n = 0;
+		for (p = g->galilConfig; p->cmd; p++) {
+			if (p->names == NULL) {
+				continue;
+			}
+			for (j = 0; p->names[j]; j++) {
+				p->known[j] = vals[n++];
+				p->knownMask |= (1 << j);
+			}
+		}
+	} else {
+		forgetConfig(g);
 	}
-	if ((temp>>3 & 0x01) == 0) {			// Forward limit
-		limitVal |= 0x02;
+
+	nsent = 0;
+	for (p = g->galilConfig; p->cmd; p++) {
+		if (p->names == NULL) {
+			tellGalil(g, p->cmd);
+			nsent++;
+			continue;
+		}
+		for (j = 0; p->names[j]; j++) {
+			nsent += sendParam(g, p, j, p->value[j]);
+		}
 	}
-	return(limitVal);
+	LOG(g, LOGCONFIG, LOGDEBUG, "%d config values sent", nsent);
 
 }
 
 /*-------------------------------------------------------------------
 
-	void backOff(); (LIBRARY)
+	long int autofocus(g, zStart, zEnd, nPoints, hook) (LIBRARY)
 
-	backOff clears a limit switch situation by searching for
-	engaged limits and backing away a few steps.
+	autofocus sweeps the focus from zStart to zEnd (thousandths of
+	an inch, see focusAbs()) in nPoints steps, takes an exposure
+	at each one through hook, fits a parabola to the focus metric
+	and moves to the best focus.
+
+	The positions are planned before starting and the focus motor
+	stays powered for the whole sweep. As soon as hook->expose()
+	reports the shutter closed the move to the next position is
+	started, and hook->readout() runs while the focus moves, so
+	each step costs max(move, readout) rather than the sum. Every
+	position, including the final one, is approached from the
+	same direction with AFBACKLASH steps of overtravel.
+
+	If the metric does not have a minimum inside the sweep, the
+	best sampled position is used. Returns the chosen focus, or
+	-1 if the sweep could not be done or an exposure failed.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-void backOff()
+long int autofocus(g, zStart, zEnd, nPoints, hook)
+struct guider *g;
+long int zStart, zEnd;
+int nPoints;
+struct exposureHook *hook;
 {
 
-	int testVal;
+	int i, best, ok;
+	long int z[MAXAFPOINTS], steps, bestZ, dir;
+	double metric[MAXAFPOINTS], a[9], b[3], zc, t;
 
-	if ((testVal = limitSwitch(XAXIS))) {
-		if (testVal & 0x01) {
-			creepToLimits(XAXIS, 2000, XYSPEED);
-		} else if (testVal & 0x02) {
-			creepToLimits(XAXIS, -2000, XYSPEED);
+	if (nPoints < 3 || nPoints > MAXAFPOINTS || zStart == zEnd) {
+		return(-1);
+	}
+	if (!focusOffset(g, zStart, &steps) || !focusOffset(g, zEnd, &steps)) {
+		return(-1);			// Out of range (or not calibrated)
+	}
+	for (i = 0; i < nPoints; i++) {
+		z[i] = zStart + (zEnd - zStart) * i / (nPoints - 1);
+	}
+	// Focus steps decrease as mils increase; overtravel opposes the sweep
+	dir = (zEnd > zStart) ? -1 : 1;
+
+	focusOffset(g, z[0], &steps);
+	prepareMove(g, ZAXIS, (int) (steps - dir * AFBACKLASH), g->axisProfile[ZAXIS].speed);
+	beginAxes(g, 1 << ZAXIS);
+	waitAxes(g, 1 << ZAXIS);
+	moveOneAxis(g, ZAXIS, (int) (dir * AFBACKLASH), g->axisProfile[ZAXIS].speed);
+	waitAxes(g, 1 << ZAXIS);
+
+	ok = 1;
+	for (i = 0; i < nPoints && ok; i++) {
+		if (!hook->expose(hook, z[i])) {
+			ok = 0;
+			break;
+		}
+		if (i + 1 < nPoints) {		// Move while the camera reads out
+			focusOffset(g, z[i + 1], &steps);
+			moveOneAxis(g, ZAXIS, (int) steps, g->axisProfile[ZAXIS].speed);
 		}
+		if (!hook->readout(hook, &metric[i])) {
+			ok = 0;
+		}
+		waitAxes(g, 1 << ZAXIS);
+		LOG(g, LOGFOCUS, LOGDEBUG, "focus %ld metric %g", z[i], metric[i]);
+	}
+	if (!ok) {
+		motorPower(g, ZAXIS, OFF);
+		return(-1);
 	}
 
-	if ((testVal = limitSwitch(YAXIS))) {
-		if (testVal & 0x01) {
-			creepToLimits(YAXIS, 2000, XYSPEED);
-		} else if (testVal & 0x02) {
-			creepToLimits(YAXIS, -2000, XYSPEED);
+	// Fit metric = b0 + b1*u + b2*u*u, u = z - zc for conditioning
+	best = 0;
+	for (i = 1; i < nPoints; i++) {
+		if (metric[i] < metric[best]) {
+			best = i;
 		}
 	}
-	if ((testVal = limitSwitch(ZAXIS))) {
-		if (testVal & 0x01) {
-			creepToLimits(ZAXIS, 2000, ZSPEED);
-		} else if (testVal & 0x02) {
-			creepToLimits(ZAXIS, -2000, ZSPEED);
+	bestZ = z[best];
+	zc = (double) (zStart + zEnd) / 2.0;
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+	for (i = 0; i < nPoints; i++) {
+		t = (double) z[i] - zc;
+		a[0] += 1.0;
+		a[1] += t;
+		a[2] += t * t;
+		a[5] += t * t * t;
+		a[8] += t * t * t * t;
+		b[0] += metric[i];
+		b[1] += metric[i] * t;
+		b[2] += metric[i] * t * t;
+	}
+	a[3] = a[1];
+	a[4] = a[2];
+	a[6] = a[2];
+	a[7] = a[5];
+	if (solveLinear(3, a, b) && b[2] > 0.0) {
+		t = zc - b[1] / (2.0 * b[2]);
+		if (t >= (double) (zStart < zEnd ? zStart : zEnd) && t <= (double) (zStart < zEnd ? zEnd : zStart)) {
+			bestZ = (long int) floor(t + 0.5);
 		}
 	}
 
+	// Back past the best focus and approach it the way the sweep did
+	focusOffset(g, bestZ, &steps);
+	moveOneAxis(g, ZAXIS, (int) (steps - dir * AFBACKLASH), g->axisProfile[ZAXIS].speed);
+	waitAxes(g, 1 << ZAXIS);
+	moveOneAxis(g, ZAXIS, (int) (dir * AFBACKLASH), g->axisProfile[ZAXIS].speed);
+	motorPower(g, ZAXIS, OFF);
+	return(bestZ);
+
 }
 
 /*-------------------------------------------------------------------
 
-	int brake(axis, onOffStatus);
+	void autofocusUser(struct guider *g) (USER)
 
-	brake(axis, onOffStatus) sets or releases a motor brake or
-	returns the current brake state for the selected axis. Only
-	the X and Y axes on the Magellan AO guider have brakes, so
-	axis can only be one of XAXIS, YAXIS. onOffStatus can be
-	ON, OFF, or STATUS. Values returned may be ON, OFF,
-	UNKNOWN, or BADAXIS.
+	Asks for the autofocus sweep range and the exposure program.
+	With no program the console is the camera: the user is told
+	when to expose and types in the focus metric.
+
+-------------------------------------------------------------------*/
+void autofocusUser(g)
+struct guider *g;
+{
+
+	char buf[256];
+	long int zStart, zEnd, bestZ;
+	int nPoints;
+	struct exposureHook hook;
+
+	if (!g->isCalibrated) {
+		printf("Calibrate first\n");
+		return;
+	}
+	printf("Autofocus start (mils): ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return;
+	}
+	zStart = atol(buf);
+	printf("Autofocus end (mils): ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return;
+	}
+	zEnd = atol(buf);
+	printf("Number of points: ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return;
+	}
+	nPoints = atoi(buf);
+	printf("Exposure program (return for console): ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return;
+	}
+
+	memset(&hook, 0, sizeof(hook));
+	if (buf[0]) {
+		if (!pipeHookOpen(&hook, buf)) {
+			printf("can't run %s\n", buf);
+			return;
+		}
+	} else {
+		hook.expose = consoleExpose;
+		hook.readout = consoleReadout;
+	}
+	bestZ = autofocus(g, zStart, zEnd, nPoints, &hook);
+	if (buf[0]) {
+		pipeHookClose(&hook);
+	}
+	if (bestZ < 0) {
+		printf("autofocus failed\n");
+	} else {
+		printf("best focus %ld mils\n", bestZ);
+	}
+	fflush(stdout);
+
+}
+
+/*-------------------------------------------------------------------
+
+	askGalil(g, cmd, buf, n);  (LIBRARY)
+
+	askGalil sends a command string (cmd) to the Galil controller
+	and returns the controller's reply in buf. n is the available
+	space in buf.  g->galilfd must already be a
+	valid socket to the Galil controller. If no reply comes
+	within READTIMEOUT, buf is left empty (see galilRecv()).
+
+	cmd is a pointer to a NUL terminated string containing the
+	Galil command. For example, "TPA" (Galil command "Tell
+	Position, A axis. askGalil adds a carriage return ('\r') to
+	the command sent to the Galil. The reply string from the Galil
+	is returned in buf.
 
 Checked 2012-04-30
 -------------------------------------------------------------------*/
-int brake(axis, onOffStatus)
-int axis, onOffStatus;
+void askGalil(g, cmd, buf, n)
+struct guider *g;
+char *cmd, *buf;
+int n;
 {
 
-	if (onOffStatus == STATUS) {
-		switch (axis) {
-			case XAXIS:
-				if (askGalilForInt("MG@OUT[1]")) {
-					return(OFF);
-				} else {
-					return(ON);
-				}
+	char cmdstr[80];
 
-			case YAXIS:
-				if (askGalilForInt("MG@OUT[2]")) {
-					return(OFF);
-				} else {
-					return(ON);
-				}
+	strcpy(cmdstr, cmd);
+	strcat(cmdstr, "\r");
+	galilLock(g);
+	galilSend(g, cmdstr, strlen(cmdstr));
+	memset(buf, 0, n);
+	galilRecv(g, buf, n);
+	galilUnlock(g);
 
-			case ZAXIS:
-				return(UNKNOWN);
+}
 
-			default:
-				return(BADAXIS);
+/*-------------------------------------------------------------------
+
+	int askGalilForInt(g, cmd); (LIBRARY)
+
+	askGalilForInt sends the command string (cmd) to the Galil
+	controller and returns the Galil reply as an integer.
+
+	cmd is a pointer to a NUL terminated string containing a
+	Galil command that returns an integer (as do most commands).
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+
+int askGalilForInt(g, cmd)
+struct guider *g;
+char *cmd;
+{
+
+	char buf[80];
+
+	askGalil(g, cmd, buf, 80);
+	return(atoi(buf));
+
+}
+
+/*-------------------------------------------------------------------
+
+	long int askGalilForLong(g, cmd); (LIBRARY)
+
+	askGalilForLong sends the command string (cmd) to the Galil
+	controller and returns the Galil reply as a long integer.
+
+	cmd is a pointer to a NUL terminated string containing a
+	Galil command that returns an integer (as do most commands).
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+long int askGalilForLong(g, cmd)
+struct guider *g;
+char *cmd;
+{
+
+	char buf[80];
+
+	askGalil(g, cmd, buf, 80);
+	return(atol(buf));
+
+}
+
+/*-------------------------------------------------------------------
+
+	int askGalilForValues(g, operands, n, vals); (LIBRARY)
+
+	askGalilForValues reads n Galil operands (e.g. "_SPA", "_TPB",
+	"@OUT[1]") in one exchange. The operands are packed into as
+	few "MG" lines as fit in GALILLINE characters, all lines are
+	written at once and the replies are read back together, so
+	the cost is about one round trip instead of n.
+
+	The values are returned in vals in the order requested. The
+	return value is the number of values parsed, which is less
+	than n if the controller rejected any of the lines.
+
+-------------------------------------------------------------------*/
+int askGalilForValues(g, operands, n, vals)
+struct guider *g;
+char **operands;
+int n;
+double *vals;
+{
+
+	char line[GALILLINE + 16], cmds[2048], reply[2048], *cp, *end;
+	int i, nlines, nvals;
+
+	cmds[0] = '\0';
+	line[0] = '\0';
+	nlines = 0;
+	for (i = 0; i < n; i++) {
+		if (line[0] && strlen(line) + strlen(operands[i]) + 1 > GALILLINE) {
+			strcat(cmds, line);
+			strcat(cmds, "\r");
+			nlines++;
+			line[0] = '\0';
 		}
+		if (strlen(cmds) + strlen(line) + strlen(operands[i]) + 8 > sizeof(cmds)) {
+			n = i;			// Too many operands; return what fits
+			break;
+		}
+		strcat(line, line[0] ? "," : "MG ");
+		strcat(line, operands[i]);
+	}
+	if (line[0]) {
+		strcat(cmds, line);
+		strcat(cmds, "\r");
+		nlines++;
+	}
+	if (nlines == 0) {
+		return(0);
 	}
 
-	if (onOffStatus == ON) {
-		switch (axis) {
-			case XAXIS:
-				tellGalil("CB1");
-				if (askGalilForInt("MG@OUT[1]") == 0) {
-					return(ON);
-				} else {
-					return(UNKNOWN);
-				}
-			case YAXIS:
-				tellGalil("CB2");
-				if (askGalilForInt("MG@OUT[2]") == 0) {
-					return(ON);
-				} else {
-					return(UNKNOWN);
-				}
-			default:
-				return(BADAXIS);
+	galilLock(g);
+	galilSend(g, cmds, strlen(cmds));
+	i = readGalil(g, reply, sizeof(reply), nlines);
+	galilUnlock(g);
+	if (i < nlines) {
+		return(0);
+	}
+
+	nvals = 0;
+	cp = reply;
+	while (nvals < n) {
+		while (*cp == ' ' || *cp == '\r' || *cp == '\n' || *cp == ':' || *cp == ',') {
+			cp++;
 		}
-	} else if (onOffStatus == OFF) {
-		switch (axis) {
-			case XAXIS:
-				tellGalil("SB1");
-				if (askGalilForInt("MG@OUT[1]")) {
-					return(OFF);
-				} else {
-					return(UNKNOWN);
-				}
-			case YAXIS:
-				tellGalil("SB2");
-				if (askGalilForInt("MG@OUT[2]")) {
-					return(OFF);
-				} else {
-					return(UNKNOWN);
-				}
-			default:
-				return(BADAXIS);
+		if (*cp == '\0' || *cp == '?') {
+			break;
 		}
-	} else {
-		return(UNKNOWN);
+		vals[nvals] = strtod(cp, &end);
+		if (end == cp) {
+			break;
+		}
+		nvals++;
+		cp = end;
 	}
-}
+	return(nvals);
 
+}
 
 /*-------------------------------------------------------------------
 
-	calibrate()
-	
-	This routine calibrates the motor steps to encoder pulses scale.
-	
-	It first calls the homeAxes routine to re-home the stepper
-	motors against the reverse limit switches. It then runs the
-	stage to the forward limit switches and computes the ratio
-	of the number of encoder pulses to the number of motor steps
-	in that long run. This ratio is almost always not exactly right
-	since (we believe) the steppers occasionally miss a step or two.
-	
-	This routine must be called before any absolute position move.
+	int axesMoving(g, axes) (LIBRARY)
+
+	axesMoving asks the controller which of the selected axes are
+	still moving, in one query. "axes" and the return value are
+	bit masks of (1 << XAXIS), (1 << YAXIS) and (1 << ZAXIS).
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-void calibrate()
+int axesMoving(g, axes)
+struct guider *g;
+int axes;
 {
 
-	homeAxes();
+	char *operands[LASTAXIS], names[LASTAXIS][8];
+	double vals[LASTAXIS];
+	int axis, n, moving;
 
-	creepToLimits(ZAXIS, -25000, ZSPEED);
-	moveOneAxis(ZAXIS, 1000, ZSPEED);
-	while (isMoving(ZAXIS)) {
+	n = 0;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (axes & (1 << axis)) {
+			sprintf(names[n], "_BG%c", axisTable[axis].letter);
+			operands[n] = names[n];
+			n++;
+		}
 	}
-	creepToLimits(ZAXIS, 10, ZSPEED);
-	moveOneAxis(ZAXIS, 4000, ZSPEED);
-	while (isMoving(ZAXIS)) {
+	if (n == 0) {
+		return(0);
 	}
-	zMaxInches = -inchPosition(ZAXIS);
-
-	// go to the reverse limit
-	creepToLimits(XAXIS, -65200, XYSPEED);
-	moveOneAxis(XAXIS, 150, XYSPEED/2);
-	while (isMoving(XAXIS)) {
+	if (askGalilForValues(g, operands, n, vals) != n) {
+		return(axes);			// Assume the worst
+	}
+	moving = 0;
+	n = 0;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (axes & (1 << axis)) {
+			if (vals[n++]) {
+				moving |= (1 << axis);
+			}
+		}
 	}
-	creepToLimits(XAXIS, 5, XYSPEED/2);
-	moveOneAxis(XAXIS, XSTEPSPERTURN, XYSPEED/2);
-	while (isMoving(XAXIS)) {
+	return(moving);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int limitSwitch(g, axis) (LIBRARY)
+
+	limitSwitch returns an integer with bits 0 and 1 indicating
+	the reverse and forward limit switch states respectively.
+	If the limit is engaged, the bit is 1 and motion is diabled
+	in that direction. If the limit is not engaged the bit is 0.
+
+Checked 2012-04-26
+-------------------------------------------------------------------*/
+int limitSwitch(g, axis)
+struct guider *g;
+{
+
+	int temp, limitVal;
+	char buf[8];
+
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(BADAXIS);
 	}
-	motorPower(XAXIS, OFF);
+	sprintf(buf, "TS%c", axisTable[axis].letter);
+	temp = askGalilForInt(g, buf);
 
-	creepToLimits(YAXIS, -65200, XYSPEED);
-	moveOneAxis(YAXIS, 150, XYSPEED/2);
-	while (isMoving(YAXIS)) {
+	limitVal = 0;
+	if ((temp>>2 & 0x01) == 0) {			// Reverse limit
+		limitVal |= 0x01;
 	}
-	creepToLimits(YAXIS, 5, XYSPEED/2);
-	moveOneAxis(YAXIS, YSTEPSPERTURN, XYSPEED/2);
-	while (isMoving(YAXIS)) {
+	if ((temp>>3 & 0x01) == 0) {			// Forward limit
+		limitVal |= 0x02;
 	}
-	motorPower(YAXIS, OFF);
+	return(limitVal);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void backOff(struct guider *g); (LIBRARY)
 
-	// Set global xEncPerStep, yEncPerStep
-	xEncPerStep = (float) (encPosition(XAXIS) - xEncOffset) / (float) stepPosition(XAXIS);
-	yEncPerStep = (float) (encPosition(YAXIS) - yEncOffset) / (float) stepPosition(YAXIS);
+	backOff clears a limit switch situation by searching for
+	engaged limits and backing away a few steps.
 
-	// Set global xEncMin, yEncMin
-	xEncMin = encPosition(XAXIS);
-	yEncMin = encPosition(YAXIS);
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+void backOff(g)
+struct guider *g;
+{
 
-	xMaxInches = inchPosition(XAXIS);
-	yMaxInches = inchPosition(YAXIS);
+	int axis, testVal;
 
-	isCalibrated = 1;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if ((testVal = limitSwitch(g, axis))) {
+			if (testVal & 0x01) {
+				creepToLimits(g, axis, 2000, axisTable[axis].speed);
+			} else if (testVal & 0x02) {
+				creepToLimits(g, axis, -2000, axisTable[axis].speed);
+			}
+		}
+	}
 
-	centerField();
-	focusAbs(500);
 }
 
-void centerField()
+/*-------------------------------------------------------------------
+
+	int batchExec(struct batchCmd *c, int *pending) (LIBRARY)
+
+	batchExec carries out one command from batchParse(). Moves are
+	started, not waited for; pending[] (one entry per guider)
+	collects the axes still moving, for batchSettle(). A motion
+	command first settles the moves pending on its own guider.
+	Returns 1 if the command succeeded, 0 if not.
+
+-------------------------------------------------------------------*/
+int batchExec(c, pending)
+struct batchCmd *c;
+int *pending;
 {
 
-	moveAbs(XCENTER, YCENTER);
+	int j, ok;
+	long int xSteps, ySteps, zSteps;
+	struct guider *g;
+	struct motionProfile *prof;
+
+	g = &guiders[c->guider];
+	ok = 1;
+	switch (c->op) {
+	case BATCHINIT:
+		ok = batchSettle(g, &pending[c->guider]);
+		initGuider(g);
+		break;
+	case BATCHHOME:
+		ok = batchSettle(g, &pending[c->guider]);
+		homeAxes(g);
+		ok = ok && isHomed(g);
+		break;
+	case BATCHCALIBRATE:
+		ok = batchSettle(g, &pending[c->guider]);
+		calibrate(g);
+		ok = ok && g->isCalibrated;
+		break;
+	case BATCHMOVE:
+		ok = batchSettle(g, &pending[c->guider]);
+		zSteps = (c->nArgs == 3) ? (long int) c->arg[2] : -1L;
+		if (c->nArgs == 2 && !focusMapZ(g, c->arg[0], c->arg[1], &zSteps)) {
+			zSteps = -1L;		// As moveAbs()
+		}
+		if (ok && absSteps(g, c->arg[0], c->arg[1], zSteps, &xSteps, &ySteps, &zSteps)) {
+			pending[c->guider] = startRelXYZ(g, xSteps, ySteps, zSteps);
+		} else {
+			ok = 0;
+		}
+		break;
+	case BATCHMOVEREL:
+		ok = batchSettle(g, &pending[c->guider]);
+		if (ok) {
+			pending[c->guider] = startRelXYZ(g, (long int) c->arg[0], (long int) c->arg[1],
+				(c->nArgs == 3) ? (long int) c->arg[2] : 0L);
+		}
+		break;
+	case BATCHFOCUS:
+		ok = batchSettle(g, &pending[c->guider]);
+		if (ok && focusOffset(g, (long int) c->arg[0], &zSteps)) {
+			pending[c->guider] = startRelXYZ(g, 0L, 0L, zSteps);
+		} else {
+			ok = 0;
+		}
+		break;
+	case BATCHFOCUSREL:
+		ok = batchSettle(g, &pending[c->guider]);
+		if (ok) {
+			pending[c->guider] = startRelXYZ(g, 0L, 0L, (long int) c->arg[0]);
+		}
+		break;
+	case BATCHCONFIG:		// Used from the next move on
+		prof = &g->axisProfile[c->axis];
+		if (c->arg[0] == 0) {
+			prof->speed = (long int) c->arg[1];
+		} else if (c->arg[0] == 1) {
+			prof->accel = (long int) c->arg[1];
+		} else {
+			prof->decel = (long int) c->arg[1];
+		}
+		break;
+	case BATCHSTATUS:
+		printf("%s ", g->name);
+		statusPrint(g);
+		break;
+	case BATCHWAIT:
+		if (c->nArgs == 1) {
+			usleep((useconds_t) (c->arg[0] * 1.0e6));
+			break;
+		}
+		for (j = 0; j < nGuiders; j++) {
+			ok = batchSettle(&guiders[j], &pending[j]) && ok;
+		}
+		break;
+	}
+	return(ok);
 
 }
 
 /*-------------------------------------------------------------------
 
-	void cmdLoop()
-	
-	Polls the keyboard for a one-key command.
-	
+	int batchLoad(fp, name, cmds, max) (LIBRARY)
+
+	batchLoad reads a whole batch script from fp (a file, stdin
+	or a FIFO, read to end of file) and validates every line with
+	batchParse() before anything runs. Blank lines and text after
+	'#' are ignored. Errors are printed as "name:line: message".
+	Returns the number of commands in cmds, or -1 if any line is
+	bad or there are more than max.
+
 -------------------------------------------------------------------*/
-void cmdLoop()
+int batchLoad(fp, name, cmds, max)
+FILE *fp;
+char *name;
+struct batchCmd *cmds;
+int max;
 {
 
-	int cmd;
+	char buf[BATCHLINE], *cp, *msg;
+	int n, line, errors, guider;
 
-	printf("> ");			// Prompt character on the terminal
+	n = line = errors = guider = 0;
+	while (fgets(buf, sizeof(buf), fp)) {
+		line++;
+		if (!strchr(buf, '\n') && !feof(fp)) {
+			printf("%s:%d: line too long\n", name, line);
+			errors++;
+			while (fgets(buf, sizeof(buf), fp) && !strchr(buf, '\n')) {
+			}
+			continue;
+		}
+		if ((cp = strchr(buf, '#'))) {
+			*cp = '\0';
+		}
+		buf[strcspn(buf, "\r\n")] = '\0';
+		cp = buf + strspn(buf, " \t");
+		if (*cp == '\0') {
+			continue;
+		}
+		if (n >= max) {
+			printf("%s:%d: more than %d commands\n", name, line, max);
+			return(-1);
+		}
+		cmds[n].line = line;
+		strcpy(cmds[n].text, cp);
+		if ((msg = batchParse(cp, &cmds[n], &guider))) {
+			printf("%s:%d: %s\n", name, line, msg);
+			errors++;
+			continue;
+		}
+		n++;
+	}
 	fflush(stdout);
+	return(errors ? -1 : n);
 
-	setMode(NONBLOCKING);
-	while (!(cmd = getKey())) {	// Wait for a command
-		usleep(10000);
+}
+
+/*-------------------------------------------------------------------
+
+	int batchOpen(char *script, struct batchCmd *cmds, int max) (USER)
+
+	Loads the batch script in the file "script" ("-" for stdin; a
+	FIFO works too, it is read until the writer closes it) with
+	batchLoad(). main() calls it before connecting to anything, so
+	a bad script never moves a motor. Returns the number of
+	commands, or -1.
+
+-------------------------------------------------------------------*/
+int batchOpen(script, cmds, max)
+char *script;
+struct batchCmd *cmds;
+int max;
+{
+
+	FILE *fp;
+	int n;
+
+	if (strcmp(script, "-") == 0) {
+		fp = stdin;
+	} else if (!(fp = fopen(script, "r"))) {
+		printf("can't open %s\n", script);
+		return(-1);
 	}
+	n = batchLoad(fp, script, cmds, max);
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	return(n);
 
-	if (cmd == 'a') {		// Insert the small aperture
-		printf("aperture, small");
-		fflush(stdout);
-		smallAp();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'A') {	// Insert the field lens
-		printf("field lens");
-		fflush(stdout);
-		fieldLens();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'B') {	// Back off limits
-		printf("Backoff limits");
-		fflush(stdout);
-		backOff();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'c') {	// center field
-		printf("center field");
-		fflush(stdout);
-		centerField();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'C') {	// Calibrate
-		printf("Calibrate");
-		fflush(stdout);
-		calibrate();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'D') {	// Demo mode 
-		printf("Demo");
-		fflush(stdout);
-		demo();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'd') {	// Toggle debug flag
-		printf("debug flag");
-		fflush(stdout);
-		debug();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'f') {	// focus relative
-		focus(FOCUSREL);
-	} else if (cmd == 'F') {	// Focus to absolute position
-		focus(FOCUSABS);
-	} else if (cmd == 'h') {	// list commands help
-		help();
-	} else if (cmd == 'H') {	// Home the X and Y axes
-		printf("Home");
-		fflush(stdout);
-		homeAxes();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'i') {	// Initialize
-		printf("initializing");
-		fflush(stdout);
-		initGuider();
-		printf(".\n");
+}
+
+/*-------------------------------------------------------------------
+
+	char *batchParse(text, c, guider) (LIBRARY)
+
+	batchParse checks one batch script line ("verb arg ...", see
+	batchVerbs[]) and fills in c. *guider is the guider index
+	lines go to; a "guider n" line changes it for the lines after.
+	Returns NULL if the line is good, otherwise what is wrong
+	with it.
+
+-------------------------------------------------------------------*/
+char *batchParse(text, c, guider)
+char *text;
+struct batchCmd *c;
+int *guider;
+{
+
+	static char *fields[] = {"speed", "accel", "decel", NULL};
+	char buf[BATCHLINE], *word[5], *end;
+	int i, n;
+
+	strcpy(buf, text);
+	n = 0;
+	for (word[n] = strtok(buf, " \t"); word[n] && n < 4; word[n] = strtok(NULL, " \t")) {
+		n++;
+	}
+	if (n == 4 && word[4]) {
+		return("too many arguments");
+	}
+	for (c->op = 1; batchVerbs[c->op].name; c->op++) {
+		if (strcmp(word[0], batchVerbs[c->op].name) == 0) {
+			break;
+		}
+	}
+	if (!batchVerbs[c->op].name) {
+		return("unknown command");
+	}
+	c->nArgs = n - 1;
+	if (c->nArgs < batchVerbs[c->op].minArgs || c->nArgs > batchVerbs[c->op].maxArgs) {
+		return("wrong number of arguments");
+	}
+
+	c->axis = 0;
+	if (c->op == BATCHCONFIG) {		// config axis field value
+		for (c->axis = XAXIS; c->axis <= LASTAXIS; c->axis++) {
+			if (word[1][0] == axisTable[c->axis].name && word[1][1] == '\0') {
+				break;
+			}
+		}
+		if (c->axis > LASTAXIS) {
+			return("unknown axis");
+		}
+		for (n = 0; fields[n]; n++) {
+			if (strcmp(word[2], fields[n]) == 0) {
+				break;
+			}
+		}
+		if (!fields[n]) {
+			return("config field is speed, accel or decel");
+		}
+		c->arg[0] = n;
+		c->arg[1] = strtod(word[3], &end);
+		if (*end || c->arg[1] <= 0.0) {
+			return("bad value");
+		}
+		c->guider = *guider;
+		return(NULL);
+	}
+	for (i = 1; i <= c->nArgs; i++) {
+		c->arg[i - 1] = strtod(word[i], &end);
+		if (*end) {
+			return("bad number");
+		}
+	}
+	if (c->op == BATCHGUIDER) {
+		if (c->arg[0] < 1 || c->arg[0] > nGuiders || c->arg[0] != (int) c->arg[0]) {
+			return("no such guider");
+		}
+		*guider = (int) c->arg[0] - 1;
+	} else if (c->op == BATCHWAIT && c->nArgs == 1 && c->arg[0] < 0.0) {
+		return("negative wait");
+	} else if (c->op == BATCHFOCUS && c->arg[0] < 0.0) {
+		return("negative focus");
+	}
+	c->guider = *guider;
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int batchRun(struct batchCmd *cmds, int n) (LIBRARY)
+
+	batchRun runs n commands from batchLoad() with batchExec().
+	Moves are started
+	and not waited for, so the commands after them (status,
+	config, waits, and above all moves on other guiders) run
+	while they do. The next motion command on the same guider,
+	or "wait" with no argument, waits for them with
+	superviseMove() and sets the brakes, as moveRelXYZ() would.
+
+	Each command is reported with the seconds it took; a move's
+	time is the time to start it, the wait for it is charged to
+	whatever command waited. Stops at the first command that
+	fails. Returns 0 if all succeeded, 1 if not.
+
+-------------------------------------------------------------------*/
+int batchRun(cmds, n)
+struct batchCmd *cmds;
+int n;
+{
+
+	int i, j, ok, pending[MAXGUIDERS];
+	double t0, t1, start;
+	struct batchCmd *c;
+
+	memset(pending, 0, sizeof(pending));
+	start = hostSeconds();
+	for (i = 0; i < n; i++) {
+		c = &cmds[i];
+		t0 = hostSeconds();
+		ok = batchExec(c, pending);
+		t1 = hostSeconds();
+		printf("%4d %-40s %8.3f s%s\n", c->line, c->text, t1 - t0, ok ? "" : "  FAILED");
 		fflush(stdout);
-	} else if (cmd == 'l') {	// Set up LED with S-H
-		printf("led ");
-		if (ledInOut(STATUS) == IN) {
-			ledInOut(OUT);
-			printf("out.\n");
+		if (!ok) {
+			for (j = 0; j < nGuiders; j++) {
+				batchSettle(&guiders[j], &pending[j]);
+			}
+			return(1);
+		}
+	}
+	ok = 1;
+	for (j = 0; j < nGuiders; j++) {
+		ok = batchSettle(&guiders[j], &pending[j]) && ok;
+	}
+	printf("%d commands, %.3f s%s\n", n, hostSeconds() - start, ok ? "" : ", last moves FAILED");
+	fflush(stdout);
+	return(ok ? 0 : 1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int batchSettle(struct guider *g, int *axes) (LIBRARY)
+
+	Waits for the moves batchExec() started on *axes to finish
+	(superviseMove()), powers those axes down, waits for the stage
+	to settle (settleWait()) and clears *axes. Returns 1 if the
+	moves went as commanded, 0 if one stalled.
+
+-------------------------------------------------------------------*/
+int batchSettle(g, axes)
+struct guider *g;
+int *axes;
+{
+
+	int axis, status;
+	double end;
+
+	if (*axes == 0) {
+		return(1);
+	}
+	status = superviseMove(g, *axes);
+	end = hostSeconds();
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (*axes & (1 << axis)) {
+			motorPower(g, axis, OFF);
+		}
+	}
+	settleWait(g, *axes, end);
+	*axes = 0;
+	return(status == PASS);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void beginAxes(g, axes); (LIBRARY)
+
+	beginAxes starts the moves set up by prepareMove() on the
+	selected axes with a single BG command, so they start in the
+	same controller sample. "axes" is a bit mask of (1 << XAXIS),
+	(1 << YAXIS), (1 << ZAXIS). The moves are timestamped in
+	axisMove[] for moveETA() and waitAxes().
+
+-------------------------------------------------------------------*/
+void beginAxes(g, axes)
+struct guider *g;
+int axes;
+{
+
+	char buf[4 + LASTAXIS];
+	int axis, n;
+
+	if (g->job.cancel) {		// jobCancel() stopped everything
+		return;
+	}
+	strcpy(buf, "BG");
+	n = 2;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (axes & (1 << axis)) {
+			buf[n++] = axisTable[axis].letter;
+		}
+	}
+	if (n == 2) {
+		return;
+	}
+	buf[n] = '\0';
+	tellGalil(g, buf);
+	noteBegin(g, axes, hostSeconds());
+
+}
+
+/*-------------------------------------------------------------------
+
+	int brake(axis, onOffStatus);
+
+	brake(axis, onOffStatus) sets or releases a motor brake or
+	returns the current brake state for the selected axis. Only
+	the X and Y axes on the Magellan AO guider have brakes, so
+	axis can only be one of XAXIS, YAXIS. onOffStatus can be
+	ON, OFF, or STATUS. Values returned may be ON, OFF,
+	UNKNOWN, or BADAXIS.
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+int brake(g, axis, onOffStatus)
+struct guider *g;
+int axis, onOffStatus;
+{
+
+	char buf[20];
+	int out;
+
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(BADAXIS);
+	}
+	if ((out = axisTable[axis].brakeOut) == 0) {	// No brake
+		return((onOffStatus == STATUS) ? UNKNOWN : BADAXIS);
+	}
+	sprintf(buf, "MG@OUT[%d]", out);
+
+	if (onOffStatus == STATUS) {
+		if (askGalilForInt(g, buf)) {
+			return(OFF);
+		} else {
+			return(ON);
+		}
+	}
+
+	if (onOffStatus == ON) {
+		sprintf(buf, "CB%d", out);
+		tellGalil(g, buf);
+		sprintf(buf, "MG@OUT[%d]", out);
+		if (askGalilForInt(g, buf) == 0) {
+			return(ON);
+		} else {
+			return(UNKNOWN);
+		}
+	} else if (onOffStatus == OFF) {
+		sprintf(buf, "SB%d", out);
+		tellGalil(g, buf);
+		sprintf(buf, "MG@OUT[%d]", out);
+		if (askGalilForInt(g, buf)) {
+			return(OFF);
+		} else {
+			return(UNKNOWN);
+		}
+	} else {
+		return(UNKNOWN);
+	}
+}
+
+
+/*-------------------------------------------------------------------
+
+	calibrate()
+	
+	This routine calibrates the motor steps to encoder pulses scale.
+	
+	It first calls the homeAxes routine to re-home the stepper
+	motors against the reverse limit switches. It then runs the
+	stage to the forward limit switches and computes the ratio
+	of the number of encoder pulses to the number of motor steps
+	in that long run. This ratio is almost always not exactly right
+	since (we believe) the steppers occasionally miss a step or two.
+	The ends of travel it finds become the controller's soft
+	limits (softLimits()).
+	
+	This routine must be called before any absolute position move.
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+void calibrate(g)
+struct guider *g;
+{
+
+	char phase[32];
+	int axis;
+	long int speed;
+
+	homeAxes(g);
+
+	if (!jobPhase(g, "calibrate Z travel", 1, 4)) {
+		return;
+	}
+	speed = axisTable[ZAXIS].speed;
+	if (!creepToLimits(g, ZAXIS, -25000, speed)) {
+		return;
+	}
+	moveOneAxis(g, ZAXIS, 1000, speed);
+	waitAxes(g, 1 << ZAXIS);
+	if (!creepToLimits(g, ZAXIS, 10, speed)) {
+		return;
+	}
+	moveOneAxis(g, ZAXIS, axisTable[ZAXIS].stepsPerTurn, speed);
+	waitAxes(g, 1 << ZAXIS);
+	g->maxInches[ZAXIS] = -inchPosition(g, ZAXIS);
+	g->stepMin[ZAXIS] = g->cmdPosition[ZAXIS] = stepPosition(g, ZAXIS);
+	g->cmdKnown |= (1 << ZAXIS);
+
+	// X and Y: go to the reverse limit, then one turn back in
+	for (axis = XAXIS; axis <= YAXIS; axis++) {
+		sprintf(phase, "calibrate %c travel", axisTable[axis].name);
+		if (!jobPhase(g, phase, axis + 1, 4)) {
+			return;
+		}
+		speed = axisTable[axis].speed;
+		if (!creepToLimits(g, axis, -65200, speed)) {
+			return;
+		}
+		moveOneAxis(g, axis, axisTable[axis].limitHyster, speed/2);
+		waitAxes(g, 1 << axis);
+		if (!creepToLimits(g, axis, 5, speed/2)) {
+			return;
+		}
+		moveOneAxis(g, axis, axisTable[axis].stepsPerTurn, speed/2);
+		waitAxes(g, 1 << axis);
+		motorPower(g, axis, OFF);
+		g->stepMin[axis] = g->cmdPosition[axis] = stepPosition(g, axis);
+		g->cmdKnown |= (1 << axis);
+	}
+
+	for (axis = XAXIS; axis <= YAXIS; axis++) {
+		g->encPerStep[axis] = (float) (encPosition(g, axis) - g->encOffset[axis]) / (float) stepPosition(g, axis);
+		g->encMin[axis] = encPosition(g, axis);
+		g->maxInches[axis] = inchPosition(g, axis);
+	}
+
+	if (!jobPhase(g, "center", 4, 4)) {
+		return;
+	}
+	g->stalledAxes = 0;
+	g->isCalibrated = 1;
+	estimateReset(g);			// The encoders count from here
+	softLimits(g, ON);
+
+	moveAbsXYZ(g, XCENTER, YCENTER, 500L);	// Center and focus together
+}
+
+/*-------------------------------------------------------------------
+
+	int characterize(g, axis) (LIBRARY)
+
+	characterize finds the fastest speed and acceleration the
+	selected axis (XAXIS or YAXIS) can run without losing steps.
+	For each acceleration level (XYACCEL, 2x, 4x, 8x) it runs
+	CHARSTEPS out and back at increasing speeds, comparing the
+	encoder travel to the commanded steps on every run, until a
+	run loses more than CHARTOL steps. Of the passing runs, the
+	one with the shortest measured move time is derated by
+	CHARMARGIN and becomes the axis's motion profile, which is
+	saved to the guider's calibration file along with the brake
+	times characterizeBrake() then measures.
+
+	The focus axis has no encoder and cannot be characterized.
+	The stage must be homed. A run that stalls badly enough for
+	superviseMove() to abort it clears isCalibrated, so calibrate
+	again afterwards if that happened. Returns PASS if a profile was found,
+	FAIL otherwise (the old profile is then kept).
+
+-------------------------------------------------------------------*/
+int characterize(g, axis)
+struct guider *g;
+int axis;
+{
+
+	int i;
+	long int speed, accel, decel, maxSteps, pos;
+	double t, bestTime;
+	struct motionProfile best, saved;
+
+	if (axis < XAXIS || axis > LASTAXIS || axisTable[axis].encPerTurn == 0) {
+		return(FAIL);		// Needs an encoder to see lost steps
+	}
+	maxSteps = axisTable[axis].maxSteps;
+	if (!isHomed(g)) {
+		printf("not homed\n");
+		return(FAIL);
+	}
+
+	// Start from the middle of the travel so CHARSTEPS fits either way
+	pos = stepPosition(g, axis);
+	if (pos - CHARSTEPS < -maxSteps + 1000 || pos > -1000) {
+		moveOneAxis(g, axis, -maxSteps/2 - pos, XYSPEED);
+		waitAxes(g, 1 << axis);
+	}
+
+	saved = g->axisProfile[axis];
+	best.speed = 0;
+	bestTime = 0.0;
+	for (i = 0; i < CHARACCELS; i++) {
+		accel = XYACCEL << i;
+		decel = XYDECEL << i;
+		for (speed = XYSPEED/2; speed <= CHARMAXSPEED; speed += CHARSPEEDSTEP) {
+			if (characterizeRun(g, axis, speed, accel, decel, &t) != PASS) {
+				break;		// Faster runs will lose steps too
+			}
+			if (best.speed == 0 || t < bestTime) {
+				best.speed = speed;
+				best.accel = accel;
+				best.decel = decel;
+				bestTime = t;
+			}
+		}
+		LOG(g, LOGCALIB, LOGDEBUG, "accel %ld: lost steps above speed %ld", accel, speed - CHARSPEEDSTEP);
+	}
+
+	g->axisProfile[axis] = saved;	// characterizeRun() changes it
+	motorPower(g, axis, OFF);
+	if (best.speed == 0) {
+		return(FAIL);
+	}
+	characterizeBrake(g, axis);
+
+	g->axisProfile[axis].speed = (long int) (CHARMARGIN * best.speed);
+	g->axisProfile[axis].accel = (long int) (CHARMARGIN * best.accel);
+	g->axisProfile[axis].decel = (long int) (CHARMARGIN * best.decel);
+	saveCalibration(g, g->calFile);
+	return(PASS);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int characterizeBrake(struct guider *g, int axis) (LIBRARY)
+
+	characterizeBrake measures how long the axis's brake takes to
+	let go and to hold, for motorPower(). Release: with the motor
+	holding, the brake is released and, after a delay, BRAKESTEPS
+	are moved; if the encoder shows steps lost to a dragging brake
+	the delay was too short. Engage: with the motor holding still,
+	the brake is applied and, after a delay, the motor turned off;
+	if the encoder, sampled every SETTLEPERIOD, then moves more
+	than SETTLEBAND in BRAKEWATCH seconds the brake wasn't holding
+	yet. Delays are tried in
+	BRAKESTEP increments up to BRAKEMAXTIME, and the shortest that
+	works, times BRAKEMARGIN, becomes brakeRelease or brakeEngage.
+	A time that never works is left as it was.
+
+	Returns PASS if both were measured, FAIL otherwise. The axis
+	ends powered off with its brake on.
+
+-------------------------------------------------------------------*/
+int characterizeBrake(g, axis)
+struct guider *g;
+int axis;
+{
+
+	char buf[20], op[8], *operands[1];
+	int leg, found;
+	long int enc;
+	double d, encPerStep, lost, t0, sample;
+
+	if (!axisTable[axis].brakeOut || axisTable[axis].encPerTurn == 0) {
+		return(FAIL);
+	}
+	sprintf(op, "_TP%c", axisTable[axis].letter);
+	operands[0] = op;
+	encPerStep = g->isCalibrated ? g->encPerStep[axis] :
+		(double) axisTable[axis].encPerTurn / axisTable[axis].stepsPerTurn;
+	found = 0;
+
+	for (d = BRAKESTEP; d < BRAKEMAXTIME + BRAKESTEP / 2; d += BRAKESTEP) {
+		motorPower(g, axis, OFF);
+		sprintf(buf, "SH%c", axisTable[axis].letter);
+		tellGalil(g, buf);
+		usleep((useconds_t) (HOLDSETTLE * 1.0e6));
+		brake(g, axis, OFF);
+		usleep((useconds_t) (d * 1.0e6));
+		g->poweredAxes |= (1 << axis);	// So prepareMove() doesn't wait again
+		lost = 0.0;
+		for (leg = 0; leg < 2; leg++) {
+			enc = encPosition(g, axis);
+			moveOneAxis(g, axis, leg ? BRAKESTEPS : -BRAKESTEPS, g->axisProfile[axis].speed);
+			superviseMove(g, 1 << axis);
+			lost += fabs((double) (encPosition(g, axis) - enc) / encPerStep -
+				(leg ? BRAKESTEPS : -BRAKESTEPS));
+		}
+		LOG(g, LOGCALIB, LOGDEBUG, "%c brake release after %.3f s: lost %.1f steps",
+			axisTable[axis].name, d, lost);
+		if (lost <= CHARTOL) {
+			g->brakeRelease[axis] = BRAKEMARGIN * d;
+			found |= 1;
+			break;
+		}
+	}
+
+	for (d = BRAKESTEP; d < BRAKEMAXTIME + BRAKESTEP / 2; d += BRAKESTEP) {
+		if (!(g->poweredAxes & (1 << axis))) {
+			motorPower(g, axis, ON);
+		}
+		brake(g, axis, ON);
+		usleep((useconds_t) (d * 1.0e6));
+		sprintf(buf, "MO%c", axisTable[axis].letter);
+		tellGalil(g, buf);
+		g->poweredAxes &= ~(1 << axis);
+		enc = encPosition(g, axis);
+		t0 = hostSeconds();
+		lost = 0.0;
+		while (hostSeconds() - t0 < BRAKEWATCH) {
+			if (askGalilForValues(g, operands, 1, &sample) == 1 && fabs(sample - enc) > lost) {
+				lost = fabs(sample - enc);
+			}
+			usleep((useconds_t) (SETTLEPERIOD * 1.0e6));
+		}
+		LOG(g, LOGCALIB, LOGDEBUG, "%c brake engage after %.3f s: moved %.0f counts",
+			axisTable[axis].name, d, lost);
+		if (lost <= SETTLEBAND) {
+			g->brakeEngage[axis] = BRAKEMARGIN * d;
+			found |= 2;
+			break;
+		}
+	}
+	motorPower(g, axis, OFF);
+	return((found == 3) ? PASS : FAIL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int characterizeRun(g, axis, speed, accel, decel, seconds) (LIBRARY)
+
+	characterizeRun moves the axis CHARSTEPS toward the reverse
+	limit and back again with the given profile and checks the
+	encoder travel of each leg against the commanded steps.
+	The total time for both legs is returned in seconds.
+
+	Returns PASS if neither leg lost more than CHARTOL steps,
+	FAIL otherwise. The motor is left powered.
+
+-------------------------------------------------------------------*/
+int characterizeRun(g, axis, speed, accel, decel, seconds)
+struct guider *g;
+int axis;
+long int speed, accel, decel;
+double *seconds;
+{
+
+	int leg, steps;
+	long int enc;
+	double encPerStep, t0, lost;
+
+	if (g->isCalibrated) {
+		encPerStep = g->encPerStep[axis];
+	} else {
+		encPerStep = (double) axisTable[axis].encPerTurn / axisTable[axis].stepsPerTurn;
+	}
+
+	g->axisProfile[axis].accel = accel;
+	g->axisProfile[axis].decel = decel;
+	*seconds = 0.0;
+	for (leg = 0; leg < 2; leg++) {
+		steps = (leg == 0) ? -CHARSTEPS : CHARSTEPS;
+		enc = encPosition(g, axis);
+		t0 = hostSeconds();
+		moveOneAxis(g, axis, steps, speed);
+		superviseMove(g, 1 << axis);	// Stops early if it stalls
+		*seconds += hostSeconds() - t0;
+		lost = fabs((double) (encPosition(g, axis) - enc) / encPerStep - steps);
+		LOG(g, LOGCALIB, LOGDEBUG, "speed %ld accel %ld steps %d lost %.1f", speed, accel, steps, lost);
+		if (lost > CHARTOL) {
+			return(FAIL);
+		}
+	}
+	return(PASS);
+
+}
+
+void centerField(g)
+struct guider *g;
+{
+
+	moveAbs(g, XCENTER, YCENTER);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int clockProgram(struct guider *g) (LIBRARY)
+
+	Downloads ttagProgram[] to the controller for scheduleAxes().
+	DL replaces whatever program the controller had. Returns 1 if
+	the controller took it.
+
+-------------------------------------------------------------------*/
+int clockProgram(g)
+struct guider *g;
+{
+
+	char buf[1024], reply[64];
+	int i;
+
+	strcpy(buf, "DL\r");
+	for (i = 0; ttagProgram[i]; i++) {
+		strcat(buf, ttagProgram[i]);
+		strcat(buf, "\r");
+	}
+	strcat(buf, "\\");			// Ends the download
+
+	galilLock(g);
+	galilSend(g, buf, strlen(buf));
+	i = readGalil(g, reply, sizeof(reply), 1);
+	galilUnlock(g);
+	if (i < 1 || strchr(reply, '?')) {
+		g->clock.loaded = 0;
+		return(0);
+	}
+	tellGalil(g, "ttdone=1");
+	g->clock.loaded = 1;
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int clockSync(struct guider *g) (LIBRARY)
+
+	clockSync measures the offset between hostSeconds() and the
+	controller's TIME. TIME is read CLOCKPINGS times and the
+	quickest exchange is taken to have been answered half way
+	through, so the offset is good to about half its round trip
+	plus a TIME count. The rate is CLOCKRATE until the kept syncs
+	span CLOCKMINSPAN seconds, then a straight line fit to them.
+	A sync far off the prediction (the controller was reset)
+	starts the history again. Returns 1 on success.
+
+-------------------------------------------------------------------*/
+int clockSync(g)
+struct guider *g;
+{
+
+	char *operands[1];
+	int i, n;
+	double t0, t1, val, best, host, count;
+	double sx, sy, sxx, sxy, d, span;
+	struct clockMap *c;
+
+	c = &g->clock;
+	operands[0] = "TIME";
+	best = 1.0e9;
+	host = count = 0.0;
+	for (i = 0; i < CLOCKPINGS; i++) {
+		t0 = hostSeconds();
+		if (askGalilForValues(g, operands, 1, &val) != 1) {
+			continue;
+		}
+		t1 = hostSeconds();
+		if (t1 - t0 < best) {
+			best = t1 - t0;
+			host = 0.5 * (t0 + t1);
+			count = val;
+		}
+	}
+	if (best > 1.0e8) {
+		return(0);
+	}
+
+	if (c->nSyncs > 0 && fabs(hostToGalil(g, host) - count) > CLOCKJUMP) {
+		LOG(g, LOGCLOCK, LOGWARN, "TIME jumped %.0f counts, resyncing", count - hostToGalil(g, host));
+		c->nSyncs = 0;
+	}
+	c->host[c->nSyncs % CLOCKHISTORY] = host;
+	c->time[c->nSyncs % CLOCKHISTORY] = count;
+	c->nSyncs++;
+	n = (c->nSyncs < CLOCKHISTORY) ? c->nSyncs : CLOCKHISTORY;
+
+	c->rate = CLOCKRATE;
+	sx = sy = sxx = sxy = span = 0.0;
+	for (i = 0; i < n; i++) {		// Relative to this sync, for precision
+		sx += c->host[i] - host;
+		sy += c->time[i] - count;
+		sxx += (c->host[i] - host) * (c->host[i] - host);
+		sxy += (c->host[i] - host) * (c->time[i] - count);
+		if (host - c->host[i] > span) {
+			span = host - c->host[i];
+		}
+	}
+	d = n * sxx - sx * sx;
+	if (span >= CLOCKMINSPAN && d > 0.0) {
+		c->rate = (n * sxy - sx * sy) / d;
+	}
+	c->host0 = host;
+	c->time0 = count;
+	c->roundTrip = best;
+	LOG(g, LOGCLOCK, LOGDEBUG, "sync %d: TIME %.0f, rate %.4f, round trip %.2f ms",
+		c->nSyncs, count, c->rate, 1000.0 * best);
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void cmdLoop()
+	
+	Polls the keyboard for a one-key command and runs it on the
+	selected guider (see guiderCommand()). With several guiders,
+	'g' selects one of them or all of them; a command given to all
+	of them runs on each in its own thread, so e.g. both guiders
+	home at the same time.
+	
+-------------------------------------------------------------------*/
+void cmdLoop()
+{
+
+	char buf[20];
+	int cmd, i;
+	pthread_t tid[MAXGUIDERS];
+	struct guiderCmd job[MAXGUIDERS];
+
+	if (nGuiders > 1) {
+		if (currentGuider < 0) {
+			printf("all");
+		} else {
+			printf("%s", guiders[currentGuider].name);
+		}
+	}
+	printf("> ");			// Prompt character on the terminal
+	fflush(stdout);
+
+	setMode(NONBLOCKING);
+	while (!(cmd = getKey())) {	// Wait for a command
+		usleep(10000);
+	}
+
+	if (cmd == 'd') {		// Toggle debug logging
+		printf("debug logging");
+		fflush(stdout);
+		debug();
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 'g') {	// Select a guider
+		printf("guider (1-%d, * for all): ", nGuiders);
+		fflush(stdout);
+		if (getLine(buf, sizeof(buf)) == NULL) {
+			return;
+		}
+		if (buf[0] == '*') {
+			currentGuider = -1;
+		} else if (atoi(buf) >= 1 && atoi(buf) <= nGuiders) {
+			currentGuider = atoi(buf) - 1;
+		}
+	} else if (cmd == 'h') {	// list commands help
+		help();
+	} else if (cmd == 'q') {	// quit
+		exit(0);
+	} else if (currentGuider >= 0) {
+		guiderCommand(&guiders[currentGuider], cmd);
+	} else if (cmd == '?') {	// One status listing after another
+		for (i = 0; i < nGuiders; i++) {
+			printf("%s ", guiders[i].name);
+			statusPrint(&guiders[i]);
+		}
+	} else if (strchr("aABcCHijlRSswx", cmd)) {
+		for (i = 0; i < nGuiders; i++) {
+			job[i].g = &guiders[i];
+			job[i].cmd = cmd;
+			pthread_create(&tid[i], NULL, guiderThread, &job[i]);
+		}
+		for (i = 0; i < nGuiders; i++) {
+			pthread_join(tid[i], NULL);
+		}
+	} else {
+		printf("%c: select one guider first (g)\n", cmd);
+		fflush(stdout);
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	int guideFrame(g, double t, float px, float py) (LIBRARY)
+
+	guideFrame takes one camera frame's star centroid (px, py)
+	detector pixels, from an exposure centered on hostSeconds() t
+	(0 for now), and queues the correction the control law asks
+	for with guideOffset(). Call it once per frame while guiding
+	(guideStart()).
+
+	The error is the stage move that follows the star from ref to
+	(px, py) through the pixel map, map(px, py) - map(ref), in
+	motor steps. Corrections already sent but not finished at t
+	(positionEstimate() against where they take the stage) aren't
+	in the frame yet and are taken off it, so a slow frame rate
+	or a long latency doesn't make the loop overshoot. Of what
+	remains, kp is sent plus ki times the sum of the errors so
+	far; GUIDEPREDICT adds the star's drift rate, fitted over the
+	frames, times the frame interval, so a steady drift is
+	corrected for where the star will be rather than where it was.
+	A correction under deadband steps is held back, and one at
+	least that large is at least one step, so a deadband under
+	one step still lets small errors through. Once the frame
+	interval is known, a correction is cut to what the axis
+	profiles can finish (after the previous one) by the next
+	frame's t, and the integral isn't fed while that happens.
+
+	Statistics go in g->control and, at debug level, a line per
+	frame to the guide log category.
+
+	Returns 1 if a correction was queued, 0 if none was needed or
+	it couldn't be, -1 if not guiding or there's no pixel map.
+	Only the thread calling guideOffset() may call guideFrame(),
+	and only guideFrame() should call guideOffset() while it runs.
+
+-------------------------------------------------------------------*/
+int guideFrame(g, t, px, py)
+struct guider *g;
+double t;
+float px, py;
+{
+
+	int axis, i, queued, trimmed;
+	long int steps[LASTAXIS + 1], lo, hi, mid;
+	float u[2], v[2], x[2], y[2];
+	double err[LASTAXIS + 1], now, start, available, lead, est, sigma, pending, want, ks, moveTime, dt;
+	struct guideControl *gc;
+
+	gc = &g->control;
+	if (!g->guide.run || g->pixelMapTerms == 0) {
+		return(-1);
+	}
+	now = hostSeconds();
+	if (t <= 0.0) {
+		t = now;
+	}
+	dt = (gc->lastT > 0.0) ? t - gc->lastT : 0.0;
+	if (dt > 0.0) {
+		gc->period = (gc->period > 0.0) ? gc->period + GUIDESMOOTH * (dt - gc->period) : dt;
+	}
+
+	// The stage move that follows the star, in steps (see encoderTarget())
+	u[0] = gc->ref[0]; v[0] = gc->ref[1];
+	u[1] = px; v[1] = py;
+	pixelsToInches(g, 2, u, v, x, y);
+	err[XAXIS] = -(x[1] - x[0]) * axisTable[XAXIS].encPerTurn / axisTable[XAXIS].pitch / g->encPerStep[XAXIS];
+	err[YAXIS] = -(y[1] - y[0]) * axisTable[YAXIS].encPerTurn / axisTable[YAXIS].pitch / g->encPerStep[YAXIS];
+
+	// Time left for a correction: it starts once the last one is done
+	start = now + GUIDEPERIOD;
+	if (gc->busyUntil > start) {
+		start = gc->busyUntil;
+	}
+	available = t + gc->period - start;
+	lead = (gc->mode == GUIDEPREDICT) ? gc->period : 0.0;
+
+	trimmed = 0;
+	moveTime = 0.0;
+	for (axis = XAXIS; axis <= YAXIS; axis++) {
+		est = gc->target[axis];
+		positionEstimate(g, axis, t, &est, &sigma);
+		pending = gc->target[axis] - est;
+		if (dt > 0.0) {
+			gc->rate[axis] += GUIDESMOOTH * ((err[axis] + est - gc->origin[axis] - gc->drift[axis]) / dt -
+				gc->rate[axis]);
+		}
+		gc->drift[axis] = err[axis] + est - gc->origin[axis];
+		err[axis] -= pending;
+
+		want = gc->kp * (err[axis] + gc->rate[axis] * lead) + gc->ki * (gc->integral[axis] + err[axis]);
+		steps[axis] = 0;
+		if (fabs(want) >= gc->deadband) {
+			steps[axis] = (long int) floor(fabs(want) + 0.5);
+			if (steps[axis] == 0) {
+				steps[axis] = 1;
+			}
+		}
+
+		// The most steps that finish in time (profileTime() grows with steps)
+		ks = findParam(g, "KS")->value[axis - XAXIS];
+		if (steps[axis] && gc->period > 0.0 &&
+			profileTime(steps[axis], &g->axisProfile[axis], ks) > available) {
+			lo = 0;
+			hi = steps[axis];
+			while (hi - lo > 1) {
+				mid = (lo + hi) / 2;
+				if (profileTime(mid, &g->axisProfile[axis], ks) <= available) {
+					lo = mid;
+				} else {
+					hi = mid;
+				}
+			}
+			steps[axis] = lo;
+			trimmed = 1;
+		} else {
+			gc->integral[axis] += err[axis];
+		}
+		if (want < 0.0) {
+			steps[axis] = -steps[axis];
+		}
+		if (profileTime(steps[axis], &g->axisProfile[axis], ks) > moveTime) {
+			moveTime = profileTime(steps[axis], &g->axisProfile[axis], ks);
+		}
+	}
+
+	gc->trimmed += trimmed;
+	queued = 0;
+	if (steps[XAXIS] || steps[YAXIS]) {
+		if (guideOffset(g, steps[XAXIS], steps[YAXIS])) {
+			gc->target[XAXIS] += steps[XAXIS];
+			gc->target[YAXIS] += steps[YAXIS];
+			gc->busyUntil = start + moveTime;
+			gc->moves++;
+			queued = 1;
+		}
+	} else {
+		gc->held++;
+	}
+	statAdd(&gc->latency, hostSeconds() - t);
+
+	gc->frames++;
+	for (i = 0; i < 2; i++) {
+		want = (i == 0) ? px - gc->ref[0] : py - gc->ref[1];
+		gc->errSum[i] += want;
+		gc->errSumSq[i] += want * want;
+		if (fabs(want) > gc->errMax) {
+			gc->errMax = fabs(want);
+		}
+	}
+	gc->lastT = t;
+	LOG(g, LOGGUIDE, LOGDEBUG, "frame %ld error %.3f %.3f px, remaining %.1f %.1f steps, sent %ld %ld, %.1f ms",
+		gc->frames, px - gc->ref[0], py - gc->ref[1], err[XAXIS], err[YAXIS], steps[XAXIS], steps[YAXIS],
+		1.0e3 * (hostSeconds() - t));
+	return(queued);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int guideOffset(g, long int dx, long int dy) (LIBRARY)
+
+	guideOffset queues a guide correction of (dx, dy) X and Y motor
+	steps for the guide thread (guideStart()) and returns at once;
+	it never waits for the controller. Corrections that arrive
+	while the previous guide move is still running are added
+	together. Returns 1, or 0 if the queue is full (the correction
+	is dropped and counted) or guiding is off.
+
+	Only one thread may call guideOffset() for a guider.
+
+-------------------------------------------------------------------*/
+int guideOffset(g, dx, dy)
+struct guider *g;
+long int dx, dy;
+{
+
+	struct guideLoop *gl;
+	unsigned int head;
+
+	gl = &g->guide;
+	if (!gl->run) {
+		return(0);
+	}
+	head = gl->head;
+	if (head - __atomic_load_n(&gl->tail, __ATOMIC_ACQUIRE) >= GUIDERING) {
+		gl->dropped++;
+		return(0);
+	}
+	gl->ring[head % GUIDERING].t = hostSeconds();
+	gl->ring[head % GUIDERING].dx = dx;
+	gl->ring[head % GUIDERING].dy = dy;
+	__atomic_store_n(&gl->head, head + 1, __ATOMIC_RELEASE);
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int guideStart(g, int cpu) (LIBRARY)
+
+	guideStart powers the X and Y motors (brakes off) and starts
+	the guide thread, which wakes every GUIDEPERIOD seconds and
+	applies queued guideOffset() corrections as relative moves.
+	guideFrame()'s control law starts over from the stage's
+	position, holding the star at its ref pixel (the pixel map
+	center unless one was set).
+	It runs at SCHED_FIFO priority GUIDEPRIO, pinned to cpu if cpu
+	is 0 or more, with the process's memory locked, and does no
+	terminal I/O. Real-time scheduling and locking need privileges;
+	without them the thread runs normally (see guide.realtime and
+	guide.locked; guide.cpu is -1 if it could not be pinned).
+	Statistics start from zero.
+
+	Don't move X or Y from elsewhere while guiding.
+
+	Returns 1 if guiding is running, 0 if not calibrated or the
+	thread could not be started.
+
+-------------------------------------------------------------------*/
+int guideStart(g, cpu)
+struct guider *g;
+int cpu;
+{
+
+	int axis;
+	double sigma;
+	struct guideLoop *gl;
+	struct guideControl *gc;
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t cpus;
+
+	gl = &g->guide;
+	if (gl->run) {
+		return(1);
+	}
+	if (!g->isCalibrated) {
+		return(0);
+	}
+	gl->head = gl->tail = 0;
+	gl->applied = gl->dropped = 0;
+	memset(&gl->wake, 0, sizeof(gl->wake));
+	memset(&gl->latency, 0, sizeof(gl->latency));
+
+#ifdef MCL_CURRENT
+	gl->locked = (mlockall(MCL_CURRENT | MCL_FUTURE) == 0);
+#else
+	gl->locked = 0;
+#endif
+
+	// Motors stay on while guiding, so corrections don't wait for brakes
+	if (!(g->poweredAxes & (1 << XAXIS))) {
+		motorPower(g, XAXIS, ON);
+	}
+	if (!(g->poweredAxes & (1 << YAXIS))) {
+		motorPower(g, YAXIS, ON);
+	}
+
+	gc = &g->control;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		gc->target[axis] = 0.0;
+		positionEstimate(g, axis, hostSeconds(), &gc->target[axis], &sigma);
+		gc->origin[axis] = gc->target[axis];
+		gc->integral[axis] = gc->rate[axis] = gc->drift[axis] = 0.0;
+	}
+	gc->lastT = gc->period = gc->busyUntil = 0.0;
+	gc->frames = gc->moves = gc->held = gc->trimmed = 0;
+	gc->errSum[0] = gc->errSum[1] = gc->errSumSq[0] = gc->errSumSq[1] = gc->errMax = 0.0;
+	memset(&gc->latency, 0, sizeof(gc->latency));
+	if (!gc->refSet) {
+		gc->ref[0] = g->pixelMapCenter[0];
+		gc->ref[1] = g->pixelMapCenter[1];
+	}
+
+	gl->run = 1;
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	param.sched_priority = GUIDEPRIO;
+	pthread_attr_setschedparam(&attr, &param);
+	gl->realtime = 1;
+	if (pthread_create(&gl->tid, &attr, guideThread, g) != 0) {
+		gl->realtime = 0;	// Probably not allowed; run it normally
+		if (pthread_create(&gl->tid, NULL, guideThread, g) != 0) {
+			gl->run = 0;
+			pthread_attr_destroy(&attr);
+			return(0);
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	gl->cpu = -1;
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (pthread_setaffinity_np(gl->tid, sizeof(cpus), &cpus) == 0) {
+			gl->cpu = cpu;
+		}
+	}
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void guideStop(g) (LIBRARY)
+
+	Stops the guide thread, waits for its last move and powers
+	down X and Y (brakes on). Queued corrections are discarded.
+
+-------------------------------------------------------------------*/
+void guideStop(g)
+struct guider *g;
+{
+
+	if (!g->guide.run) {
+		return;
+	}
+	g->guide.run = 0;
+	pthread_join(g->guide.tid, NULL);
+	motorPower(g, XAXIS, OFF);
+	motorPower(g, YAXIS, OFF);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void *guideThread(void *g) (LIBRARY)
+
+	The guide thread started by guideStart(). Every GUIDEPERIOD
+	seconds (absolute deadlines, so it doesn't drift) it records how
+	late it woke, takes the queued corrections and, once the last
+	guide move is predicted to be over (moveETA(), no controller
+	traffic), starts one relative move for their sum. Everything it
+	touches is preallocated; its only system calls are the sleep
+	and the Galil socket I/O.
+
+-------------------------------------------------------------------*/
+void *guideThread(arg)
+void *arg;
+{
+
+	struct guider *g;
+	struct guideLoop *gl;
+	struct guideCorrection *c;
+	struct timespec next;
+	unsigned int tail;
+	int axes;
+	long int dx, dy;
+	double due, oldest;
+
+	g = (struct guider *) arg;
+	gl = &g->guide;
+	dx = dy = 0;
+	oldest = 0.0;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (gl->run) {
+		next.tv_nsec += (long) (GUIDEPERIOD * 1.0e9);
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		due = (double) next.tv_sec + 1.0e-9 * (double) next.tv_nsec;
+		statAdd(&gl->wake, hostSeconds() - due);
+
+		tail = gl->tail;
+		while (tail != __atomic_load_n(&gl->head, __ATOMIC_ACQUIRE)) {
+			c = &gl->ring[tail % GUIDERING];
+			if (dx == 0 && dy == 0) {
+				oldest = c->t;
+			}
+			dx += c->dx;
+			dy += c->dy;
+			tail++;
+		}
+		__atomic_store_n(&gl->tail, tail, __ATOMIC_RELEASE);
+
+		if ((dx || dy) && moveETA(g, XAXIS) == 0.0 && moveETA(g, YAXIS) == 0.0) {
+			axes = 0;
+			if (dx) {
+				prepareMove(g, XAXIS, (int) dx, g->axisProfile[XAXIS].speed);
+				axes |= (1 << XAXIS);
+			}
+			if (dy) {
+				prepareMove(g, YAXIS, (int) dy, g->axisProfile[YAXIS].speed);
+				axes |= (1 << YAXIS);
+			}
+			beginAxes(g, axes);
+			statAdd(&gl->latency, hostSeconds() - oldest);
+			gl->applied++;
+			dx = dy = 0;
+		}
+	}
+	waitAxes(g, (1 << XAXIS) | (1 << YAXIS));
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void guideUser(g) (USER)
+
+	Asks for a guiding action: start (optionally pinned to a CPU),
+	stop, queue an offset, feed a frame's centroid to the control
+	law, set the law (gains, "p" to predict), its deadband or the
+	reference pixel, or print the statistics.
+
+-------------------------------------------------------------------*/
+void guideUser(g)
+struct guider *g;
+{
+
+	char buf[80], predict[8];
+	int cpu, i;
+	long int dx, dy;
+	float px, py;
+	double kp, ki, d;
+	struct guideControl *gc;
+
+	gc = &g->control;
+	printf("guide: s)tart [cpu], x) stop, o)ffset dx dy, f)rame px py, l)aw kp ki [p],\n"
+		"       d)eadband steps, r)eference px py, j)itter stats: ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return;
+	}
+	if (buf[0] == 's') {
+		if (sscanf(buf + 1, "%d", &cpu) != 1) {
+			cpu = -1;
+		}
+		if (!guideStart(g, cpu)) {
+			printf("can't start guiding (calibrated?)\n");
+		} else {
+			printf("guiding: %s, %s, cpu %d\n",
+				g->guide.realtime ? "SCHED_FIFO" : "not real-time",
+				g->guide.locked ? "memory locked" : "memory not locked", g->guide.cpu);
+			if (cpu >= 0 && g->guide.cpu != cpu) {
+				printf("can't pin the guide thread to cpu %d\n", cpu);
+			}
+		}
+	} else if (buf[0] == 'x') {
+		guideStop(g);
+	} else if (buf[0] == 'o') {
+		if (sscanf(buf + 1, "%ld %ld", &dx, &dy) == 2 && !guideOffset(g, dx, dy)) {
+			printf("not queued (guiding off or queue full)\n");
+		}
+	} else if (buf[0] == 'f') {
+		if (sscanf(buf + 1, "%f %f", &px, &py) == 2 && guideFrame(g, 0.0, px, py) < 0) {
+			printf("not guiding, or no pixel map\n");
+		}
+	} else if (buf[0] == 'l') {
+		i = sscanf(buf + 1, "%lf %lf %7s", &kp, &ki, predict);
+		if (i >= 2) {
+			gc->kp = kp;
+			gc->ki = ki;
+			gc->mode = (i == 3 && predict[0] == 'p') ? GUIDEPREDICT : GUIDEPI;
+		}
+		printf("law %s kp %.3f ki %.3f\n", (gc->mode == GUIDEPREDICT) ? "predict" : "PI", gc->kp, gc->ki);
+	} else if (buf[0] == 'd') {
+		if (sscanf(buf + 1, "%lf", &d) == 1 && d >= 0.0) {
+			gc->deadband = d;
+		}
+		printf("deadband %.2f steps\n", gc->deadband);
+	} else if (buf[0] == 'r') {
+		if (sscanf(buf + 1, "%f %f", &px, &py) == 2) {
+			gc->ref[0] = px;
+			gc->ref[1] = py;
+			gc->refSet = 1;
+		}
+		printf("reference pixel %.2f %.2f\n", gc->ref[0], gc->ref[1]);
+	} else if (buf[0] == 'j') {
+		printf("%ld moves, %ld dropped, %s\n", g->guide.applied, g->guide.dropped,
+			g->guide.realtime ? "SCHED_FIFO" : "not real-time");
+		statPrint("wakeup lateness", &g->guide.wake);
+		statPrint("correction latency", &g->guide.latency);
+		if (gc->frames) {
+			printf("%ld frames, %.1f ms apart: %ld corrected, %ld held, %ld cut short for time\n",
+				gc->frames, 1.0e3 * gc->period, gc->moves, gc->held, gc->trimmed);
+			for (i = 0; i < 2; i++) {
+				d = gc->errSum[i] / gc->frames;
+				printf("%c error mean %.3f rms %.3f px\n", i ? 'y' : 'x', d,
+					sqrt(gc->errSumSq[i] / gc->frames));
+			}
+			printf("largest error %.3f px\n", gc->errMax);
+			statPrint("frame to correction", &gc->latency);
+		}
+	}
+	fflush(stdout);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void guiderCommand(g, cmd) (USER)
+
+	Runs the one-key command cmd (see help()) on guider g.
+
+-------------------------------------------------------------------*/
+void guiderCommand(g, cmd)
+struct guider *g;
+int cmd;
+{
+
+	if (cmd == 'j') {		// Background job progress
+		jobPrint(g);
+	} else if (cmd == 'x') {	// Abort the job, or just stop
+		printf("abort\n");
+		fflush(stdout);
+		if (g->job.active) {
+			jobCancel(g);
+		} else {
+			stopMotors(g);
+		}
+	} else if (g->job.active && cmd != '?') {
+		printf("%s is busy: j for progress, x to abort\n", g->name);
+		fflush(stdout);
+	} else if (cmd == 'a') {	// Insert the small aperture
+		printf("aperture, small");
+		fflush(stdout);
+		smallAp(g);
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 'A') {	// Insert the field lens
+		printf("field lens");
+		fflush(stdout);
+		fieldLens(g);
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 'B') {	// Back off limits
+		printf("Backoff limits");
+		fflush(stdout);
+		backOff(g);
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 'c') {	// center field
+		printf("center field");
+		fflush(stdout);
+		centerField(g);
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 'C') {	// Calibrate
+		printf("Calibrate (in the background)\n");
+		jobStart(g, JOBCALIBRATE);
+	} else if (cmd == 'D') {	// Demo mode 
+		printf("Demo (in the background)\n");
+		jobStart(g, JOBDEMO);
+	} else if (cmd == 'f') {	// focus relative
+		focus(g, FOCUSREL);
+	} else if (cmd == 'F') {	// Focus to absolute position
+		focus(g, FOCUSABS);
+	} else if (cmd == 'G') {	// Guide thread
+		guideUser(g);
+	} else if (cmd == 'H') {	// Home the X and Y axes
+		printf("Home (in the background)\n");
+		jobStart(g, JOBHOME);
+	} else if (cmd == 'i') {	// Initialize
+		printf("initializing");
+		fflush(stdout);
+		initGuider(g);
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 'l') {	// Set up LED with S-H
+		printf("led ");
+		if (ledInOut(g, STATUS) == IN) {
+			ledInOut(g, OUT);
+			printf("out.\n");
+		} else {
+			ledInOut(g, IN);
+			printf("in.\n");
+		}
+		fflush(stdout);
+	} else if (cmd == 'L') {	// Visit a list of targets
+		targetListUser(g);
+	} else if (cmd == 'm') {	// relative position move
+		move(g, RELATIVE);
+	} else if (cmd == 'M') {	// absolute position move
+		move(g, ABSOLUTE);
+	} else if (cmd == 'P') {	// Characterize motion profiles
+		printf("Profile X and Y axes");
+		fflush(stdout);
+		characterize(g, XAXIS);
+		characterize(g, YAXIS);
+		printf(".\n");
+		printf("X: speed %ld accel %ld decel %ld, brake %.3f s on %.3f s off\n",
+			g->axisProfile[XAXIS].speed, g->axisProfile[XAXIS].accel, g->axisProfile[XAXIS].decel,
+			g->brakeEngage[XAXIS], g->brakeRelease[XAXIS]);
+		printf("Y: speed %ld accel %ld decel %ld, brake %.3f s on %.3f s off\n",
+			g->axisProfile[YAXIS].speed, g->axisProfile[YAXIS].accel, g->axisProfile[YAXIS].decel,
+			g->brakeEngage[YAXIS], g->brakeRelease[YAXIS]);
+		fflush(stdout);
+	} else if (cmd == 'R') {	// Reset
+		printf("Reset");
+		fflush(stdout);
+		resetGalil(g);
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 'S') {	// Self check
+		printf("Self check (in the background)\n");
+		jobStart(g, JOBSELFCHECK);
+	} else if (cmd == 's') {	// Set up for Shack-Hartmann
+		printf("shack-Hartmann lenslets in");
+		fflush(stdout);
+		shCam(g);
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 't') {	// Time-tagged moves
+		scheduleUser(g);
+	} else if (cmd == 'T') {	// Run the Test function
+		printf("Test function");
+		fflush(stdout);
+		testFunction(g);
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 'U') {	// Autofocus sweep
+		autofocusUser(g);
+	} else if (cmd == 'w') {	// Set up for wide field viewing
+		printf("wide field camera");
+		fflush(stdout);
+		fieldCam(g);
+		printf(".\n");
+		fflush(stdout);
+	} else if (cmd == 'X') {	// Detector pixel to stage transform
+		pixelMapUser(g);
+	} else if (cmd == 'Z') {	// Focus map
+		focusMapUser(g);
+	} else if (cmd == '?') {	// status
+		statusPrint(g);
+	} else if (cmd == ':') {	// Talk directly to the Galil
+		passthru(g);
+	} else {
+		printf("%c? Type \"h\" for command list help\n", cmd);
+		fflush(stdout);
+	}
+
+}
+
+
+/*-------------------------------------------------------------------
+
+	consoleExpose(hook, z), consoleReadout(hook, metric) (USER)
+
+	Exposure hook for autofocus() with a person at the camera:
+	consoleExpose asks for an exposure and waits for return,
+	consoleReadout asks for the focus metric.
+
+-------------------------------------------------------------------*/
+int consoleExpose(hook, z)
+struct exposureHook *hook;
+long int z;
+{
+
+	char buf[80];
+
+	printf("focus %ld: expose, then press return ", z);
+	fflush(stdout);
+	return(getLine(buf, sizeof(buf)) != NULL);
+
+}
+
+int consoleReadout(hook, metric)
+struct exposureHook *hook;
+double *metric;
+{
+
+	char buf[80];
+
+	printf("focus metric: ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return(0);
+	}
+	*metric = atof(buf);
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int creepToLimits(g, axis, steps, speed); (LIBRARY)
+
+	creepToLimits moves the selected motor axis in increments of
+	"steps" at the selected "speed" until that axis's limit switch
+	changes state. Note that the limit switch may alread be engaged
+	so a change of state could be from engaged to not engaged.
+
+	Pay attention the step direction since you don't want to travel
+	the full length of the stage at slow speed.
+
+	Returns 1 for success, 0 if you used a bad axis value, the
+	step size was small and the process timed out before
+	reaching the limit, or the job was cancelled (jobCancel()).
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+int creepToLimits(g, axis, steps, speed)
+struct guider *g;
+int axis, steps, speed;
+{
+
+	int i, oldLimits, maxLoops;
+
+	maxLoops = 200;
+
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(0);
+	}
+	i = 0;
+	oldLimits = limitSwitch(g, axis);
+	while (oldLimits == limitSwitch(g, axis) && i < maxLoops && !g->job.cancel) {	// wait until the switch changes state
+		moveOneAxis(g, axis, steps, speed);
+		while (isMoving(g, axis)) {
+		}
+		i++;
+	}
+	motorPower(g, axis, OFF);
+	g->cmdKnown &= ~(1 << axis);		// Limit may have cut the last move short
+	if (g->job.cancel) {
+		return(0);
+	}
+	if (i <= maxLoops) {
+		return(1);
+	} else {
+		return(0);
+	}
+}
+
+/*-------------------------------------------------------------------
+
+	int cylinder(g, axis, exRetStatus); (LIBRARY)
+	
+	cylinder sets or returns information on the three pneumatic
+	cylinders. "axis" should be one of Y1AXIS, Y2AXIS, or SAXIS
+	and "exRetStatus" should be one of EXTEND, RETRACT, STATUS.
+	
+	EXTEND and RETRACT cause that action to be performed. STATUS
+	returns one of EXTEND, RETRACT, UNKNOWN, BOTHSENSORS, or
+	BADAXIS. UNKNOWN and BOTHSENSORS probably indicate a
+	timeout situation due to low air pressure. BADAXIS means
+	that you called the routine with an invalid axis.
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+int cylinder(g, axis, extRetStatus)
+struct guider *g;
+int axis, extRetStatus;
+{
+
+	int i, status, y1e, y1r, y2e, y2r;
+
+	if (extRetStatus == STATUS) {
+
+		status = ~askGalilForInt(g, "TI0");
+		y1e = ((status>>4) & 0x01);
+		y1r = ((status>>5) & 0x01);
+		y2e = ((status>>2) & 0x01);
+		y2r = ((status>>3) & 0x01);
+
+		if ((y1e == y1r) || (y2e == y2r)) {
+			return(BOTHSENSORS);
+		}
+
+		switch(axis) {
+
+			case Y1AXIS:
+				if (y1e) {
+					return(EXTEND);
+				} else {
+					return(RETRACT);
+				}
+
+			case Y2AXIS:
+				if (y2e) {
+					return(EXTEND);
+				} else {
+					return(RETRACT);
+				}
+
+			case SAXIS:
+				return(g->sAxisStatus);
+
+			default:
+				return(BADAXIS);
+
+		}
+
+	} else if (extRetStatus == RETRACT) {
+		switch(axis) {
+			case Y1AXIS:
+				tellGalil(g, "CB7;SB8");
+				for (i = 0; i < 50; i++) {
+					usleep(100000);
+					status = ~askGalilForInt(g, "TI0");
+					y1e = ((status>>4) & 0x01);
+					y1r = ((status>>5) & 0x01);
+					if (y1r && !y1e) {
+						return(RETRACT);
+					}
+				}
+				return(UNKNOWN);
+
+			case Y2AXIS:
+				tellGalil(g, "SB5;CB6");
+				for (i = 0; i < 50; i++) {
+					usleep(100000);
+					status = ~askGalilForInt(g, "TI0");
+					y2e = ((status>>2) & 0x01);
+					y2r = ((status>>3) & 0x01);
+					if (y2r && !y2e) {
+						return(RETRACT);
+					}
+				}
+				return(UNKNOWN);
+
+			case SAXIS:
+				tellGalil(g, "CB3");
+				g->sAxisStatus = RETRACT;
+				sleep(1);
+				return(RETRACT);
+
+			default:
+				return(BADAXIS);
+		}
+
+	} else if (extRetStatus == EXTEND) {
+
+		switch(axis) {
+
+			case Y1AXIS:
+				tellGalil(g, "SB7;CB8");
+				for (i = 0; i < 50; i++) {
+					usleep(100000);
+					status = ~askGalilForInt(g, "TI0");
+					y1e = ((status>>4) & 0x01);
+					y1r = ((status>>5) & 0x01);
+					if (y1e && !y1r) {
+						return(EXTEND);
+					}
+				}
+				return(UNKNOWN);
+
+			case Y2AXIS:
+				tellGalil(g, "CB5;SB6");
+				for (i = 0; i < 50; i++) {
+					usleep(100000);
+					status = ~askGalilForInt(g, "TI0");
+					y2e = ((status>>2) & 0x01);
+					y2r = ((status>>3) & 0x01);
+					if (y2e && !y2r) {
+						return(EXTEND);
+					}
+				}
+				return(UNKNOWN);
+
+			case SAXIS:
+				tellGalil(g, "SB3");
+				g->sAxisStatus = EXTEND;
+				sleep(1);
+				return(EXTEND);
+
+			default:
+				return(BADAXIS);
+		} 
+	} else {
+		return(BADAXIS);
+	}
+}
+
+/*-------------------------------------------------------------------
+
+	void daemonClose(int client) (LIBRARY)
+
+	Closes a daemon client connection and frees its slot. Its
+	queued commands still run; their replies are dropped.
+
+-------------------------------------------------------------------*/
+void daemonClose(client)
+int client;
+{
+
+	pthread_mutex_lock(&clientLock);
+	close(clients[client].fd);
+	clients[client].fd = -1;
+	pthread_mutex_unlock(&clientLock);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void daemonLine(int client, char *line) (LIBRARY)
+
+	Handles one request line from a daemon client. A request is
+	"tag command": tag is any word the client chooses (up to 15
+	characters), echoed at the start of the reply, and command is
+	one of
+
+		stop			priority: stop the motors, drop the queue
+		status			from the snapshot, no controller query
+		guider n		send this client's commands to guider n
+		anything batchParse() takes, e.g. "moverel 100 0"
+
+	stop, status and guider are answered at once. Other commands
+	are checked, queued for the guider's daemonWorker() and
+	answered when they finish. A reply is "tag ok ..." or
+	"tag err message".
+
+-------------------------------------------------------------------*/
+void daemonLine(client, line)
+int client;
+char *line;
+{
+
+	char tag[16], reply[BATCHLINE + 96], *cp, *msg;
+	struct daemonClient *c;
+	struct daemonRequest r;
+	struct cmdQueue *q;
+	struct guider *g;
+
+	c = &clients[client];
+	line[strcspn(line, "\r")] = '\0';
+	if (sscanf(line, "%15s", tag) != 1) {
+		return;				// Blank line
+	}
+	cp = line + strspn(line, " \t");
+	cp += strcspn(cp, " \t");
+	cp += strspn(cp, " \t");
+	if (*cp == '\0') {
+		daemonReply(client, c->serial, tag, "err no command");
+		return;
+	}
+	if (strlen(cp) >= BATCHLINE) {
+		daemonReply(client, c->serial, tag, "err too long");
+		return;
+	}
+
+	if (strncmp(cp, "stop", 4) == 0 && strspn(cp + 4, " \t") == strlen(cp + 4)) {
+		daemonStop(&guiders[c->guider]);
+		daemonReply(client, c->serial, tag, "ok");
+		return;
+	}
+	memset(&r, 0, sizeof(r));
+	if ((msg = batchParse(cp, &r.cmd, &c->guider))) {
+		sprintf(reply, "err %s", msg);
+		daemonReply(client, c->serial, tag, reply);
+		return;
+	}
+	g = &guiders[r.cmd.guider];
+	if (r.cmd.op == BATCHGUIDER) {
+		daemonReply(client, c->serial, tag, "ok");
+		return;
+	}
+	if (r.cmd.op == BATCHSTATUS) {
+		daemonStatus(g, reply);
+		daemonReply(client, c->serial, tag, reply);
+		return;
+	}
+
+	strcpy(r.cmd.text, cp);
+	r.client = client;
+	r.serial = c->serial;
+	strcpy(r.tag, tag);
+	q = &g->queue;
+	pthread_mutex_lock(&q->lock);
+	if (q->head - q->tail >= MAXQUEUE) {
+		pthread_mutex_unlock(&q->lock);
+		daemonReply(client, c->serial, tag, "err queue full");
+		return;
+	}
+	q->req[q->head++ % MAXQUEUE] = r;
+	pthread_cond_signal(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int daemonMain(char *path) (USER)
+
+	Runs aoguider as a daemon instead of cmdLoop(): it keeps the
+	controller connections and serves up to MAXCLIENTS local
+	clients on the Unix socket "path", one request per line (see
+	daemonLine()). Each guider gets a daemonWorker() thread that
+	runs its queued commands in order and a daemonSnapshot()
+	thread that keeps its status current, so this thread only
+	reads requests and never waits for motion; a stop is acted on
+	as soon as it arrives. Returns 1 if the socket can't be set
+	up, otherwise it doesn't return.
+
+-------------------------------------------------------------------*/
+int daemonMain(path)
+char *path;
+{
+
+	struct sockaddr_un addr;
+	struct pollfd fds[MAXCLIENTS + 1];
+	struct daemonClient *c;
+	struct guider *g;
+	pthread_t tid;
+	unsigned int serial;
+	int lfd, fd, i, n, got;
+	char *cp;
+
+	signal(SIGPIPE, SIG_IGN);		// A client that went away
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+		|| bind(lfd, (struct sockaddr *) &addr, sizeof(addr))
+		|| listen(lfd, MAXCLIENTS)) {
+		printf("can't listen on %s\n", path);
+		return(1);
+	}
+	fcntl(lfd, F_SETFD, FD_CLOEXEC);
+	for (i = 0; i < MAXCLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+	for (i = 0; i < nGuiders; i++) {
+		g = &guiders[i];
+		pthread_mutex_init(&g->queue.lock, NULL);
+		pthread_cond_init(&g->queue.ready, NULL);
+		pthread_mutex_init(&g->queue.snap.lock, NULL);
+		pthread_create(&tid, NULL, daemonWorker, g);
+		pthread_detach(tid);
+		pthread_create(&tid, NULL, daemonSnapshot, g);
+		pthread_detach(tid);
+	}
+	printf("listening on %s\n", path);
+	fflush(stdout);
+
+	serial = 0;
+	for (;;) {
+		fds[0].fd = lfd;
+		fds[0].events = POLLIN;
+		for (i = 0; i < MAXCLIENTS; i++) {
+			fds[i + 1].fd = clients[i].fd;	// poll() skips -1
+			fds[i + 1].events = POLLIN;
+			fds[i + 1].revents = 0;
+		}
+		if (poll(fds, MAXCLIENTS + 1, -1) <= 0) {
+			continue;
+		}
+
+		if ((fds[0].revents & POLLIN) && (fd = accept(lfd, NULL, NULL)) >= 0) {
+			for (i = 0; i < MAXCLIENTS && clients[i].fd >= 0; i++) {
+			}
+			if (i == MAXCLIENTS) {
+				close(fd);		// Full up
+			} else {
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				pthread_mutex_lock(&clientLock);
+				clients[i].fd = fd;
+				clients[i].serial = ++serial;
+				clients[i].guider = 0;
+				clients[i].len = 0;
+				pthread_mutex_unlock(&clientLock);
+			}
+		}
+
+		for (i = 0; i < MAXCLIENTS; i++) {
+			c = &clients[i];
+			if (c->fd < 0 || !(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+			got = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+			if (got <= 0) {
+				daemonClose(i);
+				continue;
+			}
+			c->len += got;
+			c->buf[c->len] = '\0';
+			while ((cp = strchr(c->buf, '\n'))) {
+				*cp = '\0';
+				n = cp - c->buf + 1;
+				daemonLine(i, c->buf);
+				memmove(c->buf, c->buf + n, c->len - n + 1);
+				c->len -= n;
+			}
+			if (c->len == sizeof(c->buf) - 1) {
+				daemonReply(i, c->serial, "-", "err line too long");
+				c->len = 0;
+			}
+		}
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	void daemonReply(client, serial, tag, text) (LIBRARY)
+
+	Sends "tag text" to a daemon client, unless the connection it
+	was meant for (serial) has closed. Never blocks: a client that
+	doesn't read its replies loses them.
+
+-------------------------------------------------------------------*/
+void daemonReply(client, serial, tag, text)
+int client;
+unsigned int serial;
+char *tag, *text;
+{
+
+	char buf[BATCHLINE + 128];
+
+	snprintf(buf, sizeof(buf), "%s %s\n", tag, text);
+	pthread_mutex_lock(&clientLock);
+	if (clients[client].fd >= 0 && clients[client].serial == serial) {
+		send(clients[client].fd, buf, strlen(buf), MSG_DONTWAIT);
+	}
+	pthread_mutex_unlock(&clientLock);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void *daemonSnapshot(void *g) (LIBRARY)
+
+	Thread for daemonMain(): every SNAPPERIOD seconds reads the
+	step positions, encoders and motion flags of guider g in one
+	batched query into g->queue.snap for daemonStatus().
+
+-------------------------------------------------------------------*/
+void *daemonSnapshot(arg)
+void *arg;
+{
+
+	char ops[3 * LASTAXIS][8], *operands[3 * LASTAXIS];
+	double vals[3 * LASTAXIS];
+	int axis, i, n;
+	struct guider *g;
+	struct guiderSnapshot *sn;
+
+	g = (struct guider *) arg;
+	sn = &g->queue.snap;
+	n = 0;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		sprintf(ops[n++], "_RP%c", axisTable[axis].letter);
+		sprintf(ops[n++], "_BG%c", axisTable[axis].letter);
+		if (axisTable[axis].encPerTurn) {
+			sprintf(ops[n++], "_TP%c", axisTable[axis].letter);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		operands[i] = ops[i];
+	}
+
+	for (;;) {
+		if (askGalilForValues(g, operands, n, vals) == n) {
+			pthread_mutex_lock(&sn->lock);
+			sn->moving = 0;
+			sn->t = hostSeconds();
+			for (i = 0, axis = XAXIS; axis <= LASTAXIS; axis++) {
+				sn->step[axis] = (long int) vals[i++];
+				if (vals[i++] != 0.0) {
+					sn->moving |= (1 << axis);
+				}
+				sn->enc[axis] = axisTable[axis].encPerTurn ? (long int) vals[i++] : 0L;
+				estimateStep(g, axis, sn->t, sn->step[axis]);
+				if (axisTable[axis].encPerTurn) {
+					estimateEncoder(g, axis, sn->t, sn->enc[axis]);
+				}
+			}
+			pthread_mutex_unlock(&sn->lock);
+		}
+		usleep((useconds_t) (SNAPPERIOD * 1.0e6));
+	}
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void daemonStatus(struct guider *g, char *buf) (LIBRARY)
+
+	Formats the status reply for guider g from its snapshot and
+	queue, e.g. "ok G1 age 0.08 cal 1 busy moverel queued 2
+	moving XY X 1200 4810 Y -300 -1190 Z 0". Each axis has its step
+	position and, if it has an encoder, the encoder reading.
+
+-------------------------------------------------------------------*/
+void daemonStatus(g, buf)
+struct guider *g;
+char *buf;
+{
+
+	int axis, busy, queued;
+	struct guiderSnapshot *sn;
+
+	pthread_mutex_lock(&g->queue.lock);
+	busy = g->queue.busy;
+	queued = g->queue.head - g->queue.tail;
+	pthread_mutex_unlock(&g->queue.lock);
+
+	sn = &g->queue.snap;
+	pthread_mutex_lock(&sn->lock);
+	if (sn->t == 0.0) {
+		pthread_mutex_unlock(&sn->lock);
+		strcpy(buf, "err no status yet");
+		return;
+	}
+	sprintf(buf, "ok %s age %.2f cal %d busy %s queued %d moving ", g->name,
+		hostSeconds() - sn->t, g->isCalibrated, busy ? batchVerbs[busy].name : "-", queued);
+	if (sn->moving == 0) {
+		strcat(buf, "-");
+	}
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (sn->moving & (1 << axis)) {
+			sprintf(buf + strlen(buf), "%c", axisTable[axis].name);
+		}
+	}
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		sprintf(buf + strlen(buf), " %c %ld", axisTable[axis].name, sn->step[axis]);
+		if (axisTable[axis].encPerTurn) {
+			sprintf(buf + strlen(buf), " %ld", sn->enc[axis]);
+		}
+	}
+	pthread_mutex_unlock(&sn->lock);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void daemonStop(struct guider *g) (LIBRARY)
+
+	The daemon's priority lane: drops guider g's queued commands
+	(each gets "err stopped"), tells the running one to give up
+	(g->job.cancel, as jobCancel() does) and stops the motors. It
+	doesn't wait behind the queue, only for the controller
+	exchange in progress, if any.
+
+-------------------------------------------------------------------*/
+void daemonStop(g)
+struct guider *g;
+{
+
+	struct cmdQueue *q;
+	struct daemonRequest *r;
+
+	q = &g->queue;
+	pthread_mutex_lock(&q->lock);
+	while (q->tail != q->head) {
+		r = &q->req[q->tail++ % MAXQUEUE];
+		daemonReply(r->client, r->serial, r->tag, "err stopped");
+	}
+	if (q->busy) {
+		g->job.cancel = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	stopMotors(g);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void *daemonWorker(void *g) (LIBRARY)
+
+	Thread for daemonMain(): runs guider g's queued commands one
+	at a time with batchExec(), waits for any move to finish
+	(batchSettle()) and replies "ok seconds", "err failed seconds"
+	or, after daemonStop(), "err stopped seconds". A stopped
+	command leaves the commanded positions unknown, and a stopped
+	home or calibrate also leaves the guider uncalibrated.
+
+-------------------------------------------------------------------*/
+void *daemonWorker(arg)
+void *arg;
+{
+
+	char text[64];
+	int ok, stopped, pending[MAXGUIDERS];
+	double t0;
+	struct cmdQueue *q;
+	struct daemonRequest r;
+	struct guider *g;
+
+	g = (struct guider *) arg;
+	q = &g->queue;
+	memset(pending, 0, sizeof(pending));
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		while (q->tail == q->head) {
+			pthread_cond_wait(&q->ready, &q->lock);
+		}
+		r = q->req[q->tail++ % MAXQUEUE];
+		q->busy = r.cmd.op;
+		pthread_mutex_unlock(&q->lock);
+
+		t0 = hostSeconds();
+		ok = batchExec(&r.cmd, pending);
+		ok = batchSettle(g, &pending[r.cmd.guider]) && ok;
+
+		pthread_mutex_lock(&q->lock);
+		stopped = g->job.cancel;
+		g->job.cancel = 0;
+		q->busy = 0;
+		pthread_mutex_unlock(&q->lock);
+		if (stopped) {
+			g->cmdKnown = 0;
+			if (r.cmd.op == BATCHHOME || r.cmd.op == BATCHCALIBRATE) {
+				g->isCalibrated = 0;
+				g->homeTime = -9999;
+			}
+		}
+		sprintf(text, "%s %.3f", stopped ? "err stopped" : (ok ? "ok" : "err failed"),
+			hostSeconds() - t0);
+		daemonReply(r.client, r.serial, r.tag, text);
+	}
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	debug()
+	
+	Turns debug logging on or off: every category logs LOGDEBUG
+	records, or goes back to logBase.
+
+-------------------------------------------------------------------*/
+void debug()
+{
+
+	int i, level;
+
+	level = (logLevel[0] == LOGDEBUG) ? logBase : LOGDEBUG;
+	for (i = 0; i < NLOGCATS; i++) {
+		logLevel[i] = level;
+	}
+	printf(" %s", (level == LOGDEBUG) ? "on" : "off");
+	fflush(stdout);
+
+}
+
+/*-------------------------------------------------------------------
+
+	demo()
+	
+	Uses the rand() function to select random postions for the
+	three stepper motors and random states for the various pneumatic
+	cylinder positions.
+
+-------------------------------------------------------------------*/
+void demo(g)
+struct guider *g;
+{
+
+	float x, y, randomNum;
+
+	if (! g->isCalibrated) {
+		printf("Calibrate first\n");
+		return;
+	}
+
+	randomNum = (float) rand() / (float) RAND_MAX;
+	x = g->maxInches[XAXIS] * randomNum;
+	randomNum = (float) rand() / (float) RAND_MAX;
+	y = g->maxInches[YAXIS] * randomNum;
+	printf("Moving to %lf %lf\n", x, y);
+	jobPhase(g, "demo: move", 1, 2);
+	moveAbs(g, x,y);
+	if (!jobPhase(g, "demo: optics", 2, 2)) {
+		return;
+	}
+
+	randomNum = (float) rand() / (float) RAND_MAX;
+	if (randomNum > 0.5) {
+		cylinder(g, SAXIS, IN);
+		led(g, ON);
+		printf("LED on and in\n");
+	} else {
+		led(g, OFF);
+		cylinder(g, SAXIS, OUT);
+		printf("LED off and out\n");
+	}
+
+	randomNum = (float) rand() / (float) RAND_MAX;
+	if (randomNum > 0.5) {
+		smallAp(g);
+		printf("small aperture in\n");
+	} else {
+		fieldLens(g);
+		printf("field lens in\n");
+	}
+
+	randomNum = (float) rand() / (float) RAND_MAX;
+	if (randomNum > 0.5) {
+		shCam(g);
+		printf("Lenslets in\n");
+	} else {
+		fieldCam(g);
+		printf("wide field camera in\n");
+	}
+	
+	fflush(stdout);
+}
+
+/*-------------------------------------------------------------------
+
+	long int encPosition(axis)
+	
+	encPosition returns the current encoder position of the
+	selected axis. "axis" may be either XAXIS or YAXIS (the
+	focus axis does not have an encoder).
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+long int encPosition(g, axis)
+struct guider *g;
+int axis;
+{
+
+	char buf[8];
+
+	if (axis < XAXIS || axis > LASTAXIS || axisTable[axis].encPerTurn == 0) {
+		return(BADAXIS);
+	}
+	sprintf(buf, "TP%c", axisTable[axis].letter);
+	return(askGalilForLong(g, buf));
+
+}
+
+/*-------------------------------------------------------------------
+
+	long int encoderTarget(struct guider *g, int axis, float inches) (LIBRARY)
+
+	Returns the encoder reading of XAXIS or YAXIS at the absolute
+	stage position inches (see moveAbs()). inchesToEncoder() is
+	the batch version and must give the same answers.
+
+-------------------------------------------------------------------*/
+long int encoderTarget(g, axis, inches)
+struct guider *g;
+int axis;
+float inches;
+{
+
+	return(g->encOffset[axis] - (long int) (inches * ((float) axisTable[axis].encPerTurn)/axisTable[axis].pitch));
+
+}
+
+/*-------------------------------------------------------------------
+
+	void estimateAge(struct axisEstimate *e, double t) (LIBRARY)
+
+	Grows the bias variance of e by ESTDRIFT for the time from
+	e->t to t. Readings older than e->t don't age it.
+
+-------------------------------------------------------------------*/
+void estimateAge(e, t)
+struct axisEstimate *e;
+double t;
+{
+
+	if (t > e->t) {
+		if (e->t > 0.0) {
+			e->var += ESTDRIFT * (t - e->t);
+		}
+		e->t = t;
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	void estimateEncoder(struct guider *g, int axis, double t, long int enc) (LIBRARY)
+
+	Folds an encoder reading taken at hostSeconds() t into the
+	axis's bias. The reading's variance is the encoder resolution,
+	ESTENCNOISE, and, while the profile says the axis is moving,
+	the position change over ESTTIMING. Only used once the stage
+	is calibrated, since encOffset and encPerStep are needed to
+	turn counts into steps.
+
+-------------------------------------------------------------------*/
+void estimateEncoder(g, axis, t, enc)
+struct guider *g;
+int axis;
+double t;
+long int enc;
+{
+
+	double actual, k, r, v, x;
+	struct axisEstimate *e;
+
+	if (!g->isCalibrated || g->encPerStep[axis] == 0.0) {
+		return;
+	}
+	actual = (double) (enc - g->encOffset[axis]) / g->encPerStep[axis];
+	e = &g->estimate.axis[axis];
+	estimateLock(g);
+	if (e->known) {
+		estimateAge(e, t);
+		x = estimatePredict(e, t, &v);
+		r = 1.0 / (12.0 * g->encPerStep[axis] * g->encPerStep[axis]) +
+			ESTENCNOISE * ESTENCNOISE + v * v * ESTTIMING * ESTTIMING;
+		k = e->var / (e->var + r);
+		e->bias += k * (actual - x - e->bias);
+		e->var *= 1.0 - k;
+	}
+	estimateUnlock(g);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void estimateLock(struct guider *g) (LIBRARY)
+	void estimateUnlock(struct guider *g) (LIBRARY)
+
+	Bracket a change to g->estimate. seq is odd in between, which
+	tells positionEstimate() to try again.
+
+-------------------------------------------------------------------*/
+void estimateLock(g)
+struct guider *g;
+{
+
+	pthread_mutex_lock(&g->estimate.lock);
+	__atomic_store_n(&g->estimate.seq, g->estimate.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+}
+
+void estimateUnlock(g)
+struct guider *g;
+{
+
+	__atomic_store_n(&g->estimate.seq, g->estimate.seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&g->estimate.lock);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void estimateMove(struct guider *g, int axis) (LIBRARY)
+
+	Starts the axis's estimate following the move noteBegin() just
+	recorded. It starts from the host's commanded position if
+	that is known, otherwise from where the previous move was to
+	end. Each step to go adds ESTLOSS to the bias variance.
+
+-------------------------------------------------------------------*/
+void estimateMove(g, axis)
+struct guider *g;
+int axis;
+{
+
+	struct axisEstimate *e;
+	struct moveRecord *m;
+
+	e = &g->estimate.axis[axis];
+	m = &g->axisMove[axis];
+	estimateLock(g);
+	if (g->cmdKnown & (1 << axis)) {
+		e->from = m->from;
+		e->known = 1;
+	} else {
+		e->from += e->steps;
+	}
+	e->start = m->start;
+	e->steps = m->steps;
+	e->prof = m->prof;
+	e->ks = m->ks;
+	estimateAge(e, hostSeconds());
+	e->var += ESTLOSS * (double) labs(m->steps);
+	estimateUnlock(g);
+
+}
+
+/*-------------------------------------------------------------------
+
+	double estimatePredict(struct axisEstimate *e, double t, double *v) (LIBRARY)
+
+	Returns the commanded position (steps) e's move puts the axis
+	at at hostSeconds() t, and in v its commanded velocity (steps
+	per second).
+
+-------------------------------------------------------------------*/
+double estimatePredict(e, t, v)
+struct axisEstimate *e;
+double t, *v;
+{
+
+	double x;
+
+	x = profileDistance(e->steps, &e->prof, e->ks, t - e->start);
+	*v = (profileDistance(e->steps, &e->prof, e->ks, t - e->start + ESTDT) - x) / ESTDT;
+	return((double) e->from + x);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void estimateReset(struct guider *g) (LIBRARY)
+
+	Starts every axis's estimate over at rest at its commanded
+	position (known if the cmdKnown bit is set) with no bias.
+	homeAxes() uses it once DP has zeroed the step counts and
+	encOffset has been read, when the encoders agree with the
+	steps exactly; so do calibrate(), resetGalil() and
+	galilResync() when it finds the controller was reset.
+
+-------------------------------------------------------------------*/
+void estimateReset(g)
+struct guider *g;
+{
+
+	int axis;
+	struct axisEstimate *e;
+
+	estimateLock(g);
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		e = &g->estimate.axis[axis];
+		memset(e, 0, sizeof(*e));
+		e->from = g->cmdPosition[axis];
+		e->known = (g->cmdKnown & (1 << axis)) ? 1 : 0;
+		e->t = hostSeconds();
+	}
+	estimateUnlock(g);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void estimateStep(struct guider *g, int axis, double t, long int rp) (LIBRARY)
+
+	Keeps the axis's commanded trajectory in step with a _RP
+	reading taken at hostSeconds() t. _RP is the commanded
+	position itself, so a difference while the profile says the
+	axis is moving means the move began earlier or later than
+	noteBegin() thought, and the start time is moved (by up to
+	ESTMAXSLIP). Any other difference, e.g. a move stopped short,
+	puts the axis at rest at rp. The first reading makes a
+	trajectory that was only relative absolute.
+
+-------------------------------------------------------------------*/
+void estimateStep(g, axis, t, rp)
+struct guider *g;
+int axis;
+double t;
+long int rp;
+{
+
+	double shift, v;
+	struct axisEstimate *e;
+
+	e = &g->estimate.axis[axis];
+	estimateLock(g);
+	shift = (double) rp - estimatePredict(e, t, &v);
+	if (t < e->start) {
+		e->from = rp;			// Scheduled but not begun
+	} else if (!e->known) {
+		e->from += (long int) floor(shift + 0.5);	// The same trajectory, now absolute
+	} else if (v != 0.0 && fabs(shift / v) <= ESTMAXSLIP) {
+		e->start -= shift / v;
+	} else if (fabs(shift) >= 0.5) {
+		e->from = rp;
+		e->steps = 0;
+	}
+	e->known = 1;
+	estimateUnlock(g);
+
+}
+
+/*-------------------------------------------------------------------
+
+	inchPosition(axis)
+	
+	inchPosition returns the current X-Y position in inches away
+	from the home position of the selected axis based on the
+	rotary encoders. "axis" may be either XAXIS or YAXIS. This
+	position is computed from the manufacturer's specs on the
+	pitch of the lead screw and the measured number of pulses
+	per turn sent by the encoder (computed with the calibrate()
+	routine).
+
+	The name should be changed to inchPosition since it now
+	reports inches (this change was made after swapping out
+	the old lead screws with new inch-based ones).
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+float inchPosition(g, axis)
+struct guider *g;
+int axis;
+{
+
+	struct axisDesc *d;
+
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(BADAXIS);
+	}
+	d = &axisTable[axis];
+	if (d->encPerTurn) {
+		return((float) ((g->encOffset[axis] - encPosition(g, axis)) * d->pitch) / (float) (d->encPerTurn));
+	} else {
+		return((float) stepPosition(g, axis) * (d->pitch / d->stepsPerTurn));
+	}
+}
+
+/*-------------------------------------------------------------------
+
+	fieldCam()
+	
+	fieldCam retracts the Y1 cylinder to put Derek Kopon's wide
+	field camera into the beam ahead of the CCD. Returns UNKNOWN
+	if the cylinder() routine does not detect the retract sensor.
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+int fieldCam(g)
+struct guider *g;
+{
+
+	int status;
+
+	status = cylinder(g, Y1AXIS, RETRACT);
+
+	if (status != RETRACT) {
+		return(UNKNOWN);
+	} else {
+		return(IN);
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	void focus(struct guider *g, int type) (USER)
+	
+	focus asks the user for a new focus position and sets the
+	focus stage position. "type" may be either FOCUSREL or
+	FOCUSABS for relative or absolute motions. Relative motions
+	are in motor steps, absolute motions are in thousandths of
+	an inch from the home position.
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+void focus(g, type)
+struct guider *g;
+int type;
+{
+
+	char buf[20];
+	long int x, currentFocus;
+
+	if (type == FOCUSREL) {
+		printf("focus offset (steps): ");
+		fflush(stdout);
+		if (getLine(buf, sizeof(buf)) == NULL) {
+			return;
+		}
+		x = atol(buf);
+		focusRel(g, x);
+		return;
+	} else if (type == FOCUSABS) {
+		if (!isHomed(g)) {
+			printf("not homed\n");
+			return;
+		}
+		currentFocus = stepPosition(g, ZAXIS);
+		printf("New absolute focus value (mils): ");
+		if (getLine(buf, sizeof(buf)) == NULL) {
+			return;
+		}
+		x = atol(buf);
+/*
+		x *= (int) ((float) ZSTEPSPERTURN / (1000.0 * (float) ZSCREWPITCH));
+		focusRel(-x - currentFocus);
+*/
+		focusAbs(g, x);
+		return;
+	}
+
+}
+
+void focusAbs(g, z)
+struct guider *g;
+long int z;
+{
+
+	long int steps;
+
+	if (focusOffset(g, z, &steps)) {
+		focusRel(g, steps);
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	int focusMapAdd(struct guider *g, float x, float y, long int z); (LIBRARY)
+
+	focusMapAdd records that the best focus at stage position
+	(x, y) inches is z thousandths of an inch. Call focusMapFit()
+	after adding samples. Returns the number of samples held, or
+	0 if the table (MAXFOCUSSAMPLES) is full.
+
+-------------------------------------------------------------------*/
+int focusMapAdd(g, x, y, z)
+struct guider *g;
+float x, y;
+long int z;
+{
+
+	if (g->nFocusSamples >= MAXFOCUSSAMPLES) {
+		return(0);
+	}
+	g->focusSamples[g->nFocusSamples].x = x;
+	g->focusSamples[g->nFocusSamples].y = y;
+	g->focusSamples[g->nFocusSamples].z = z;
+	return(++g->nFocusSamples);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void focusMapClear(struct guider *g); (LIBRARY)
+
+	Discards the focus samples and the fitted map, so absolute
+	moves stop changing focus. The calibration file is updated.
+
+-------------------------------------------------------------------*/
+void focusMapClear(g)
+struct guider *g;
+{
+
+	g->nFocusSamples = 0;
+	g->focusMapTerms = 0;
+	saveCalibration(g, g->calFile);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int focusMapFit(struct guider *g); (LIBRARY)
+
+	focusMapFit fits the focus surface
+
+		z = c0 + c1*x + c2*y + c3*x*x + c4*x*y + c5*y*y
+
+	to the samples by least squares. With fewer than six samples
+	only a plane (three or more) or a constant is fitted. The map
+	is saved with the calibration in g->calFile. Once fitted,
+	moveAbs() moves the focus to the map value along with X and Y.
+
+	Returns the number of terms fitted, 0 if there are no
+	samples or the samples don't determine the surface.
+
+-------------------------------------------------------------------*/
+int focusMapFit(g)
+struct guider *g;
+{
+
+	int i, j, k, nTerms;
+	double a[FOCUSTERMS * FOCUSTERMS], b[FOCUSTERMS], t[FOCUSTERMS];
+
+	if (g->nFocusSamples >= 6) {
+		nTerms = 6;
+	} else if (g->nFocusSamples >= 3) {
+		nTerms = 3;
+	} else if (g->nFocusSamples >= 1) {
+		nTerms = 1;
+	} else {
+		g->focusMapTerms = 0;
+		return(0);
+	}
+
+	// Normal equations
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+	for (k = 0; k < g->nFocusSamples; k++) {
+		t[0] = 1.0;
+		t[1] = g->focusSamples[k].x;
+		t[2] = g->focusSamples[k].y;
+		t[3] = t[1] * t[1];
+		t[4] = t[1] * t[2];
+		t[5] = t[2] * t[2];
+		for (i = 0; i < nTerms; i++) {
+			for (j = 0; j < nTerms; j++) {
+				a[i * nTerms + j] += t[i] * t[j];
+			}
+			b[i] += t[i] * (double) g->focusSamples[k].z;
+		}
+	}
+	if (!solveLinear(nTerms, a, b)) {
+		return(0);
+	}
+
+	for (i = 0; i < FOCUSTERMS; i++) {
+		g->focusMap[i] = (i < nTerms) ? b[i] : 0.0;
+	}
+	g->focusMapTerms = nTerms;
+	saveCalibration(g, g->calFile);
+	return(nTerms);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void focusMapUser(struct guider *g) (USER)
+
+	Asks the user for a focus map action: add a sample at the
+	current stage position and focus, fit, clear, or list.
+
+-------------------------------------------------------------------*/
+void focusMapUser(g)
+struct guider *g;
+{
+
+	char buf[20];
+	int i;
+	long int z;
+
+	printf("focus map: a)dd sample here, f)it, c)lear, l)ist: ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return;
+	}
+	if (buf[0] == 'a') {
+		if (!g->isCalibrated) {
+			printf("Calibrate first\n");
+			return;
+		}
+		if (focusMapAdd(g, inchPosition(g, XAXIS), inchPosition(g, YAXIS), focusPosition(g)) == 0) {
+			printf("focus map full\n");
+		}
+	} else if (buf[0] == 'f') {
+		printf("%d terms fitted\n", focusMapFit(g));
+	} else if (buf[0] == 'c') {
+		focusMapClear(g);
+	} else if (buf[0] == 'l') {
+		for (i = 0; i < g->nFocusSamples; i++) {
+			focusMapZ(g, g->focusSamples[i].x, g->focusSamples[i].y, &z);
+			printf("%7.3f %7.3f %6ld (map %6ld)\n", g->focusSamples[i].x,
+				g->focusSamples[i].y, g->focusSamples[i].z, g->focusMapTerms ? z : -1L);
+		}
+	}
+	fflush(stdout);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int focusMapZ(struct guider *g, float x, float y, long int *z); (LIBRARY)
+
+	focusMapZ evaluates the fitted focus map at stage position
+	(x, y) inches and returns the focus in thousandths of an inch
+	in z, clipped to the calibrated focus range. Returns 1 if
+	there is a map, 0 if not (z is then unchanged).
+
+-------------------------------------------------------------------*/
+int focusMapZ(g, x, y, z)
+struct guider *g;
+float x, y;
+long int *z;
+{
+
+	double f;
+
+	if (g->focusMapTerms == 0) {
+		return(0);
+	}
+	f = g->focusMap[0] + g->focusMap[1] * x + g->focusMap[2] * y + g->focusMap[3] * x * x +
+		g->focusMap[4] * x * y + g->focusMap[5] * y * y;
+	if (f < 0.0) {
+		f = 0.0;
+	}
+	if (g->maxInches[ZAXIS] > 0.0 && f > 1000.0 * g->maxInches[ZAXIS]) {
+		f = 1000.0 * g->maxInches[ZAXIS];
+	}
+	*z = (long int) floor(f + 0.5);
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int focusOffset(struct guider *g, long int z, long int *steps); (LIBRARY)
+
+	focusOffset computes the relative focus motor steps needed to
+	reach the absolute focus position z (thousandths of an inch
+	from home) and returns them in steps. Returns 1 on success,
+	0 if z is outside the calibrated focus range.
+
+-------------------------------------------------------------------*/
+int focusOffset(g, z, steps)
+struct guider *g;
+long int z, *steps;
+{
+
+	long int currentFocus, focusSteps;
+
+	if (z < 0 || z > (long int) (1000.0 * g->maxInches[ZAXIS])) {
+		return(0);
+	}
+	currentFocus = stepPosition(g, ZAXIS);
+	focusSteps = z * (long int) ((float) axisTable[ZAXIS].stepsPerTurn / (1000.0 * (float) axisTable[ZAXIS].pitch));
+	*steps = -focusSteps - currentFocus;
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	long int focusPosition(struct guider *g); (LIBRARY)
+
+	Returns the current focus position in thousandths of an inch
+	from home, on the same scale focusAbs() uses.
+
+-------------------------------------------------------------------*/
+long int focusPosition(g)
+struct guider *g;
+{
+
+	return(-stepPosition(g, ZAXIS) / (long int) ((float) axisTable[ZAXIS].stepsPerTurn /
+		(1000.0 * (float) axisTable[ZAXIS].pitch)));
+
+}
+
+/*-------------------------------------------------------------------
+
+	void focusRel(struct guider *g, long int z); (LIBRARY)
+	
+	focusRel moves the focus motor by x steps, positive or negative.
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+void focusRel(g, z)
+struct guider *g;
+long int z;
+{
+
+	moveRelXYZ(g, 0L, 0L, z);
+}
+
+
+/*-------------------------------------------------------------------
+
+	void forgetConfig(struct guider *g); (LIBRARY)
+
+	forgetConfig clears the cache of controller parameter values
+	so the next applyConfig() or setGalilParam() sends them again.
+	Call it whenever the controller may have changed behind our
+	back (reset, reconnect, commands typed in passthru()).
+
+-------------------------------------------------------------------*/
+void forgetConfig(g)
+struct guider *g;
+{
+
+	struct galilParam *p;
+
+	for (p = g->galilConfig; p->cmd; p++) {
+		p->knownMask = 0;
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	int galilConnect(struct guider *g) (LIBRARY)
+
+	Connects to g's controller (telnetToGalil()) and sets the
+	aolive variable galilResync() looks for after a reconnect:
+	only a reset clears it. Returns the socket, or
+	telnetToGalil()'s error code.
+
+-------------------------------------------------------------------*/
+int galilConnect(g)
+struct guider *g;
+{
+
+	if ((g->galilfd = telnetToGalil(g->ipaddress)) < 0) {
+		return(g->galilfd);
+	}
+	memset(&g->link, 0, sizeof(g->link));
+	tellGalil(g, "aolive=1");
+	LOG(g, LOGIO, LOGINFO, "connected to %s", g->ipaddress);
+	return(g->galilfd);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void galilDrop(struct guider *g, char *why) (LIBRARY)
+
+	Closes g's connection to its controller after a failed read
+	or write, so galilLock() reconnects. Whatever the controller
+	had still to send is discarded with it.
+
+-------------------------------------------------------------------*/
+void galilDrop(g, why)
+struct guider *g;
+char *why;
+{
+
+	pthread_mutex_lock(&g->ioLock);
+	if (g->galilfd >= 0) {
+		close(g->galilfd);
+		g->galilfd = -1;
+		g->link.drops++;
+		g->link.downSince = g->link.retryAt = hostSeconds();
+		g->link.backoff = RECONNECTMIN;
+		LOG(g, LOGIO, LOGWARN, "connection lost (%s)", why);
+	}
+	pthread_mutex_unlock(&g->ioLock);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void galilLock(struct guider *g) (LIBRARY)
+	void galilUnlock(struct guider *g) (LIBRARY)
+
+	Bracket one command/reply exchange with the controller. They
+	nest; if the connection is down when the outermost galilLock()
+	takes ioLock, it is reconnected first (galilReconnect()).
+
+-------------------------------------------------------------------*/
+void galilLock(g)
+struct guider *g;
+{
+
+	pthread_mutex_lock(&g->ioLock);
+	if (g->ioDepth == 0 && g->galilfd < 0) {
+		galilReconnect(g);
+	}
+	g->ioDepth++;
+
+}
+
+void galilUnlock(g)
+struct guider *g;
+{
+
+	g->ioDepth--;
+	pthread_mutex_unlock(&g->ioLock);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int galilReconnect(struct guider *g) (LIBRARY)
+
+	Restores a dropped connection, trying again after backoffs
+	that double from RECONNECTMIN up to RECONNECTMAX, for up to
+	RECONNECTLIMIT seconds; the command waiting for it then goes
+	ahead. Once that has run out, each later call makes at most
+	one attempt, when the backoff allows, so commands fail fast
+	while the controller is unreachable. The controller's state
+	is resynchronized (galilResync()) before returning 1; returns
+	0 if still disconnected. Transcripts (replayOpen()) can't be
+	reconnected.
+
+	Called by galilLock() with ioLock held once. The lock is let
+	go while waiting and connecting, so other threads' commands
+	fail at once (galilSend()) instead of queueing behind it, and
+	taken again to install the connection and resync.
+
+-------------------------------------------------------------------*/
+int galilReconnect(g)
+struct guider *g;
+{
+
+	double now, limit;
+	int fd;
+
+	if (g->link.resyncing || g->link.connecting || strncmp(g->ipaddress, "replay:", 7) == 0) {
+		return(0);
+	}
+	g->link.connecting = 1;
+	limit = g->link.downSince + RECONNECTLIMIT;
+	pthread_mutex_unlock(&g->ioLock);
+	fd = -1;
+	for (;;) {
+		now = hostSeconds();
+		if (now < g->link.retryAt) {
+			if (now > limit || g->link.retryAt > limit) {
+				break;
+			}
+			usleep((useconds_t) ((g->link.retryAt - now) * 1.0e6));
+		}
+		if ((fd = telnetToGalil(g->ipaddress)) >= 0) {
+			break;
+		}
+		g->link.retryAt = hostSeconds() + g->link.backoff;
+		g->link.backoff = (2.0 * g->link.backoff < RECONNECTMAX) ? 2.0 * g->link.backoff : RECONNECTMAX;
+	}
+	pthread_mutex_lock(&g->ioLock);
+	g->link.connecting = 0;
+	if (fd < 0) {
+		return(0);
+	}
+	g->galilfd = fd;
+	g->link.reconnects++;
+	LOG(g, LOGIO, LOGINFO, "reconnected after %.1f s", hostSeconds() - g->link.downSince);
+	g->link.downSince = 0.0;
+	galilResync(g);
+	return(g->galilfd >= 0);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int galilRecv(struct guider *g, char *buf, int n) (LIBRARY)
+
+	Reads what the controller has sent, up to n bytes, into buf
+	and returns the count as read() does. Every read from the
+	controller goes through here (and every write through
+	galilSend()) so it can be recorded (transcriptOpen()) and
+	supervised: if nothing arrives within READTIMEOUT, or the
+	connection has closed, the connection is dropped
+	(galilDrop()) and -1 returned. The next galilLock()
+	reconnects.
+
+-------------------------------------------------------------------*/
+int galilRecv(g, buf, n)
+struct guider *g;
+char *buf;
+int n;
+{
+
+	int got;
+	struct pollfd pfd;
+
+	if (g->galilfd < 0) {
+		return(-1);
+	}
+	pfd.fd = g->galilfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, (int) (READTIMEOUT * 1000.0)) <= 0) {
+		galilDrop(g, "no reply");
+		return(-1);
+	}
+	if ((got = read(g->galilfd, buf, n)) <= 0) {
+		galilDrop(g, "connection closed");
+		return(-1);
+	}
+	if (g->log.fp) {
+		transcriptAdd(g, '<', buf, got);
+	}
+	return(got);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void galilResync(struct guider *g) (LIBRARY)
+
+	Called after galilReconnect() restores the connection, to
+	find out what changed while it was down and invalidate only
+	that. If the aolive marker galilConnect() set is gone the
+	controller was reset: homing, calibration, configuration and
+	the time-tag program are all lost. Otherwise the controller
+	carried on and only the command in flight is unaccounted for,
+	so the commanded positions and configuration caches are
+	refreshed and motor power and the output-driven states
+	re-read; homing is checked against homeTime and calibration
+	kept if it still holds.
+
+-------------------------------------------------------------------*/
+void galilResync(g)
+struct guider *g;
+{
+
+	char buf[80], *operands[LASTAXIS + 2], names[LASTAXIS][8];
+	double vals[LASTAXIS + 2];
+	int axis, n;
+
+	if (g->link.resetting) {
+		return;				// resetGalil() is already starting over
+	}
+	g->link.resyncing = 1;
+	g->cmdKnown = 0;			// The lost command may have moved them
+	forgetConfig(g);			// or changed them
+	askGalil(g, "MG aolive", buf, sizeof(buf));
+	if (atoi(buf) != 1) {
+		g->link.resets++;
+		g->isCalibrated = 0;
+		g->poweredAxes = 0;
+		g->clock.loaded = 0;
+		g->clock.nSyncs = 0;
+		g->sAxisStatus = UNKNOWN;
+		g->ledStatus = UNKNOWN;
+		g->ledInOutStatus = UNKNOWN;
+		tellGalil(g, "aolive=1");
+		softLimits(g, OFF);
+		estimateReset(g);		// The step counts restarted at 0
+		LOG(g, LOGIO, LOGWARN, "controller was reset: home and calibrate again");
+	} else {
+		n = 0;
+		for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+			sprintf(names[n], "_MO%c", axisTable[axis].letter);
+			operands[n] = names[n];
+			n++;
+		}
+		operands[n++] = "@OUT[3]";
+		operands[n++] = "@OUT[4]";
+		if (askGalilForValues(g, operands, n, vals) == n) {
+			g->poweredAxes = 0;
+			n = 0;
+			for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+				if (vals[n++] == 0.0) {
+					g->poweredAxes |= (1 << axis);
+				}
+			}
+			g->sAxisStatus = vals[n++] ? EXTEND : RETRACT;
+			g->ledStatus = vals[n++] ? ON : OFF;
+			if (g->isCalibrated && !isHomed(g)) {
+				g->isCalibrated = 0;
+			}
+			LOG(g, LOGIO, LOGINFO, "resynced: %s, powered axes 0x%x",
+				g->isCalibrated ? "calibration kept" : "not calibrated", g->poweredAxes);
+		}
+	}
+	g->link.resyncing = 0;
+
+}
+
+/*-------------------------------------------------------------------
+
+	int galilSend(struct guider *g, char *buf, int n) (LIBRARY)
+
+	Writes n bytes of commands to the controller; see galilRecv().
+	Returns -1 at once if the connection is down; galilLock()
+	reconnects it.
+
+-------------------------------------------------------------------*/
+int galilSend(g, buf, n)
+struct guider *g;
+char *buf;
+int n;
+{
+
+	int sent;
+
+	if (g->galilfd < 0) {
+		return(-1);
+	}
+	if ((sent = write(g->galilfd, buf, n)) != n) {
+		galilDrop(g, "write failed");
+		return(-1);
+	}
+	if (g->log.fp) {
+		transcriptAdd(g, '>', buf, sent);
+	}
+	return(sent);
+
+}
+
+/*-------------------------------------------------------------------
+
+	double galilToHost(struct guider *g, double count) (LIBRARY)
+
+	Converts controller TIME count to hostSeconds(), using the
+	mapping clockSync() last measured.
+
+-------------------------------------------------------------------*/
+double galilToHost(g, count)
+struct guider *g;
+double count;
+{
+
+	return(g->clock.host0 + (count - g->clock.time0) / g->clock.rate);
+
+}
+
+/*-------------------------------------------------------------------
+
+	getKey()
+	
+	getKey returns a keyboard character hit (from stdin).
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+int getKey()
+{
+
+	int c = 0;
+	struct timeval tv;
+	fd_set fs;
+	tv.tv_usec = tv.tv_sec = 0;
+
+	FD_ZERO(&fs);
+	FD_SET(STDIN_FILENO, &fs);
+	select(STDIN_FILENO + 1, &fs, 0, 0, &tv);
+	if (FD_ISSET(STDIN_FILENO, &fs)) {
+		c = getchar();
+		setMode(BLOCKING);
+	}
+	return c;
+
+}
+
+/*-------------------------------------------------------------------
+
+	char *getLine(char *buf, int n) (USER)
+
+	Reads a line of at most n - 1 characters from stdin into buf,
+	without the newline. Returns buf, or NULL (buf empty) at end
+	of input.
+
+-------------------------------------------------------------------*/
+char *getLine(buf, n)
+char *buf;
+int n;
+{
+
+	buf[0] = '\0';
+	if (fgets(buf, n, stdin) == NULL) {
+		buf[0] = '\0';
+		return(NULL);
+	}
+	buf[strcspn(buf, "\n")] = '\0';
+	return(buf);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void guiderInit(g, char *ipaddress, char *calFile) (LIBRARY)
+
+	Sets up a guider handle for the controller at ipaddress with
+	the default motion profiles and configuration (nothing is
+	sent to the controller). calFile is where its calibration is
+	kept. Connect with telnetToGalil() and then loadCalibration().
+
+-------------------------------------------------------------------*/
+void guiderInit(g, ipaddress, calFile)
+struct guider *g;
+char *ipaddress, *calFile;
+{
+
+	int i;
+	pthread_mutexattr_t attr;
+
+	memset(g, 0, sizeof(struct guider));
+	strncpy(g->ipaddress, ipaddress, sizeof(g->ipaddress) - 1);
+	strncpy(g->calFile, calFile, sizeof(g->calFile) - 1);
+	strcpy(g->name, "G1");
+	g->galilfd = -1;
+	g->homeTime = -9999;
+	g->sAxisStatus = UNKNOWN;
+	g->ledInOutStatus = UNKNOWN;
+	for (i = XAXIS; i <= LASTAXIS; i++) {
+		g->axisProfile[i].speed = axisTable[i].speed;
+		g->axisProfile[i].accel = axisTable[i].accel;
+		g->axisProfile[i].decel = axisTable[i].decel;
+		if (axisTable[i].brakeOut) {
+			g->brakeEngage[i] = g->brakeRelease[i] = BRAKETIME;
+		}
+	}
+	for (i = 0; defaultConfig[i].cmd && i < MAXGALILPARAMS - 1; i++) {
+		g->galilConfig[i] = defaultConfig[i];
+	}
+
+	// Recursive so tellGalil() can hold it across askGalil() calls
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+#ifdef _POSIX_THREAD_PRIO_INHERIT
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);	// For the guide thread
+#endif
+	pthread_mutex_init(&g->ioLock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&g->estimate.lock, NULL);
+	g->guide.cpu = -1;
+	g->control.mode = GUIDEPI;
+	g->control.kp = GUIDEKP;
+	g->control.ki = GUIDEKI;
+	g->control.deadband = GUIDEDEADBAND;
+	g->clock.rate = CLOCKRATE;
+
+}
+
+/*-------------------------------------------------------------------
+
+	void *guiderThread(void *job) (USER)
+
+	pthread start routine for cmdLoop(): runs one struct guiderCmd.
+
+-------------------------------------------------------------------*/
+void *guiderThread(job)
+void *job;
+{
+
+	struct guiderCmd *c;
+
+	c = (struct guiderCmd *) job;
+	guiderCommand(c->g, c->cmd);
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	help()
+	
+	prints a list of commands. Coordinate with cmdLoop().
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+void help()
+{
+
+	printf("commands:\n\n");
+	printf("\ta - aperture, insert small\n");
+	printf("\tA - field lens, insert\n");
+	printf("\tB - Back off limits\n");
+	printf("\tC - Calibrate\n");
+	printf("\td - debug logging toggle (all categories, see -l and -v)\n");
+	printf("\tD - Demo mode\n");
+	printf("\tf - focus, relative motion\n");
+	printf("\tF - Focus, absolute position\n");
+	printf("\tg - guider select (one or all)\n");
+	printf("\tG - Guide thread (start, stop, offset, frame, control law, statistics)\n");
+	printf("\th - this help listing\n");
+	printf("\tH - Home the axes\n");
+	printf("\ti - initialize\n");
+	printf("\tj - job (home, calibrate, self check, demo) progress\n");
+	printf("\tl - led in or out (toggle)\n");
+	printf("\tL - List of targets, visit in the quickest order\n");
+	printf("\tm - move relative\n");
+	printf("\tM - Move absolute\n");
+	printf("\tP - Profile X-Y speed and acceleration\n");
+	printf("\tq - quit\n");
+	printf("\tR - Reset Galil\n");
+	printf("\ts - Shack-Hartmann lenslets in\n");
+	printf("\tS - Self check\n");
+	printf("\tt - time-tagged move (sync clock, schedule a dither)\n");
+	printf("\tT - Test function execute\n");
+	printf("\tU - aUtofocus sweep\n");
+	printf("\tw - wide field camera in\n");
+	printf("\tx - abort the running job and stop the motors\n");
+	printf("\tX - pixel to stage transform (add sample, fit, clear, list, convert)\n");
+	printf("\tZ - focus map (add sample, fit, clear, list)\n");
+	printf("\t? - print status\n");
+	printf("\t: - send commands directly to Galil\n");
+	fflush(stdout);
+
+}
+
+
+/*-------------------------------------------------------------------
+
+	int fieldLens(struct guider *g); (LIBRARY)
+	
+	fieldLens retracts the Y2 cylinder to put the field lens
+	into the CCD beam. The field lens alternates with the small
+	aperture.
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+int fieldLens(g)
+struct guider *g;
+{
+
+	int status;
+
+	status = cylinder(g, Y2AXIS, RETRACT);
+	if (status != RETRACT) {
+		return(UNKNOWN);
+	} else {
+		return(IN);
+	}
+}
+
+/*-------------------------------------------------------------------
+
+	struct galilParam *findParam(g, cmd); (LIBRARY)
+
+	Returns the galilConfig[] entry for the Galil command cmd
+	(e.g. "SP"), or NULL if the command is not in the table.
+
+-------------------------------------------------------------------*/
+struct galilParam *findParam(g, cmd)
+struct guider *g;
+char *cmd;
+{
+
+	struct galilParam *p;
+
+	for (p = g->galilConfig; p->cmd; p++) {
+		if (strcmp(p->cmd, cmd) == 0) {
+			return(p);
+		}
+	}
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	homeAxes(struct guider *g) (LIBRARY)
+	
+	homeAxes drives the stage to the reverse limits, backs off
+	to a point point where the limit switch still allows motion,
+	then moves one motor turn back from there to define the home
+	position.
+	
+	The  motor positions are zeroed out and the X-Y encoder positions
+	are noted (they cannot be zeroed out). Soft limits are turned
+	off first, since they no longer hold once the zero moves.
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+void homeAxes(g)
+struct guider *g;
+{
+
+	char phase[32];
+	int axis;
+	long int speed;
+
+	jobPhase(g, "home: back off limits", 0, 3);
+	softLimits(g, OFF);				// Homing runs into the switches
+	if (limitSwitch(g, XAXIS) + limitSwitch(g, YAXIS) + limitSwitch(g, ZAXIS)) {
+		backOff(g);
+	}
+
+	for (axis = XAXIS; axis <= YAXIS; axis++) {
+		sprintf(phase, "home %c", axisTable[axis].name);
+		if (!jobPhase(g, phase, axis, 3)) {
+			return;
+		}
+		speed = axisTable[axis].speed;
+		if (!creepToLimits(g, axis, 65200, speed)) {	// hit the limit switch
+			return;
+		}
+		moveOneAxis(g, axis, -2000, speed);		// back off
+		waitAxes(g, 1 << axis);
+		moveOneAxis(g, axis, 6000, speed/2);		// hit the limit switch again
+		waitAxes(g, 1 << axis);
+		if (!creepToLimits(g, axis, -5, speed/2)) {
+			return;
+		}
+		moveOneAxis(g, axis, -axisTable[axis].stepsPerTurn, speed/2);	// back off one turn
+		waitAxes(g, 1 << axis);
+		motorPower(g, axis, OFF);
+	}
+
+	if (!jobPhase(g, "home Z", 3, 3)) {
+		return;
+	}
+	speed = axisTable[ZAXIS].speed;
+	if (!creepToLimits(g, ZAXIS, 25000, speed)) {
+		return;
+	}
+	moveOneAxis(g, ZAXIS, -1000, speed);
+	waitAxes(g, 1 << ZAXIS);
+	if (!creepToLimits(g, ZAXIS, -10, speed/2)) {
+		return;
+	}
+	moveOneAxis(g, ZAXIS, -axisTable[ZAXIS].stepsPerTurn, speed/2);
+	waitAxes(g, 1 << ZAXIS);
+	motorPower(g, ZAXIS, OFF);
+
+	if (!jobPhase(g, "home: zero", 3, 3)) {
+		return;
+	}
+	tellGalil(g, "DP 0,0,0");			// zero out the steppers
+	g->cmdPosition[XAXIS] = g->cmdPosition[YAXIS] = g->cmdPosition[ZAXIS] = 0;
+	g->cmdKnown = (1 << XAXIS) | (1 << YAXIS) | (1 << ZAXIS);
+	for (axis = XAXIS; axis <= YAXIS; axis++) {
+		g->encOffset[axis] = encPosition(g, axis);	// Save in the guider
+	}
+	estimateReset(g);
+
+	tellGalil(g, "homeTime=TIME");
+	g->homeTime = askGalilForLong(g, "MG homeTime");
+	LOG(g, LOGMOTION, LOGINFO, "homed, homeTime %ld", g->homeTime);
+}
+
+/*-------------------------------------------------------------------
+
+	double hostSeconds(void) (LIBRARY)
+
+	Returns a monotonic host clock reading in seconds, for timing
+	moves and scheduling waits.
+
+-------------------------------------------------------------------*/
+double hostSeconds()
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec);
+
+}
+
+/*-------------------------------------------------------------------
+
+	double hostToGalil(struct guider *g, double t) (LIBRARY)
+
+	Converts hostSeconds() t to the controller's TIME count, using
+	the mapping clockSync() last measured. No controller traffic.
+
+-------------------------------------------------------------------*/
+double hostToGalil(g, t)
+struct guider *g;
+double t;
+{
+
+	return(g->clock.time0 + g->clock.rate * (t - g->clock.host0));
+
+}
+
+/*-------------------------------------------------------------------
+
+	void inchesToEncoder(g, n, x, y, xEnc, yEnc) (LIBRARY)
+
+	inchesToEncoder converts n stage positions (x[i], y[i]) inches
+	to the X and Y encoder readings moveAbs() would aim for,
+	exactly as encoderTarget() does. The arrays are separate
+	(structure of arrays) and the loop has no branches so the
+	compiler can vectorize it. Range checking is left to the
+	caller (xEncMin..xEncOffset, yEncMin..yEncOffset).
+
+-------------------------------------------------------------------*/
+void inchesToEncoder(g, n, x, y, xEnc, yEnc)
+struct guider *g;
+int n;
+float *x, *y;
+long int *xEnc, *yEnc;
+{
+
+	int i;
+	long int xOff, yOff;
+	float xPuls, yPuls;
+	double xPitch, yPitch;
+
+	xOff = g->encOffset[XAXIS];
+	yOff = g->encOffset[YAXIS];
+	xPuls = (float) axisTable[XAXIS].encPerTurn;
+	yPuls = (float) axisTable[YAXIS].encPerTurn;
+	xPitch = axisTable[XAXIS].pitch;
+	yPitch = axisTable[YAXIS].pitch;
+	for (i = 0; i < n; i++) {
+		xEnc[i] = xOff - (long int) (x[i] * xPuls/xPitch);
+		yEnc[i] = yOff - (long int) (y[i] * yPuls/yPitch);
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	initGuider()
+	
+	initGuider sets up the guider so the pneumatic actuators are
+	all retracted, motor brakes are turned on, and various Galil
+	parameters are set to reasonable values.
+
+	The Galil parameters come from the galilConfig[] table and are
+	applied with applyConfig(), which only sends the values the
+	controller does not already hold.
+
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+void initGuider(g)
+struct guider *g;
+{
+
+
+//	resetGalil();
+	stopMotors(g);
+	motorPower(g, XAXIS, OFF);			// Power down the motors
+	motorPower(g, YAXIS, OFF);
+	motorPower(g, ZAXIS, OFF);
+	applyConfig(g);				// Steppers, limit switches, speeds
+	ledInOut(g, OUT);
+
+	cylinder(g, Y1AXIS, RETRACT);
+	cylinder(g, Y2AXIS, RETRACT);
+	cylinder(g, SAXIS, RETRACT);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int isHomed(struct guider *g) (LIBRARY)
+	
+	Returns 1 if the guider was homed, 0 if not.
+
+	PROBABLY WANT TO REPLACE THIS WITH "CALIBRATED?"
+
+Checked 2012-04-26
+-------------------------------------------------------------------*/
+int isHomed(g)
+struct guider *g;
+{
+
+	if (g->homeTime != askGalilForLong(g, "MG homeTime")) {
+		return(0);
+	} else {
+		return(1);
+	}
+}
+
+/*-------------------------------------------------------------------
+
+	int isMoving(axis)
+	
+	axis is one of XAXIS, YAXIS, or ZAXIS.  Returns 1 if the
+	axis is moving, 0 if not, BADAXIS if called incorrectly
+
+Checked 2012-04-26
+-------------------------------------------------------------------*/
+int isMoving(g, axis)
+struct guider *g;
+int axis;
+{
+
+	int status;
+	char buf[10];
+
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(BADAXIS);
+	}
+	sprintf(buf, "TS%c", axisTable[axis].letter);
+	status = askGalilForInt(g, buf);
+	return((status>>7) & 0x01);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void jobCancel(g) (LIBRARY)
+
+	Stops the background job, if there is one: the motors are
+	stopped at once and no new move is started (beginAxes() refuses
+	while the cancel is pending). jobThread() then cleans up when
+	the job reaches its next jobPhase() check. Returns at once; the
+	job is over when g->job.active is 0.
+
+-------------------------------------------------------------------*/
+void jobCancel(g)
+struct guider *g;
+{
+
+	if (!g->job.active) {
+		return;
+	}
+	g->job.cancel = 1;
+	stopMotors(g);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int jobPhase(g, char *phase, int step, int nSteps) (LIBRARY)
+
+	Long operations call jobPhase between steps to say what they
+	are doing (step of nSteps). It returns 1 to carry on, or 0 if
+	the job has been cancelled and the caller should return.
+	Outside a job it only returns 1.
+
+-------------------------------------------------------------------*/
+int jobPhase(g, phase, step, nSteps)
+struct guider *g;
+char *phase;
+int step, nSteps;
+{
+
+	if (g->job.active && pthread_equal(pthread_self(), g->job.tid)) {
+		strncpy(g->job.phase, phase, sizeof(g->job.phase) - 1);
+		g->job.step = step;
+		g->job.nSteps = nSteps;
+	}
+	return(!g->job.cancel);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void jobPrint(g) (USER)
+
+	Prints what the background job is doing and for how long.
+
+-------------------------------------------------------------------*/
+void jobPrint(g)
+struct guider *g;
+{
+
+	static char *names[] = {"?", "home", "calibrate", "self check", "demo"};
+
+	if (!g->job.active) {
+		printf("no job running\n");
+	} else {
+		printf("%s: %s (%d/%d), %.0f s%s\n", names[g->job.which], g->job.phase,
+			g->job.step, g->job.nSteps, hostSeconds() - g->job.start,
+			g->job.cancel ? ", cancelling" : "");
+	}
+	fflush(stdout);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int jobStart(g, int which) (LIBRARY)
+
+	jobStart runs a long operation, one of JOBHOME (homeAxes()),
+	JOBCALIBRATE (calibrate()), JOBSELFCHECK (selfCheck()) or
+	JOBDEMO (demo()), in its own thread and returns at once, so the
+	console can still ask for status (jobPrint(), statusPrint())
+	or cancel it (jobCancel()). Only one job runs per guider.
+
+	Returns 1 if the job started, 0 if a job is already running,
+	the guider is guiding, or the thread could not be created.
+
+-------------------------------------------------------------------*/
+int jobStart(g, which)
+struct guider *g;
+int which;
+{
+
+	pthread_t tid;
+
+	if (g->job.active || g->guide.run) {
+		return(0);
+	}
+	g->job.which = which;
+	g->job.cancel = 0;
+	g->job.phase[0] = '\0';
+	g->job.step = g->job.nSteps = 0;
+	g->job.start = hostSeconds();
+	g->job.active = 1;
+	if (pthread_create(&tid, NULL, jobThread, g) != 0) {
+		g->job.active = 0;
+		return(0);
+	}
+	pthread_detach(tid);
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void *jobThread(void *g) (LIBRARY)
+
+	Runs the job jobStart() set up. If it was cancelled, the
+	motors are stopped and powered down (brakes on), the host's
+	idea of the commanded positions is dropped, and after an
+	interrupted home or calibration the guider is marked neither
+	homed nor calibrated, since the axes were left partway.
+
+-------------------------------------------------------------------*/
+void *jobThread(arg)
+void *arg;
+{
+
+	static char *names[] = {"?", "home", "calibrate", "self check", "demo"};
+	struct guider *g;
+	int axis;
+
+	g = (struct guider *) arg;
+	g->job.tid = pthread_self();	// Before any jobPhase(), which checks it
+	switch (g->job.which) {
+		case JOBHOME:
+			homeAxes(g);
+			break;
+		case JOBCALIBRATE:
+			calibrate(g);
+			break;
+		case JOBSELFCHECK:
+			g->job.result = selfCheck(g);
+			break;
+		case JOBDEMO:
+			demo(g);
+			break;
+	}
+
+	if (g->job.cancel) {
+		stopMotors(g);
+		for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+			if (g->poweredAxes & (1 << axis)) {
+				motorPower(g, axis, OFF);
+			}
+		}
+		g->cmdKnown = 0;
+		if (g->job.which == JOBHOME || g->job.which == JOBCALIBRATE) {
+			g->isCalibrated = 0;
+			g->homeTime = -9999;
+		}
+	}
+	printf("\n%s %s %s after %.0f s\n", g->name, names[g->job.which],
+		g->job.cancel ? "cancelled" : "done", hostSeconds() - g->job.start);
+	fflush(stdout);
+	g->job.cancel = 0;
+	g->job.active = 0;
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int led(g, onOffStatus) (LIBRARY)
+	
+	Turns the led on or off, or asks for status. onOffStatus
+	should be one of ON, OFF, or STATUS. This function returns
+	one of ON, OFF, or UNKNOWN. UNKNOWN is returned if the
+	Galil controller returns an inconsistent answer or if you
+	called the routine with something other than ON, OFF, or
+	STATUS.
+
+Checked 2012-04-26
+-------------------------------------------------------------------*/
+int led(g, onOffStatus)
+struct guider *g;
+{
+
+	switch (onOffStatus) {
+		case ON:
+			tellGalil(g, "SB4");
+			if (askGalilForInt(g, "MG@OUT[4]") == 0) {
+				g->ledStatus = UNKNOWN;
+			} else {
+				g->ledStatus = ON;
+			}
+			break;
+
+		case OFF:
+			tellGalil(g, "CB4");
+			if (askGalilForInt(g, "MG@OUT[4]") != 0) {
+				g->ledStatus = UNKNOWN;
+			} else {
+				g->ledStatus = OFF;
+			}
+			break;
+
+		case STATUS:
+			if (askGalilForInt(g, "MG@OUT[4]") == 0) {
+				g->ledStatus = OFF;
+			} else {
+				g->ledStatus = ON;
+			}
+			break;
+
+		default:
+			g->ledStatus = UNKNOWN;
+	}
+	return(g->ledStatus);
+}
+
+/*-------------------------------------------------------------------
+
+	int loadCalibration(struct guider *g, char *filename) (LIBRARY)
+
+	loadCalibration reads values saved by saveCalibration(). Lines
+	are a keyword followed by values; unknown keywords and lines
+	starting with '#' are ignored so older files still load.
+
+		profile <axis> <speed> <accel> <decel>
+		brake <axis> <engage seconds> <release seconds>
+		focussample <x> <y> <z>
+		focusmap <terms> <c0> <c1> <c2> <c3> <c4> <c5>
+		pixelsample <px> <py> <x> <y>
+		pixelmap <terms> <cx> <cy> <scale> <a0>..<a4> <b0>..<b4>
+
+	where <axis> is X, Y or Z. Returns 1 if the file was read,
+	0 if it could not be opened.
+
+-------------------------------------------------------------------*/
+int loadCalibration(g, filename)
+struct guider *g;
+char *filename;
+{
+
+	char line[256], keyword[32], axisName;
+	int axis, terms;
+	long int speed, accel, decel, z;
+	float x, y, px, py;
+	double engage, release;
+	double c[FOCUSTERMS], m[3 + 2 * PIXELTERMS];
+	FILE *fp;
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		return(0);
+	}
+	g->nFocusSamples = 0;
+	g->nPixelSamples = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || sscanf(line, "%31s", keyword) != 1) {
+			continue;
+		}
+		if (strcmp(keyword, "profile") == 0) {
+			if (sscanf(line, "%*s %c %ld %ld %ld", &axisName, &speed, &accel, &decel) != 4) {
+				continue;
+			}
+			for (axis = LASTAXIS; axis > 0; axis--) {
+				if (axisTable[axis].name == axisName) {
+					break;
+				}
+			}
+			if (axis && speed > 0 && accel > 0 && decel > 0) {
+				g->axisProfile[axis].speed = speed;
+				g->axisProfile[axis].accel = accel;
+				g->axisProfile[axis].decel = decel;
+			}
+		} else if (strcmp(keyword, "brake") == 0) {
+			if (sscanf(line, "%*s %c %lf %lf", &axisName, &engage, &release) != 3) {
+				continue;
+			}
+			for (axis = LASTAXIS; axis > 0; axis--) {
+				if (axisTable[axis].name == axisName) {
+					break;
+				}
+			}
+			if (axis && axisTable[axis].brakeOut && engage >= 0.0 && release >= 0.0) {
+				g->brakeEngage[axis] = engage;
+				g->brakeRelease[axis] = release;
+			}
+		} else if (strcmp(keyword, "focussample") == 0) {
+			if (sscanf(line, "%*s %f %f %ld", &x, &y, &z) == 3) {
+				focusMapAdd(g, x, y, z);
+			}
+		} else if (strcmp(keyword, "focusmap") == 0) {
+			if (sscanf(line, "%*s %d %lf %lf %lf %lf %lf %lf", &terms, &c[0], &c[1],
+			    &c[2], &c[3], &c[4], &c[5]) == 1 + FOCUSTERMS && terms > 0) {
+				memcpy(g->focusMap, c, sizeof(g->focusMap));
+				g->focusMapTerms = terms;
+			}
+		} else if (strcmp(keyword, "pixelsample") == 0) {
+			if (sscanf(line, "%*s %f %f %f %f", &px, &py, &x, &y) == 4) {
+				pixelMapAdd(g, px, py, x, y);
+			}
+		} else if (strcmp(keyword, "pixelmap") == 0) {
+			if (sscanf(line, "%*s %d %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf",
+			    &terms, &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &m[6], &m[7],
+			    &m[8], &m[9], &m[10], &m[11], &m[12]) == 1 + 3 + 2 * PIXELTERMS &&
+			    terms > 0 && m[2] > 0.0) {
+				memcpy(g->pixelMapCenter, m, sizeof(g->pixelMapCenter));
+				memcpy(g->pixelMapX, m + 3, sizeof(g->pixelMapX));
+				memcpy(g->pixelMapY, m + 3 + PIXELTERMS, sizeof(g->pixelMapY));
+				g->pixelMapTerms = terms;
+			}
+		}
+	}
+	fclose(fp);
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int ledInOut(g, inOutStatus) (LIBRARY)
+	
+	Turns the led on or off, or asks for status. inOutStatus
+	is one of IN, OUT, or STATUS. This function returns one
+	of IN, OUT, UNKNOWN.
+
+Checked 2012-04-29
+-------------------------------------------------------------------*/
+int ledInOut(g, inOutStatus)
+struct guider *g;
+int inOutStatus;
+{
+
+	if (inOutStatus == IN) {
+		if (cylinder(g, SAXIS, EXTEND) == EXTEND) {
+			led(g, ON);
+			g->ledInOutStatus = IN;
 		} else {
-			ledInOut(IN);
-			printf("in.\n");
+			g->ledInOutStatus = UNKNOWN;
 		}
+	} else if (inOutStatus == OUT) {
+		led(g, OFF);
+		if (cylinder(g, SAXIS, RETRACT) == RETRACT) {
+			g->ledInOutStatus = OUT;
+		} else {
+			g->ledInOutStatus = UNKNOWN;
+		}
+	}
+	return(g->ledInOutStatus);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void logFlush(void) (LIBRARY)
+
+	Run at exit: stops logWriter() and writes out whatever
+	records are still in the ring.
+
+-------------------------------------------------------------------*/
+void logFlush()
+{
+
+	if (logRing.run) {
+		logRing.run = 0;
+		pthread_join(logRing.tid, NULL);
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	int logOpen(char *file, char *verbose) (LIBRARY)
+
+	Starts the log writer (logWriter()). Records go to file, or
+	to stdout if file is NULL, in which case only warnings and
+	errors are logged unless asked for; with a file, each
+	category logs LOGINFO and up. verbose is a comma-separated
+	list of categories (logCategories[], or "all") that log
+	LOGDEBUG too, like debug() for the whole run. Returns 1, or
+	0 if file can't be written.
+
+-------------------------------------------------------------------*/
+int logOpen(file, verbose)
+char *file, *verbose;
+{
+
+	unsigned int i;
+	int j;
+	char list[80], *cp;
+
+	if (file) {
+		if (!(logRing.fp = fopen(file, "a"))) {
+			return(0);
+		}
+		logBase = LOGINFO;
+	} else {
+		logRing.fp = stdout;
+		logBase = LOGWARN;
+	}
+	for (j = 0; j < NLOGCATS; j++) {
+		logLevel[j] = logBase;
+	}
+	if (verbose) {
+		snprintf(list, sizeof(list), "%s", verbose);
+		for (cp = strtok(list, ","); cp; cp = strtok(NULL, ",")) {
+			for (j = 0; j < NLOGCATS; j++) {
+				if (strcmp(cp, "all") == 0 || strcmp(cp, logCategories[j]) == 0) {
+					logLevel[j] = LOGDEBUG;
+				}
+			}
+		}
+	}
+	for (i = 0; i < LOGRING; i++) {
+		logRing.rec[i].seq = i;
+	}
+	logRing.head = logRing.tail = logRing.dropped = 0;
+	logRing.start = hostSeconds();
+	logRing.run = 1;
+	if (pthread_create(&logRing.tid, NULL, logWriter, NULL)) {
+		logRing.run = 0;
+		return(0);
+	}
+	atexit(logFlush);
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void logPrint(struct guider *g, int cat, int level, char *fmt, ...) (LIBRARY)
+
+	Queues a record for logWriter() and returns without doing any
+	I/O, so it may be called from any thread, including with
+	ioLock held or from the guide thread. Claiming a slot is one
+	compare-and-swap; if the ring is full the record is dropped
+	and counted rather than waiting. Use LOG(), which skips the
+	call altogether when the category isn't logging level.
+
+-------------------------------------------------------------------*/
+void logPrint(struct guider *g, int cat, int level, char *fmt, ...)
+{
+
+	struct logRecord *r;
+	unsigned int head;
+	va_list ap;
+
+	head = __atomic_load_n(&logRing.head, __ATOMIC_RELAXED);
+	for (;;) {
+		r = &logRing.rec[head % LOGRING];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != head) {
+			if ((int) (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - head) < 0) {
+				__atomic_add_fetch(&logRing.dropped, 1, __ATOMIC_RELAXED);
+				return;		// The writer hasn't taken it yet: full
+			}
+			head = __atomic_load_n(&logRing.head, __ATOMIC_RELAXED);
+		} else if (__atomic_compare_exchange_n(&logRing.head, &head, head + 1, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	r->t = hostSeconds();
+	r->g = g;
+	r->cat = cat;
+	r->level = level;
+	va_start(ap, fmt);
+	vsnprintf(r->text, LOGTEXT, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&r->seq, head + 1, __ATOMIC_RELEASE);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void *logWriter(void *arg) (LIBRARY)
+
+	Thread for logOpen(): writes each record as a line of seconds
+	since logOpen(), guider, category, level and text, flushing
+	after each batch, and notes how many records were dropped.
+	When stopped (logFlush()) it drains the ring before returning.
+
+-------------------------------------------------------------------*/
+void *logWriter(arg)
+void *arg;
+{
+
+	struct logRecord *r;
+	unsigned int tail, dropped, reported;
+	int n, running;
+
+	reported = 0;
+	do {
+		running = logRing.run;
+		tail = logRing.tail;
+		n = 0;
+		for (;;) {
+			r = &logRing.rec[tail % LOGRING];
+			if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+				break;
+			}
+			fprintf(logRing.fp, "%12.6f %-3s %-6s %-5s %s\n", r->t - logRing.start,
+				r->g ? r->g->name : "-", logCategories[r->cat], logLevels[r->level], r->text);
+			__atomic_store_n(&r->seq, tail + LOGRING, __ATOMIC_RELEASE);
+			tail++;
+			n++;
+		}
+		logRing.tail = tail;
+		dropped = __atomic_load_n(&logRing.dropped, __ATOMIC_RELAXED);
+		if (dropped != reported) {
+			fprintf(logRing.fp, "%12.6f -   -      warn  %u log records dropped\n",
+				hostSeconds() - logRing.start, dropped - reported);
+			reported = dropped;
+			n++;
+		}
+		if (n) {
+			fflush(logRing.fp);
+		} else if (running) {
+			usleep((useconds_t) (LOGPERIOD * 1.0e6));
+		}
+	} while (running || n);
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int motorPower(struct guider *g, int axis, int onOffStatus) (LIBRARY)
+	
+	Controls power to the motors. axis is XAXIS, YAXIS, or ZAXIS.
+	onOffStatus is one of ON, OFF, or STATUS.
+
+	An axis with a brake has it released HOLDSETTLE after the
+	motor is told to hold, and applied before the motor is turned
+	off. The wait for the brake is the axis's brakeRelease or
+	brakeEngage time, BRAKETIME until characterizeBrake() has
+	measured it. If the brake output doesn't read back as
+	switched, a warning is logged and the wait is still made.
+
+	This routine returns ON, OFF, BADAXIS (if you supplied an
+	incorrect axis value), and UNKNOWN if you supplied an 
+	inccorrect onOffStatus value.
+
+Checked 2012-04-26
+-------------------------------------------------------------------*/
+int motorPower(g, axis, onOffStatus)
+struct guider *g;
+int axis, onOffStatus;
+{
+
+	char buf[20], axischar;
+
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(BADAXIS);
+	}
+	axischar = axisTable[axis].letter;
+
+	if (onOffStatus == ON) {
+		sprintf(buf, "SH%c", axischar);
+		tellGalil(g, buf);
+		if (axisTable[axis].brakeOut) {
+			usleep((useconds_t) (HOLDSETTLE * 1.0e6));
+			if (brake(g, axis, OFF) != OFF) {
+				LOG(g, LOGMOTION, LOGWARN, "%c brake release not confirmed", axisTable[axis].name);
+			}
+			usleep((useconds_t) (g->brakeRelease[axis] * 1.0e6));
+		}
+		g->poweredAxes |= (1 << axis);
+		return(ON);
+
+	} else if (onOffStatus == OFF) {
+		waitAxes(g, 1 << axis);
+		if (axisTable[axis].brakeOut) {
+			if (brake(g, axis, ON) != ON) {
+				LOG(g, LOGMOTION, LOGWARN, "%c brake engage not confirmed", axisTable[axis].name);
+			}
+			usleep((useconds_t) (g->brakeEngage[axis] * 1.0e6));
+		}
+		sprintf(buf, "MO%c", axischar);
+		tellGalil(g, buf);
+		g->poweredAxes &= ~(1 << axis);
+		return(OFF);
+
+	} else if (onOffStatus == STATUS) {
+		sprintf(buf, "TS%c", axischar);
+		if ((askGalilForInt(g, buf) >> 5) & 0x01) {
+			return(OFF);
+		} else {
+			return(ON);
+		}
+
+	} else {
+		return(UNKNOWN);
+	}
+
+}
+
+
+/*-------------------------------------------------------------------
+
+	move(g, type) (USER)
+
+	Moves the X-Y stage. type is ABSOLUTE or RELATIVE. For
+	absolute moves, the user is requested for the position in
+	inches. Relative moves are in motor steps.
+
+-------------------------------------------------------------------*/
+void move(g, type)
+struct guider *g;
+int type;
+{
+
+	char buf[80];
+	long int xoff, yoff;
+	float x, y;
+
+	if (type == ABSOLUTE) {
+		if (!isHomed(g)) {
+			printf("Not homed\n");
+			return;
+		}
+		printf("Absolute postion X-Y move\n");
+		printf("New X position (inches): ");
 		fflush(stdout);
-	} else if (cmd == 'm') {	// relative position move
-		move(RELATIVE);
-	} else if (cmd == 'M') {	// absolute position move
-		move(ABSOLUTE);
-	} else if (cmd == 'q') {	// quit
-		exit(0);
-	} else if (cmd == 'R') {	// Reset
-		printf("Reset");
-		fflush(stdout);
-		resetGalil();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'S') {	// Self check
-		printf("Self check ");
-		fflush(stdout);
-		selfCheck();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 's') {	// Set up for Shack-Hartmann
-		printf("shack-Hartmann lenslets in");
-		fflush(stdout);
-		shCam();
-		printf(".\n");
-		fflush(stdout);
-	} else if (cmd == 'T') {	// Run the Test function
-		printf("Test function");
+		if (getLine(buf, sizeof(buf)) == NULL) {
+			return;
+		}
+		x = atof(buf);
+		printf("New Y position (inches): ");
 		fflush(stdout);
-		testFunction();
-		printf(".\n");
+		if (getLine(buf, sizeof(buf)) == NULL) {
+			return;
+		}
+		y = atof(buf);
+		printf("New focus (mils, return for no change): ");
 		fflush(stdout);
-	} else if (cmd == 'w') {	// Set up for wide field viewing
-		printf("wide field camera");
+		getLine(buf, sizeof(buf));	// Left empty (no change) at end of input
+		moveAbsXYZ(g, x, y, buf[0] ? atol(buf) : -1L);
+		return;
+
+	} else if (type == RELATIVE) {
+		printf("Relative position X-Y move\n");
+		printf("X offset (steps): ");
 		fflush(stdout);
-		fieldCam();
-		printf(".\n");
+		if (getLine(buf, sizeof(buf)) == NULL) {
+			return;
+		}
+		xoff = atol(buf);
+		printf("Y offset (steps): ");
 		fflush(stdout);
-	} else if (cmd == '?') {	// status
-		statusPrint();
-	} else if (cmd == ':') {	// Talk directly to the Galil
-		passthru();
+		if (getLine(buf, sizeof(buf)) == NULL) {
+			return;
+		}
+		yoff = atol(buf);
+		if (xoff == 0 && yoff == 0) {
+			printf("No motion\n");
+			return;
+		}
+		LOG(g, LOGMOTION, LOGDEBUG, "X, Y offsets: %ld %ld", xoff, yoff);
+		moveRel(g, xoff,yoff);
+		return;
 	} else {
-		printf("%c? Type \"h\" for command list help\n", cmd);
-		fflush(stdout);
+		printf("move(%d) type not ABSOLUTE or RELATIVE\n", type);
 	}
-
 }
 
-
 /*-------------------------------------------------------------------
 
-	int creepToLimits(axis, steps, speed); (LIBRARY)
+	int moveAbs(struct guider *g, float, float) (LIBRARY)
 
-	creepToLimits moves the selected motor axis in increments of
-	"steps" at the selected "speed" until that axis's limit switch
-	changes state. Note that the limit switch may alread be engaged
-	so a change of state could be from engaged to not engaged.
+	moveAbs positions the guider stage at coordinates (x,y) where
+	x and y are in inches.
 
-	Pay attention the step direction since you don't want to travel
-	the full length of the stage at slow speed.
+	The coordinates are positive numbers referenced to the
+	upper right hand corner of the guider patrol space (the
+	home position).
+
+	A calibrate() operation must be done before this command.
 
-	Returns 1 for success, 0 if you used a bad axis value or
-	the step size was small and the process timed out before
-	reaching the limit.
+	If a focus map has been fitted (focusMapFit()) the focus is
+	moved to the map's best focus for (x, y) in the same move.
 
-Checked 2012-04-30
+Minor changes; check it 2012-04-26
 -------------------------------------------------------------------*/
-int creepToLimits(axis, steps, speed)
-int axis, steps, speed;
+int moveAbs(g, x, y)
+struct guider *g;
+float x, y;
 {
 
-	int i, oldLimits, maxLoops;
+	long int z;
 
-	maxLoops = 200;
+	if (!focusMapZ(g, x, y, &z)) {
+		z = -1L;			// No map, leave focus alone
+	}
+	return(moveAbsXYZ(g, x, y, z));
 
-	switch (axis) {
+}
 
-		case XAXIS:
-			i = 0;
-			oldLimits = limitSwitch(XAXIS);
-			while (oldLimits == limitSwitch(XAXIS) && i < maxLoops) {	// wait until the switch changes state
-				moveOneAxis(XAXIS, steps, speed);
-				while (isMoving(XAXIS)) {
-				}
-				i++;
-			}
-			motorPower(XAXIS, OFF);
-			break;
+/*-------------------------------------------------------------------
 
-		case YAXIS:
-			i = 0;
-			oldLimits = limitSwitch(YAXIS);
-			while (oldLimits == limitSwitch(YAXIS) && i < maxLoops) {
-				moveOneAxis(YAXIS, steps, speed);
-				while (isMoving(YAXIS)) {
-				}
-				i++;
-			}
-			motorPower(YAXIS, OFF);
-			break;
+	int moveAbsXYZ(struct guider *g, float x, float y, long int z) (LIBRARY)
 
-		case ZAXIS:
-			i = 0;
-			oldLimits = limitSwitch(ZAXIS);
-			while (oldLimits == limitSwitch(ZAXIS) && i < maxLoops) {
-				moveOneAxis(ZAXIS, steps, speed);
-				while (isMoving(ZAXIS)) {
-				}
-				i++;
-			}
-			motorPower(ZAXIS, OFF);
-			break;
+	moveAbsXYZ is moveAbs() with a focus move to the absolute
+	focus position z (thousandths of an inch, see focusAbs())
+	run at the same time. A negative z leaves the focus alone.
+	The move takes the longer of the X-Y and focus times rather
+	than their sum. Returns 0 if any coordinate is out of range.
 
-		default:
-			return(0);
+-------------------------------------------------------------------*/
+int moveAbsXYZ(g, x, y, z)
+struct guider *g;
+float x, y;
+long int z;
+{
 
-	}
-	if (i <= maxLoops) {
-		return(1);
-	} else {
+	long int xSteps, ySteps, zSteps;
+
+	if (!absSteps(g, x, y, z, &xSteps, &ySteps, &zSteps)) {
 		return(0);
 	}
+	moveRelXYZ(g, xSteps, ySteps, zSteps);
+	return(1);
+
 }
 
 /*-------------------------------------------------------------------
 
-	int cylinder(axis, exRetStatus); (LIBRARY)
-	
-	cylinder sets or returns information on the three pneumatic
-	cylinders. "axis" should be one of Y1AXIS, Y2AXIS, or SAXIS
-	and "exRetStatus" should be one of EXTEND, RETRACT, STATUS.
-	
-	EXTEND and RETRACT cause that action to be performed. STATUS
-	returns one of EXTEND, RETRACT, UNKNOWN, BOTHSENSORS, or
-	BADAXIS. UNKNOWN and BOTHSENSORS probably indicate a
-	timeout situation due to low air pressure. BADAXIS means
-	that you called the routine with an invalid axis.
+	double moveDuration(g, axis, steps) (LIBRARY)
+
+	Returns the predicted time in seconds for a move of "steps"
+	on the selected axis with its current axisProfile[] speed and
+	acceleration. Callers can use it to plan camera exposures
+	around moves before starting them.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-int cylinder(axis, extRetStatus)
-int axis, extRetStatus;
+double moveDuration(g, axis, steps)
+struct guider *g;
+int axis;
+long int steps;
 {
 
-	int i, status, y1e, y1r, y2e, y2r;
-	static int sAxisStatus = UNKNOWN;
-
-	if (extRetStatus == STATUS) {
-
-		status = ~askGalilForInt("TI0");
-		y1e = ((status>>4) & 0x01);
-		y1r = ((status>>5) & 0x01);
-		y2e = ((status>>2) & 0x01);
-		y2r = ((status>>3) & 0x01);
-
-		if ((y1e == y1r) || (y2e == y2r)) {
-			return(BOTHSENSORS);
-		}
-
-		switch(axis) {
+	struct galilParam *p;
 
-			case Y1AXIS:
-				if (y1e) {
-					return(EXTEND);
-				} else {
-					return(RETRACT);
-				}
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(0.0);
+	}
+	p = findParam(g, "KS");
+	return(profileTime(steps, &g->axisProfile[axis], p->value[axis - XAXIS]));
 
-			case Y2AXIS:
-				if (y2e) {
-					return(EXTEND);
-				} else {
-					return(RETRACT);
-				}
+}
 
-			case SAXIS:
-				return(sAxisStatus);
+/*-------------------------------------------------------------------
 
-			default:
-				return(BADAXIS);
+	double moveETA(g, axis) (LIBRARY)
 
-		}
+	Returns the predicted number of seconds until the last move
+	started on the axis finishes, or 0.0 if it should be done.
+	This costs no controller traffic.
 
-	} else if (extRetStatus == RETRACT) {
-		switch(axis) {
-			case Y1AXIS:
-				tellGalil("CB7;SB8");
-				for (i = 0; i < 50; i++) {
-					usleep(100000);
-					status = ~askGalilForInt("TI0");
-					y1e = ((status>>4) & 0x01);
-					y1r = ((status>>5) & 0x01);
-					if (y1r && !y1e) {
-						return(RETRACT);
-					}
-				}
-				return(UNKNOWN);
+-------------------------------------------------------------------*/
+double moveETA(g, axis)
+struct guider *g;
+int axis;
+{
 
-			case Y2AXIS:
-				tellGalil("SB5;CB6");
-				for (i = 0; i < 50; i++) {
-					usleep(100000);
-					status = ~askGalilForInt("TI0");
-					y2e = ((status>>2) & 0x01);
-					y2r = ((status>>3) & 0x01);
-					if (y2r && !y2e) {
-						return(RETRACT);
-					}
-				}
-				return(UNKNOWN);
+	double eta;
 
-			case SAXIS:
-				tellGalil("CB3");
-				sAxisStatus = RETRACT;
-				sleep(1);
-				return(RETRACT);
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(0.0);
+	}
+	eta = g->axisMove[axis].start + g->axisMove[axis].duration - hostSeconds();
+	return((eta > 0.0) ? eta : 0.0);
 
-			default:
-				return(BADAXIS);
-		}
+}
 
-	} else if (extRetStatus == EXTEND) {
+/*-------------------------------------------------------------------
 
-		switch(axis) {
+	void moveOneAxis(struct guider *g, int, int, int) (LIBRARY)
 
-			case Y1AXIS:
-				tellGalil("SB7;CB8");
-				for (i = 0; i < 50; i++) {
-					usleep(100000);
-					status = ~askGalilForInt("TI0");
-					y1e = ((status>>4) & 0x01);
-					y1r = ((status>>5) & 0x01);
-					if (y1e && !y1r) {
-						return(EXTEND);
-					}
-				}
-				return(UNKNOWN);
+	moveOneAxis commands a single-axis motion with the selected
+	number of motor steps and speed. Acceleration and deceleration
+	come from axisProfile[]. See prepareMove() and beginAxes(),
+	which it uses.
 
-			case Y2AXIS:
-				tellGalil("CB5;SB6");
-				for (i = 0; i < 50; i++) {
-					usleep(100000);
-					status = ~askGalilForInt("TI0");
-					y2e = ((status>>2) & 0x01);
-					y2r = ((status>>3) & 0x01);
-					if (y2e && !y2r) {
-						return(EXTEND);
-					}
-				}
-				return(UNKNOWN);
+	IMPORTANT NOTE: moveOneAxis turns on the motor power and
+	releases the brakes (if any) but does not turn off the motor
+	or set the brakes. This must be done after with a call to
+	motorPower(axis, onOffStatus), which waits for motion to
+	stop, then turns on the brake (if any) and turns off the
+	motor.
 
-			case SAXIS:
-				tellGalil("SB3");
-				sAxisStatus = EXTEND;
-				sleep(1);
-				return(EXTEND);
+Checked 2012-04-30
+-------------------------------------------------------------------*/
+void moveOneAxis(g, axis, steps, speed)
+struct guider *g;
+int axis, steps, speed;
+{
 
-			default:
-				return(BADAXIS);
-		} 
-	} else {
-		return(BADAXIS);
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return;
 	}
+	prepareMove(g, axis, steps, speed);
+	beginAxes(g, 1 << axis);
+
 }
 
 /*-------------------------------------------------------------------
 
-	debug()
-	
-	Turns the global variable debugFlag on or off.
+	void moveRel(struct guider *g, long int, long int) (LIBRARY)
+
+	Moves the X-Y stage to the new position, relative motor
+	steps. This could be more elegant, but it works. The move is
+	watched by superviseMove(), which stops an axis that stalls.
 
+Checked 2012-04-30
 -------------------------------------------------------------------*/
-void debug()
+void moveRel(g, x, y)
+struct guider *g;
+long int x, y;
 {
 
-	if (debugFlag) {
-		debugFlag = 0;
-		printf(" off");
-		fflush(stdout);
-	} else {
-		debugFlag = 1;
-		printf(" on");
-		fflush(stdout);
-	}
-
+	moveRelXYZ(g, x, y, 0L);
 }
 
 /*-------------------------------------------------------------------
 
-	demo()
-	
-	Uses the rand() function to select random postions for the
-	three stepper motors and random states for the various pneumatic
-	cylinder positions.
+	void moveRelXYZ(struct guider *g, long int x, long int y, long int z) (LIBRARY)
+
+	moveRelXYZ moves the X-Y stage and the focus stage by relative
+	motor steps at the same time (see startRelXYZ()) and waits for
+	all of them. Axes that moved are powered down (brakes on)
+	afterwards, and it returns once the X-Y stage has settled
+	(settleWait(); g->settle says when).
 
 -------------------------------------------------------------------*/
-void demo()
+void moveRelXYZ(g, x, y, z)
+struct guider *g;
+long int x, y, z;
 {
 
-	float x, y, randomNum;
-
-	if (! isCalibrated) {
-		printf("Calibrate first\n");
-		return;
-	}
+	int axes;
+	double end;
 
-	randomNum = (float) rand() / (float) RAND_MAX;
-	x = xMaxInches * randomNum;
-	randomNum = (float) rand() / (float) RAND_MAX;
-	y = yMaxInches * randomNum;
-	printf("Moving to %lf %lf\n", x, y);
-	moveAbs(x,y);
+	axes = startRelXYZ(g, x, y, z);
+	superviseMove(g, axes);
+	end = hostSeconds();
 
-	randomNum = (float) rand() / (float) RAND_MAX;
-	if (randomNum > 0.5) {
-		cylinder(SAXIS, IN);
-		led(ON);
-		printf("LED on and in\n");
-	} else {
-		led(OFF);
-		cylinder(SAXIS, OUT);
-		printf("LED off and out\n");
+	if (axes & (1 << XAXIS)) {
+		motorPower(g, XAXIS, OFF);
 	}
-
-	randomNum = (float) rand() / (float) RAND_MAX;
-	if (randomNum > 0.5) {
-		smallAp();
-		printf("small aperture in\n");
-	} else {
-		fieldLens();
-		printf("field lens in\n");
+	if (axes & (1 << YAXIS)) {
+		motorPower(g, YAXIS, OFF);
 	}
-
-	randomNum = (float) rand() / (float) RAND_MAX;
-	if (randomNum > 0.5) {
-		shCam();
-		printf("Lenslets in\n");
-	} else {
-		fieldCam();
-		printf("wide field camera in\n");
+	if (axes & (1 << ZAXIS)) {
+		motorPower(g, ZAXIS, OFF);
 	}
-	
-	fflush(stdout);
-}
-
-/*-------------------------------------------------------------------
-
-	long int encPosition(axis)
-	
-	encPosition returns the current encoder position of the
-	selected axis. "axis" may be either XAXIS or YAXIS (the
-	focus axis does not have an encoder).
-
-Checked 2012-04-30
--------------------------------------------------------------------*/
-long int encPosition(axis)
-int axis;
-{
+	settleWait(g, axes, end);
+}
+
 
-	switch (axis) {
+/*-------------------------------------------------------------------
 
-		case XAXIS:
-			return(askGalilForLong("TPA"));
+	void noteBegin(struct guider *g, int axes, double start) (LIBRARY)
 
-		case YAXIS:
-			return(askGalilForLong("TPB"));
+	Records that the moves prepareMove() set up on "axes" begin at
+	hostSeconds() start, for predictPosition(), moveETA(),
+	positionEstimate() and the commanded position. beginAxes() uses it with the time BG was
+	sent, scheduleAxes() with a time still to come.
 
-		default:
-			return(BADAXIS);
+-------------------------------------------------------------------*/
+void noteBegin(g, axes, start)
+struct guider *g;
+int axes;
+double start;
+{
 
+	int axis;
+
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (axes & (1 << axis)) {
+			g->axisMove[axis].start = start;
+			g->axisMove[axis].from = g->cmdPosition[axis];
+			g->axisMove[axis].duration = profileTime(g->axisMove[axis].steps,
+				&g->axisMove[axis].prof, g->axisMove[axis].ks);
+			estimateMove(g, axis);
+			g->cmdPosition[axis] += g->axisMove[axis].steps;
+		}
 	}
 
 }
 
 /*-------------------------------------------------------------------
 
-	inchPosition(axis)
-	
-	inchPosition returns the current X-Y position in inches away
-	from the home position of the selected axis based on the
-	rotary encoders. "axis" may be either XAXIS or YAXIS. This
-	position is computed from the manufacturer's specs on the
-	pitch of the lead screw and the measured number of pulses
-	per turn sent by the encoder (computed with the calibrate()
-	routine).
+	void passthru(struct guider *g) (USER)
 
-	The name should be changed to inchPosition since it now
-	reports inches (this change was made after swapping out
-	the old lead screws with new inch-based ones).
+	Talk directly to the Galil controller.
 
-Checked 2012-04-30
+Checked 2012-04-26 (increased string sizes)
 -------------------------------------------------------------------*/
-float inchPosition(axis)
-int axis;
+void passthru(g)
+struct guider *g;
 {
 
-	switch(axis) {
-		case XAXIS:
-			return((float) ((xEncOffset - encPosition(XAXIS)) * XSCREWPITCH) / (float) (XENCPULSPERTURN));
-
-		case YAXIS:
-			return((float) ((yEncOffset - encPosition(YAXIS)) * YSCREWPITCH) / (float) (YENCPULSPERTURN));
-
-		case ZAXIS:
-			return((float) stepPosition(ZAXIS) * 1.25e-5);
+	char cmd[128], buf[128];
 
-		default:
-			return(BADAXIS);
+	printf("Galil command\n:");
+	fflush(stdout);
+	if (getLine(cmd, sizeof(cmd)) == NULL) {
+		return;
+	}
+	forgetConfig(g);				// We can't tell what cmd changes
+	g->clock.loaded = 0;
+	g->poweredAxes = 0;
+	askGalil(g, cmd, buf, 128);
+	printf("%s\n", buf);
+	if (buf[strlen(buf) - 1] == '?') {	// Error message from Galil?
+		askGalil(g, "TC1", buf, 128);
+		printf("%s\n", buf);		// Print TC1 error message
 	}
+	fflush(stdout);
+
 }
 
 /*-------------------------------------------------------------------
 
-	fieldCam()
-	
-	fieldCam retracts the Y1 cylinder to put Derek Kopon's wide
-	field camera into the beam ahead of the CCD. Returns UNKNOWN
-	if the cylinder() routine does not detect the retract sensor.
+	int pipeHookOpen(hook, command) (LIBRARY)
+
+	pipeHookOpen starts "command" with /bin/sh, connected to us by
+	pipes, and sets hook up to take exposures through it. The
+	program reads lines
+
+		expose <z>
+
+	from its standard input, writes "exposed" to its standard
+	output once the shutter has closed, and later "metric <value>"
+	when the image has been read out and measured. Returns 1 on
+	success, 0 if the program could not be started.
+
+	pipeHookExpose() and pipeHookReadout() are the hook functions;
+	pipeHookClose() ends the program.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-int fieldCam()
+int pipeHookOpen(hook, command)
+struct exposureHook *hook;
+char *command;
 {
 
-	int status;
-
-	status = cylinder(Y1AXIS, RETRACT);
+	int toChild[2], fromChild[2];
 
-	if (status != RETRACT) {
-		return(UNKNOWN);
-	} else {
-		return(IN);
+	if (pipe(toChild) < 0) {
+		return(0);
+	}
+	if (pipe(fromChild) < 0) {
+		close(toChild[0]);
+		close(toChild[1]);
+		return(0);
 	}
+	if ((hook->pid = fork()) < 0) {
+		close(toChild[0]);
+		close(toChild[1]);
+		close(fromChild[0]);
+		close(fromChild[1]);
+		return(0);
+	}
+	if (hook->pid == 0) {
+		dup2(toChild[0], STDIN_FILENO);
+		dup2(fromChild[1], STDOUT_FILENO);
+		close(toChild[1]);
+		close(fromChild[0]);
+		execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+		_exit(127);
+	}
+	close(toChild[0]);
+	close(fromChild[1]);
+	signal(SIGPIPE, SIG_IGN);		// A dead program shouldn't kill us
+	hook->toCmd = fdopen(toChild[1], "w");
+	hook->fromCmd = fdopen(fromChild[0], "r");
+	hook->expose = pipeHookExpose;
+	hook->readout = pipeHookReadout;
+	return(1);
 
 }
 
-/*-------------------------------------------------------------------
-
-	void focus(int type) (USER)
-	
-	focus asks the user for a new focus position and sets the
-	focus stage position. "type" may be either FOCUSREL or
-	FOCUSABS for relative or absolute motions. Relative motions
-	are in motor steps, absolute motions are in thousandths of
-	an inch from the home position.
-
-Checked 2012-04-30
--------------------------------------------------------------------*/
-void focus(type)
-int type;
+int pipeHookExpose(hook, z)
+struct exposureHook *hook;
+long int z;
 {
 
-	char buf[20];
-	long int x, currentFocus;
+	char line[80];
 
-	if (type == FOCUSREL) {
-		printf("focus offset (steps): ");
-		fflush(stdout);
-		x = atol(gets(buf));
-		focusRel(x);
-		return;
-	} else if (type == FOCUSABS) {
-		if (!isHomed()) {
-			printf("not homed\n");
-			return;
+	fprintf(hook->toCmd, "expose %ld\n", z);
+	if (fflush(hook->toCmd) != 0) {
+		return(0);
+	}
+	while (fgets(line, sizeof(line), hook->fromCmd)) {
+		if (strncmp(line, "exposed", 7) == 0) {
+			return(1);
 		}
-		currentFocus = stepPosition(ZAXIS);
-		printf("New absolute focus value (mils): ");
-		x = atol(gets(buf));
-/*
-		x *= (int) ((float) ZSTEPSPERTURN / (1000.0 * (float) ZSCREWPITCH));
-		focusRel(-x - currentFocus);
-*/
-		focusAbs(x);
-		return;
 	}
+	return(0);
 
 }
 
-void focusAbs(z)
-long int z;
+int pipeHookReadout(hook, metric)
+struct exposureHook *hook;
+double *metric;
 {
 
-	long int currentFocus, focusSteps;
+	char line[80];
 
-	if (z < 0 || z > (long int) (1000.0 * zMaxInches)) {
-		return;
+	while (fgets(line, sizeof(line), hook->fromCmd)) {
+		if (sscanf(line, "metric %lf", metric) == 1) {
+			return(1);
+		}
 	}
-	currentFocus = stepPosition(ZAXIS);
-	focusSteps = z * (long int) ((float) ZSTEPSPERTURN / (1000.0 * (float) ZSCREWPITCH));
-	focusRel(-focusSteps - currentFocus);
+	return(0);
+
+}
+
+void pipeHookClose(hook)
+struct exposureHook *hook;
+{
+
+	fclose(hook->toCmd);
+	fclose(hook->fromCmd);
+	waitpid(hook->pid, NULL, 0);
 
 }
 
 /*-------------------------------------------------------------------
 
-	void focusRel(long int z); (LIBRARY)
-	
-	focusRel moves the focus motor by x steps, positive or negative.
+	int pixelMapAdd(struct guider *g, float px, float py, float x, float y); (LIBRARY)
+
+	pixelMapAdd records that a star was seen at detector pixel
+	(px, py) with the stage at (x, y) inches. Call pixelMapFit()
+	after adding samples. Returns the number of samples held, or
+	0 if the table (MAXPIXELSAMPLES) is full.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-void focusRel(z)
-long int z;
+int pixelMapAdd(g, px, py, x, y)
+struct guider *g;
+float px, py, x, y;
 {
 
-	if (limitSwitch(XAXIS) & 0x01) {
-		return;
+	if (g->nPixelSamples >= MAXPIXELSAMPLES) {
+		return(0);
 	}
-	moveOneAxis(ZAXIS, z, ZSPEED);
-	motorPower(ZAXIS, OFF);
+	g->pixelSamples[g->nPixelSamples].px = px;
+	g->pixelSamples[g->nPixelSamples].py = py;
+	g->pixelSamples[g->nPixelSamples].x = x;
+	g->pixelSamples[g->nPixelSamples].y = y;
+	return(++g->nPixelSamples);
+
 }
 
+/*-------------------------------------------------------------------
+
+	void pixelMapClear(struct guider *g); (LIBRARY)
+
+	Discards the pixel samples and the fitted transform. The
+	calibration file is updated.
+
+-------------------------------------------------------------------*/
+void pixelMapClear(g)
+struct guider *g;
+{
+
+	g->nPixelSamples = 0;
+	g->pixelMapTerms = 0;
+	saveCalibration(g, g->calFile);
+
+}
 
 /*-------------------------------------------------------------------
 
-	getKey()
-	
-	getKey returns a keyboard character hit (from stdin).
+	int pixelMapFit(struct guider *g); (LIBRARY)
+
+	pixelMapFit fits the detector to stage transform
+
+		x = a0 + a1*u + a2*v + a3*u*r*r + a4*v*r*r
+		y = b0 + b1*u + b2*v + b3*u*r*r + b4*v*r*r
+
+	to the samples by least squares, where u, v are the pixel
+	offsets from the samples' mean pixel divided by their largest
+	distance from it (so the normal equations stay well
+	conditioned) and r*r = u*u + v*v. The first three terms are
+	an affine map (scale, rotation, shear and offset); the last
+	two are third order radial distortion. With fewer than five
+	samples only the affine part is fitted (three or more). The
+	transform is saved with the calibration in g->calFile.
+
+	Returns the number of terms fitted, 0 if there are too few
+	samples or they don't determine the transform.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-int getKey()
+int pixelMapFit(g)
+struct guider *g;
 {
 
-	int c = 0;
-	struct timeval tv;
-	fd_set fs;
-	tv.tv_usec = tv.tv_sec = 0;
+	int i, j, k, nTerms;
+	double a[PIXELTERMS * PIXELTERMS], ay[PIXELTERMS * PIXELTERMS];
+	double bx[PIXELTERMS], by[PIXELTERMS], t[PIXELTERMS];
+	double cx, cy, scale, u, v;
 
-	FD_ZERO(&fs);
-	FD_SET(STDIN_FILENO, &fs);
-	select(STDIN_FILENO + 1, &fs, 0, 0, &tv);
-	if (FD_ISSET(STDIN_FILENO, &fs)) {
-		c = getchar();
-		setMode(BLOCKING);
+	if (g->nPixelSamples >= 5) {
+		nTerms = 5;
+	} else if (g->nPixelSamples >= 3) {
+		nTerms = 3;
+	} else {
+		g->pixelMapTerms = 0;
+		return(0);
+	}
+
+	cx = cy = 0.0;
+	for (k = 0; k < g->nPixelSamples; k++) {
+		cx += g->pixelSamples[k].px;
+		cy += g->pixelSamples[k].py;
+	}
+	cx /= g->nPixelSamples;
+	cy /= g->nPixelSamples;
+	scale = 0.0;
+	for (k = 0; k < g->nPixelSamples; k++) {
+		u = hypot(g->pixelSamples[k].px - cx, g->pixelSamples[k].py - cy);
+		if (u > scale) {
+			scale = u;
+		}
+	}
+	if (scale == 0.0) {
+		return(0);
 	}
-	return c;
+
+	// Normal equations, the same matrix for x and y
+	memset(a, 0, sizeof(a));
+	memset(bx, 0, sizeof(bx));
+	memset(by, 0, sizeof(by));
+	for (k = 0; k < g->nPixelSamples; k++) {
+		u = (g->pixelSamples[k].px - cx) / scale;
+		v = (g->pixelSamples[k].py - cy) / scale;
+		t[0] = 1.0;
+		t[1] = u;
+		t[2] = v;
+		t[3] = u * (u * u + v * v);
+		t[4] = v * (u * u + v * v);
+		for (i = 0; i < nTerms; i++) {
+			for (j = 0; j < nTerms; j++) {
+				a[i * nTerms + j] += t[i] * t[j];
+			}
+			bx[i] += t[i] * g->pixelSamples[k].x;
+			by[i] += t[i] * g->pixelSamples[k].y;
+		}
+	}
+	memcpy(ay, a, sizeof(a));
+	if (!solveLinear(nTerms, a, bx) || !solveLinear(nTerms, ay, by)) {
+		return(0);
+	}
+
+	for (i = 0; i < PIXELTERMS; i++) {
+		g->pixelMapX[i] = (i < nTerms) ? bx[i] : 0.0;
+		g->pixelMapY[i] = (i < nTerms) ? by[i] : 0.0;
+	}
+	g->pixelMapCenter[0] = cx;
+	g->pixelMapCenter[1] = cy;
+	g->pixelMapCenter[2] = scale;
+	g->pixelMapTerms = nTerms;
+	saveCalibration(g, g->calFile);
+	return(nTerms);
 
 }
 
 /*-------------------------------------------------------------------
 
-	help()
-	
-	prints a list of commands. Coordinate with cmdLoop().
+	void pixelMapUser(struct guider *g) (USER)
+
+	Asks the user for a pixel transform action: add a sample at
+	the current stage position, fit, clear, list, or transform
+	a file of "px py" lines to stage inches and encoder targets.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-void help()
+void pixelMapUser(g)
+struct guider *g;
 {
 
-	printf("commands:\n\n");
-	printf("\ta - aperture, insert small\n");
-	printf("\tA - field lens, insert\n");
-	printf("\tB - Back off limits\n");
-	printf("\tC - Calibrate\n");
-	printf("\td - debug flag toggle (diagnostic prints)\n");
-	printf("\tD - Demo mode\n");
-	printf("\tf - focus, relative motion\n");
-	printf("\tF - Focus, absolute position\n");
-	printf("\th - this help listing\n");
-	printf("\tH - Home the axes\n");
-	printf("\ti - initialize\n");
-	printf("\tl - led in or out (toggle)\n");
-	printf("\tm - move relative\n");
-	printf("\tM - Move absolute\n");
-	printf("\tq - quit\n");
-	printf("\tR - Reset Galil\n");
-	printf("\ts - Shack-Hartmann lenslets in\n");
-	printf("\tS - Self check\n");
-	printf("\tT - Test function execute\n");
-	printf("\tw - wide field camera in\n");
-	printf("\t? - print status\n");
-	printf("\t: - send commands directly to Galil\n");
+	char buf[256];
+	int i, n, bad;
+	float px[MAXTARGETS], py[MAXTARGETS], x[MAXTARGETS], y[MAXTARGETS];
+	long int xEnc[MAXTARGETS], yEnc[MAXTARGETS];
+	FILE *fp;
+
+	printf("pixel map: a)dd sample here, f)it, c)lear, l)ist, t)ransform file: ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return;
+	}
+	if (buf[0] == 'a') {
+		if (!g->isCalibrated) {
+			printf("Calibrate first\n");
+			return;
+		}
+		printf("Star pixel (px py): ");
+		fflush(stdout);
+		if (getLine(buf, sizeof(buf)) == NULL ||
+			sscanf(buf, "%f %f", &px[0], &py[0]) != 2) {
+			return;
+		}
+		if (pixelMapAdd(g, px[0], py[0], inchPosition(g, XAXIS), inchPosition(g, YAXIS)) == 0) {
+			printf("pixel map full\n");
+		}
+	} else if (buf[0] == 'f') {
+		printf("%d terms fitted\n", pixelMapFit(g));
+	} else if (buf[0] == 'c') {
+		pixelMapClear(g);
+	} else if (buf[0] == 'l') {
+		for (i = 0; i < g->nPixelSamples; i++) {
+			pixelsToInches(g, 1, &g->pixelSamples[i].px, &g->pixelSamples[i].py, &x[0], &y[0]);
+			printf("%8.2f %8.2f %7.3f %7.3f (map %7.3f %7.3f)\n", g->pixelSamples[i].px,
+				g->pixelSamples[i].py, g->pixelSamples[i].x, g->pixelSamples[i].y, x[0], y[0]);
+		}
+	} else if (buf[0] == 't') {
+		if (g->pixelMapTerms == 0 || !g->isCalibrated) {
+			printf("Fit the map and calibrate first\n");
+			return;
+		}
+		if ((bad = transformCheck(g)) != 0) {
+			printf("inchesToEncoder disagrees with encoderTarget %d times\n", bad);
+		}
+		printf("Pixel list file: ");
+		fflush(stdout);
+		if (getLine(buf, sizeof(buf)) == NULL) {
+			return;
+		}
+		if ((fp = fopen(buf, "r")) == NULL) {
+			printf("can't open %s\n", buf);
+			return;
+		}
+		n = 0;
+		while (n < MAXTARGETS && fgets(buf, sizeof(buf), fp)) {
+			if (sscanf(buf, "%f %f", &px[n], &py[n]) == 2) {
+				n++;
+			}
+		}
+		fclose(fp);
+		pixelsToInches(g, n, px, py, x, y);
+		inchesToEncoder(g, n, x, y, xEnc, yEnc);
+		for (i = 0; i < n; i++) {
+			printf("%8.2f %8.2f -> %7.3f %7.3f  enc %7ld %7ld%s\n", px[i], py[i],
+				x[i], y[i], xEnc[i], yEnc[i],
+				(xEnc[i] > g->encOffset[XAXIS] || xEnc[i] < g->encMin[XAXIS] ||
+				yEnc[i] > g->encOffset[YAXIS] || yEnc[i] < g->encMin[YAXIS]) ? " out of range" : "");
+		}
+	}
 	fflush(stdout);
 
 }
 
-
 /*-------------------------------------------------------------------
 
-	int fieldLens(void); (LIBRARY)
-	
-	fieldLens retracts the Y2 cylinder to put the field lens
-	into the CCD beam. The field lens alternates with the small
-	aperture.
+	void pixelsToInches(g, n, px, py, x, y) (LIBRARY)
+
+	pixelsToInches maps n detector pixel positions (px[i], py[i])
+	through the fitted transform (pixelMapFit()) to stage
+	positions (x[i], y[i]) inches. The arrays are separate
+	(structure of arrays) and the loop is straight-line float
+	arithmetic so the compiler can vectorize it; the whole
+	catalog of a field costs little more than one star. If there
+	is no map the outputs are set to 0.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-int fieldLens()
+void pixelsToInches(g, n, px, py, x, y)
+struct guider *g;
+int n;
+float *px, *py, *x, *y;
 {
 
-	int status;
+	int i;
+	float cx, cy, s, u, v, r2;
+	float a0, a1, a2, a3, a4, b0, b1, b2, b3, b4;
 
-	status = cylinder(Y2AXIS, RETRACT);
-	if (status != RETRACT) {
-		return(UNKNOWN);
-	} else {
-		return(IN);
+	if (g->pixelMapTerms == 0) {
+		for (i = 0; i < n; i++) {
+			x[i] = y[i] = 0.0;
+		}
+		return;
+	}
+	cx = g->pixelMapCenter[0];
+	cy = g->pixelMapCenter[1];
+	s = 1.0 / g->pixelMapCenter[2];
+	a0 = g->pixelMapX[0]; a1 = g->pixelMapX[1]; a2 = g->pixelMapX[2];
+	a3 = g->pixelMapX[3]; a4 = g->pixelMapX[4];
+	b0 = g->pixelMapY[0]; b1 = g->pixelMapY[1]; b2 = g->pixelMapY[2];
+	b3 = g->pixelMapY[3]; b4 = g->pixelMapY[4];
+	for (i = 0; i < n; i++) {
+		u = (px[i] - cx) * s;
+		v = (py[i] - cy) * s;
+		r2 = u * u + v * v;
+		x[i] = a0 + u * (a1 + a3 * r2) + v * (a2 + a4 * r2);
+		y[i] = b0 + u * (b1 + b3 * r2) + v * (b2 + b4 * r2);
 	}
+
 }
 
 /*-------------------------------------------------------------------
 
-	homeAxes() (LIBRARY)
-	
-	homeAxes drives the stage to the reverse limits, backs off
-	to a point point where the limit switch still allows motion,
-	then moves one motor turn back from there to define the home
-	position.
-	
-	The  motor positions are zeroed out and the X-Y encoder positions
-	are noted (they cannot be zeroed out).
+	double planTargets(g, n, x, y, order) (LIBRARY)
+
+	planTargets orders the n stage positions (x[i], y[i]) inches
+	to keep the total move time from the current position small.
+	The time between two targets is targetTime(), which uses the
+	real axis profiles, so it is not simply distance. A nearest
+	neighbour tour is improved by 2-opt segment reversals until
+	none helps. The path starts at the current stage position and
+	may end anywhere.
+
+	The order is returned in order[]; the return value is the
+	predicted total move time in seconds (-1.0 on failure).
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-void homeAxes()
+double planTargets(g, n, x, y, order)
+struct guider *g;
+int n;
+float *x, *y;
+int *order;
 {
 
-	if (limitSwitch(XAXIS) + limitSwitch(YAXIS) + limitSwitch(ZAXIS)) {
-		backOff();
+	int i, j, k, m, improved, *path, *used;
+	long int z;
+	double *cost, *px, *py, *pz, best, delta, total;
+
+	if (n <= 0 || n > MAXTARGETS) {
+		return(-1.0);
 	}
 
-	creepToLimits(XAXIS, 65200, XYSPEED);	// hit the limit switch
-	moveOneAxis(XAXIS, -2000, XYSPEED);	// back off
-	while (isMoving(XAXIS)) {
+	// Node 0 is where the stage is now, node i + 1 is target i
+	m = n + 1;
+	cost = (double *) malloc(m * m * sizeof(double));
+	px = (double *) malloc(m * sizeof(double));
+	py = (double *) malloc(m * sizeof(double));
+	pz = (double *) malloc(m * sizeof(double));
+	path = (int *) malloc(m * sizeof(int));
+	used = (int *) calloc(m, sizeof(int));
+	if (!cost || !px || !py || !pz || !path || !used) {
+		free(cost); free(px); free(py); free(pz); free(path); free(used);
+		return(-1.0);
 	}
-	moveOneAxis(XAXIS, 6000, XYSPEED/2);	// hit the limit switch again
-	while (isMoving(XAXIS)) {
+	px[0] = g->isCalibrated ? inchPosition(g, XAXIS) : 0.0;
+	py[0] = g->isCalibrated ? inchPosition(g, YAXIS) : 0.0;
+	pz[0] = g->focusMapTerms ? (double) focusPosition(g) : 0.0;
+	for (i = 0; i < n; i++) {
+		px[i + 1] = x[i];
+		py[i + 1] = y[i];
+		pz[i + 1] = focusMapZ(g, x[i], y[i], &z) ? (double) z : 0.0;
 	}
-	creepToLimits(XAXIS, -5, XYSPEED/2);
-	moveOneAxis(XAXIS, -XSTEPSPERTURN, XYSPEED/2);	// back off one turn
-	while (isMoving(XAXIS)) {
+	for (i = 0; i < m; i++) {
+		for (j = 0; j < m; j++) {
+			cost[i * m + j] = (i == j) ? 0.0 :
+				targetTime(g, px[j] - px[i], py[j] - py[i], pz[j] - pz[i]);
+		}
 	}
-	motorPower(XAXIS, OFF);
 
-	creepToLimits(YAXIS, 65200, XYSPEED);
-	moveOneAxis(YAXIS, -2000, XYSPEED);
-	while (isMoving(YAXIS)) {
-	}
-	moveOneAxis(YAXIS, 6000, XYSPEED/2);
-	while (isMoving(YAXIS)) {
+	// Nearest neighbour
+	path[0] = 0;
+	used[0] = 1;
+	for (k = 1; k < m; k++) {
+		best = -1.0;
+		for (j = 1; j < m; j++) {
+			if (!used[j] && (best < 0.0 || cost[path[k - 1] * m + j] < best)) {
+				best = cost[path[k - 1] * m + j];
+				path[k] = j;
+			}
+		}
+		used[path[k]] = 1;
 	}
-	creepToLimits(YAXIS, -5, XYSPEED/2);
-	moveOneAxis(YAXIS, -YSTEPSPERTURN, XYSPEED/2);
-	while (isMoving(YAXIS)) {
+
+	// 2-opt: reverse path[i..j] if it helps (open path, path[0] fixed)
+	do {
+		improved = 0;
+		for (i = 1; i < m - 1; i++) {
+			for (j = i + 1; j < m; j++) {
+				delta = cost[path[i - 1] * m + path[j]] - cost[path[i - 1] * m + path[i]];
+				if (j + 1 < m) {
+					delta += cost[path[i] * m + path[j + 1]] - cost[path[j] * m + path[j + 1]];
+				}
+				if (delta < -1.0e-9) {
+					for (k = 0; k < (j - i + 1) / 2; k++) {
+						z = path[i + k];
+						path[i + k] = path[j - k];
+						path[j - k] = (int) z;
+					}
+					improved = 1;
+				}
+			}
+		}
+	} while (improved);
+
+	total = 0.0;
+	for (k = 1; k < m; k++) {
+		order[k - 1] = path[k] - 1;
+		total += cost[path[k - 1] * m + path[k]];
 	}
-	motorPower(YAXIS, OFF);
+	free(cost); free(px); free(py); free(pz); free(path); free(used);
+	return(total);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int positionEstimate(struct guider *g, int axis, double t, double *steps, double *sigma) (LIBRARY)
+
+	Estimates where the axis actually is (motor steps) at host
+	time t (a hostSeconds() value, past or future), with its
+	standard deviation in sigma. It fuses the motion profile of
+	the last move, the _RP and encoder readings superviseMove(),
+	settleWait() and daemonSnapshot() take anyway, and, for an
+	axis without an encoder, how far it has moved since it was
+	homed. It needs no controller traffic and no lock, so any
+	thread can call it at any rate.
+
+	Returns 1, or 0 if the position is only relative (nothing has
+	tied it to the controller's step count since startup).
+
+-------------------------------------------------------------------*/
+int positionEstimate(g, axis, t, steps, sigma)
+struct guider *g;
+int axis;
+double t, *steps, *sigma;
+{
+
+	unsigned int seq;
+	double v, var;
+	struct axisEstimate e;
 
-	creepToLimits(ZAXIS, 25000, ZSPEED);
-	moveOneAxis(ZAXIS, -1000, ZSPEED);
-	while (isMoving(ZAXIS)) {
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(0);
 	}
-	creepToLimits(ZAXIS, -10, ZSPEED/2);
-	moveOneAxis(ZAXIS, -ZSTEPSPERTURN, ZSPEED/2);
-	while (isMoving(ZAXIS)) {
+	do {
+		seq = __atomic_load_n(&g->estimate.seq, __ATOMIC_ACQUIRE);
+		e = g->estimate.axis[axis];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&g->estimate.seq, __ATOMIC_RELAXED));
+
+	*steps = estimatePredict(&e, t, &v) + e.bias;
+	var = e.var + v * v * ESTTIMING * ESTTIMING;
+	if (e.t > 0.0 && t > e.t) {
+		var += ESTDRIFT * (t - e.t);
 	}
-	motorPower(ZAXIS, OFF);
+	*sigma = sqrt(var);
+	return(e.known);
+
+}
+
+/*-------------------------------------------------------------------
+
+	double predictPosition(g, axis, t) (LIBRARY)
+
+	Returns the predicted commanded position (motor steps) of the
+	axis at host time t (a hostSeconds() value), from the last move
+	started with moveOneAxis(). The answer is only absolute if the
+	commanded position was known when that move started (bit set
+	in cmdKnown); otherwise it is relative to the move's start.
+	No controller traffic is needed.
+
+-------------------------------------------------------------------*/
+double predictPosition(g, axis, t)
+struct guider *g;
+int axis;
+double t;
+{
 
-	tellGalil("DP 0,0,0");			// zero out the steppers
-	xEncOffset = askGalilForLong("TPA");	// Save global variables
-	yEncOffset = askGalilForLong("TPB");
+	struct moveRecord *m;
 
-	tellGalil("homeTime=TIME");
-	homeTime = askGalilForLong("MG homeTime");
-	if (debugFlag) {
-		printf("homeTime = %ld", homeTime);
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(0.0);
 	}
+	m = &g->axisMove[axis];
+	return((double) m->from + profileDistance(m->steps, &m->prof, m->ks, t - m->start));
+
 }
 
 /*-------------------------------------------------------------------
 
-	initGuider()
-	
-	initGuider sets up the guider so the pneumatic actuators are
-	all retracted, motor brakes are turned on, and various Galil
-	parameters are set to reasonable values.
+	void prepareMove(struct guider *g, int axis, int steps, int speed) (LIBRARY)
+
+	prepareMove powers up the axis (releasing its brake) unless
+	motorPower() already did and it hasn't been turned off, sets its
+	speed, acceleration and deceleration and the relative move of
+	"steps", but does not start it; see beginAxes(). Speed,
+	acceleration and deceleration are only sent when they differ
+	from what the controller last got.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-void initGuider()
+void prepareMove(g, axis, steps, speed)
+struct guider *g;
+int axis, steps, speed;
 {
 
+	char buf[20];
 
-//	resetGalil();
-	stopMotors();
-	tellGalil("MT -2,-2,-2");		// Tell Galil they're stepper motors
-	motorPower(XAXIS, OFF);			// Power down the motors
-	motorPower(YAXIS, OFF);
-	motorPower(ZAXIS, OFF);
-	ledInOut(OUT);
-	tellGalil("CN1");			// Limit switch configuration
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return;
+	}
+	if (!(g->poweredAxes & (1 << axis))) {	// Already on and brake off?
+		motorPower(g, axis, ON);
+	}
 
-	cylinder(Y1AXIS, RETRACT);
-	cylinder(Y2AXIS, RETRACT);
-	cylinder(SAXIS, RETRACT);
+	setGalilParam(g, "SP", axis, speed);	// Only sent if changed
+	setGalilParam(g, "AC", axis, g->axisProfile[axis].accel);
+	setGalilParam(g, "DC", axis, g->axisProfile[axis].decel);
+	sprintf(buf, "PR%c=%d", axisTable[axis].letter, steps);
+	tellGalil(g, buf);
 
-	tellGalil("SP 200,200,1000");		// Slow speed
-	tellGalil("AC 256000,256000,256000");	// These are defaults from Galil
-	tellGalil("DC 256000,256000,256000");
-	tellGalil("SD 256000,256000,256000");	// Deceleration after hitting a limit switch
-	tellGalil("VS 200");			// Slow vector speed
-	tellGalil("VA 256000");			// Default vector values
-	tellGalil("VD 256000");
-	tellGalil("KS 3,3,3");			// Step motor smoothing (not too sensitive)
-	tellGalil("CAS");			// S coordinate system for vector motion
+	g->axisMove[axis].steps = steps;
+	g->axisMove[axis].prof.speed = speed;
+	g->axisMove[axis].prof.accel = g->axisProfile[axis].accel;
+	g->axisMove[axis].prof.decel = g->axisProfile[axis].decel;
+	g->axisMove[axis].ks = findParam(g, "KS")->value[axis - XAXIS];
+	g->axisMove[axis].duration = 0.0;
 
 }
 
 /*-------------------------------------------------------------------
 
-	int isHomed() (LIBRARY)
-	
-	Returns 1 if the guider was homed, 0 if not.
+	double profileDistance(steps, prof, ks, t) (LIBRARY)
 
-	PROBABLY WANT TO REPLACE THIS WITH "CALIBRATED?"
+	Returns how many of "steps" a move with profile prof has
+	covered t seconds after it began (signed like steps). The
+	trapezoid (or triangle, for short moves) is the controller's
+	own profile; step smoothing (KS) is treated as a delay of
+	ks controller samples.
 
-Checked 2012-04-26
 -------------------------------------------------------------------*/
-int isHomed()
+double profileDistance(steps, prof, ks, t)
+long int steps;
+struct motionProfile *prof;
+double ks, t;
 {
 
-	if (homeTime != askGalilForLong("MG homeTime")) {
-		return(0);
+	double d, v, a, dc, ta, tc, td, x;
+
+	d = (double) labs(steps);
+	a = (double) prof->accel;
+	dc = (double) prof->decel;
+	v = (double) prof->speed;
+	t -= ks * GALILSAMPLE;
+	if (d == 0.0 || t <= 0.0 || v <= 0.0 || a <= 0.0 || dc <= 0.0) {
+		return(0.0);
+	}
+
+	if (v * v / (2.0 * a) + v * v / (2.0 * dc) > d) {
+		v = sqrt(2.0 * d * a * dc / (a + dc));	// Never reaches speed
+	}
+	ta = v / a;
+	td = v / dc;
+	tc = (d - v * ta / 2.0 - v * td / 2.0) / v;
+
+	if (t < ta) {
+		x = a * t * t / 2.0;
+	} else if (t < ta + tc) {
+		x = v * ta / 2.0 + v * (t - ta);
+	} else if (t < ta + tc + td) {
+		t -= ta + tc;
+		x = v * ta / 2.0 + v * tc + v * t - dc * t * t / 2.0;
 	} else {
-		return(1);
+		x = d;
 	}
+	return((steps < 0) ? -x : x);
+
 }
 
 /*-------------------------------------------------------------------
 
-	int isMoving(axis)
-	
-	axis is one of XAXIS, YAXIS, or ZAXIS.  Returns 1 if the
-	axis is moving, 0 if not, BADAXIS if called incorrectly
+	double profileTime(steps, prof, ks) (LIBRARY)
+
+	Returns the predicted duration in seconds of a move of "steps"
+	with the speed, acceleration and deceleration in prof and
+	step smoothing ks. This is the trapezoidal profile time plus
+	KSLAG smoothing time constants for the step output to settle.
 
-Checked 2012-04-26
 -------------------------------------------------------------------*/
-int isMoving(axis)
-int axis;
+double profileTime(steps, prof, ks)
+long int steps;
+struct motionProfile *prof;
+double ks;
 {
 
-	int status;
-	char buf[10];
+	double d, v, a, dc;
 
-	switch(axis) {
-		case XAXIS:
-			strcpy(buf, "TSA");
-			break;
-		case YAXIS:
-			strcpy(buf, "TSB");
-			break;
-		case ZAXIS:
-			strcpy(buf, "TSC");
-			break;
-		default:
-			return(BADAXIS);
+	d = (double) labs(steps);
+	a = (double) prof->accel;
+	dc = (double) prof->decel;
+	v = (double) prof->speed;
+	if (d == 0.0 || v <= 0.0 || a <= 0.0 || dc <= 0.0) {
+		return(0.0);
 	}
-	status = askGalilForInt(buf);
-	return((status>>7) & 0x01);
+
+	if (v * v / (2.0 * a) + v * v / (2.0 * dc) > d) {
+		v = sqrt(2.0 * d * a * dc / (a + dc));
+		return(v / a + v / dc + KSLAG * ks * GALILSAMPLE);
+	}
+	return(v / a + v / dc + (d - v * v / (2.0 * a) - v * v / (2.0 * dc)) / v + KSLAG * ks * GALILSAMPLE);
 
 }
 
 /*-------------------------------------------------------------------
 
-	int led(onOffStatus) (LIBRARY)
-	
-	Turns the led on or off, or asks for status. onOffStatus
-	should be one of ON, OFF, or STATUS. This function returns
-	one of ON, OFF, or UNKNOWN. UNKNOWN is returned if the
-	Galil controller returns an inconsistent answer or if you
-	called the routine with something other than ON, OFF, or
-	STATUS.
+	int readGalil(g, buf, n, nReplies); (LIBRARY)
+
+	readGalil reads from the Galil until nReplies responses have
+	been terminated by ':' (success) or '?' (error), or buf is
+	full. A single read() is not enough when several commands are
+	written at once since the replies can arrive in pieces.
+
+	Returns the number of terminators seen. buf is NUL terminated.
 
-Checked 2012-04-26
 -------------------------------------------------------------------*/
-int led(onOffStatus)
+int readGalil(g, buf, n, nReplies)
+struct guider *g;
+char *buf;
+int n, nReplies;
 {
 
-	static int status;
-
-	switch (onOffStatus) {
-		case ON:
-			tellGalil("SB4");
-			if (askGalilForInt("MG@OUT[4]") == 0) {
-				status = UNKNOWN;
-			} else {
-				status = ON;
-			}
-			break;
+	int i, got, len, seen;
 
-		case OFF:
-			tellGalil("CB4");
-			if (askGalilForInt("MG@OUT[4]") != 0) {
-				status = UNKNOWN;
-			} else {
-				status = OFF;
-			}
+	memset(buf, 0, n);
+	len = 0;
+	seen = 0;
+	while (seen < nReplies && len < n - 1) {
+		got = galilRecv(g, buf + len, n - 1 - len);
+		if (got <= 0) {
 			break;
-
-		case STATUS:
-			if (askGalilForInt("MG@OUT[4]") == 0) {
-				status = OFF;
-			} else {
-				status = ON;
+		}
+		for (i = len; i < len + got; i++) {
+			if (buf[i] == ':' || buf[i] == '?') {
+				seen++;
 			}
-			break;
-
-		default:
-			status = UNKNOWN;
+		}
+		len += got;
 	}
-	return(status);
+	return(seen);
+
 }
 
 /*-------------------------------------------------------------------
 
-	int ledInOut(inOutStatus) (LIBRARY)
-	
-	Turns the led on or off, or asks for status. inOutStatus
-	is one of IN, OUT, or STATUS. This function returns one
-	of IN, OUT, UNKNOWN.
+	int selfCheck(struct guider *g) (USER)
 
-Checked 2012-04-29
+	selfCheck does a few sanity checks on the guider. It moves
+	the three pneumatic cyinders and notices if the GMR sensors
+	are correctly triggered and it moves the X-Y axis motors
+	to see if the axis encoders report position changes of about
+	the correct amount.
+
+Checked 2012-04-26
 -------------------------------------------------------------------*/
-int ledInOut(inOutStatus)
-int inOutStatus;
+int selfCheck(g)
+struct guider *g;
 {
 
-	static int status = UNKNOWN;
+	int i, testVal, retVal;
+	long int oldEnc;
+	float encScale;
 
-	if (inOutStatus == IN) {
-		if (cylinder(SAXIS, EXTEND) == EXTEND) {
-			led(ON);
-			status = IN;
-		} else {
-			status = UNKNOWN;
+	retVal = PASS;
+	for (i = 0; i < 2; i++) {
+		if (!jobPhase(g, "self check: cylinders", i, 3)) {
+			return(FAIL);
 		}
-	} else if (inOutStatus == OUT) {
-		led(OFF);
-		if (cylinder(SAXIS, RETRACT) == RETRACT) {
-			status = OUT;
-		} else {
-			status = UNKNOWN;
+		testVal = cylinder(g, Y1AXIS, EXTEND);
+		if (testVal != 1) {
+			retVal = FAIL;
+		} 
+		testVal = cylinder(g, Y1AXIS, RETRACT);
+		if (testVal != 0) {
+			retVal = FAIL;
+		}
+		testVal = cylinder(g, Y2AXIS, EXTEND);
+		if (testVal != 1) {
+			retVal = FAIL;
+		}
+		testVal = cylinder(g, Y2AXIS, RETRACT);
+		if (testVal != 0) {
+			retVal = FAIL;
 		}
 	}
-	return(status);
 
+
+	if (!jobPhase(g, "self check: encoders", 2, 3)) {
+		return(FAIL);
+	}
+	if (limitSwitch(g, XAXIS) || limitSwitch(g, YAXIS)) {
+		backOff(g);
+	}
+	oldEnc = encPosition(g, XAXIS);
+	moveRel(g, 200,0);
+	encScale = (float) (encPosition(g, XAXIS) - oldEnc) / 200.0;
+	if (fabs(encScale - 4.0) > 0.02) {
+		printf("Fail X encoder scale (%7.5f)\n", encScale);
+		retVal = FAIL;
+	}
+	oldEnc = encPosition(g, YAXIS);
+	moveRel(g, 0,200);
+	encScale = (float) (encPosition(g, YAXIS) - oldEnc) / 200.0;
+	if (fabs(encScale - 4.0) > 0.02) {
+		printf("Fail Y encoder scale (%7.5f)\n", encScale);
+		retVal = FAIL;
+	}
+	if (retVal == PASS) {
+		printf("passed\n");
+	} else {
+		printf("failed\n");
+	}
+	fflush(stdout);
+	return(retVal);
 }
 
 /*-------------------------------------------------------------------
 
-	int motorPower(int axis, int onOffStatus) (LIBRARY)
-	
-	Controls power to the motors. axis is XAXIS, YAXIS, or ZAXIS.
-	onOffStatus is one of ON, OFF, or STATUS.
+	int setGalilParam(g, cmd, axis, value); (LIBRARY)
 
-	This routine returns ON, OFF, BADAXIS (if you supplied an
-	incorrect axis value), and UNKNOWN if you supplied an 
-	inccorrect onOffStatus value.
+	setGalilParam sets a per-axis galilConfig[] parameter such as
+	"SP", "AC" or "DC" on the selected axis (XAXIS, YAXIS, ZAXIS)
+	unless the controller is already known to hold that value.
+
+	Returns 1 if the command was sent, 0 if it was skipped, and
+	BADAXIS for an unknown command or axis.
 
-Checked 2012-04-26
 -------------------------------------------------------------------*/
-int motorPower(axis, onOffStatus)
-int axis, onOffStatus;
+int setGalilParam(g, cmd, axis, value)
+struct guider *g;
+char *cmd;
+int axis;
+long int value;
 {
 
-	char buf[20], axischar;
+	struct galilParam *p;
 
-	switch (axis) {
+	if ((p = findParam(g, cmd)) == NULL || p->names == NULL || strcmp(p->names, "ABC")) {
+		return(BADAXIS);
+	}
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(BADAXIS);
+	}
+	return(sendParam(g, p, axis - XAXIS, (double) value));
 
-		case XAXIS:
-			axischar = 'A';
-			break;
+}
 
-		case YAXIS:
-			axischar = 'B';
-			break;
+/*-------------------------------------------------------------------
 
-		case ZAXIS:
-			axischar = 'C';
-			break;
+	int sendParam(g, p, index, value); (LIBRARY)
 
-		default:
-			return(BADAXIS);
-	}	
+	sendParam sends value for entry "index" of the configuration
+	parameter p (e.g. "SPB=2000", "CN 1") if it differs from the
+	cached controller value, and updates the cache. Returns 1 if
+	the command was sent, 0 if not.
 
-	if (onOffStatus == ON) {
-		sprintf(buf, "SH%c", axischar);
-		tellGalil(buf);
-		if (axis != ZAXIS) {
-			usleep(250000);
-			brake(axis, OFF);
-			usleep(250000);
-		}
-		return(ON);
+-------------------------------------------------------------------*/
+int sendParam(g, p, index, value)
+struct guider *g;
+struct galilParam *p;
+int index;
+double value;
+{
 
-	} else if (onOffStatus == OFF) {
-		while (isMoving(axis)) {
-			}
-		if (axis != ZAXIS) {
-			usleep(250000);
-			brake(axis, ON);
-			usleep(250000);
-		}
-		sprintf(buf, "MO%c", axischar);
-		tellGalil(buf);
-		return(OFF);
+	char buf[40], valstr[20];
 
-	} else if (onOffStatus == STATUS) {
-		sprintf(buf, "TS%c", axischar);
-		if ((askGalilForInt(buf) >> 5) & 0x01) {
-			return(OFF);
-		} else {
-			return(ON);
-		}
+	if ((p->knownMask & (1 << index)) && fabs(p->known[index] - value) < 0.001) {
+		return(0);
+	}
 
+	if (value == floor(value)) {
+		sprintf(valstr, "%ld", (long int) value);
 	} else {
-		return(UNKNOWN);
+		sprintf(valstr, "%.4f", value);
+	}
+	if (strlen(p->names) > 1) {
+		sprintf(buf, "%s%c=%s", p->cmd, p->names[index], valstr);
+	} else {
+		sprintf(buf, "%s %s", p->cmd, valstr);
 	}
 
-}
+	if (tellGalil(g, buf)) {
+		p->known[index] = value;
+		p->knownMask |= (1 << index);
+	} else {
+		p->knownMask &= ~(1 << index);
+	}
+	return(1);
 
+}
 
 /*-------------------------------------------------------------------
 
-	move(type) (USER)
+	setMode(mode) (USER)
 
-	Moves the X-Y stage. type is ABSOLUTE or RELATIVE. For
-	absolute moves, the user is requested for the position in
-	inches. Relative moves are in motor steps.
+	setMode switches between ICANON and ~ICANON tty modes. This
+	is used for the command keys. mode is either NONBLOCKING
+	(for one-key command mode) or BLOCKING (for line oriented
+	input).
 
+Checked 2012-04-26
 -------------------------------------------------------------------*/
-void move(type)
-int type;
+void setMode(mode)
+int mode;
 {
 
-	char buf[80];
-	long int xoff, yoff;
-	float x, y;
-
-	if (type == ABSOLUTE) {
-		if (!isHomed()) {
-			printf("Not homed\n");
-			return;
-		}
-		printf("Absolute postion X-Y move\n");
-		printf("New X position (inches): ");
-		fflush(stdout);
-		x = atof(gets(buf));
-		printf("New Y position (inches): ");
-		fflush(stdout);
-		y = atof(gets(buf));
-		moveAbs(x, y);
-		return;
+	static int firstCall = 1;
+	static struct termios oldtty, newtty;
 
-	} else if (type == RELATIVE) {
-		printf("Relative position X-Y move\n");
-		printf("X offset (steps): ");
-		fflush(stdout);
-		xoff = atol(gets(buf));
-		printf("Y offset (steps): ");
-		fflush(stdout);
-		yoff = atol(gets(buf));
-		if (xoff == 0 && yoff == 0) {
-			printf("No motion\n");
-			return;
-		}
-		if (debugFlag) {
-			printf("X, Y offsets: %ld %ld\n", xoff, yoff);
-		}
-		moveRel(xoff,yoff);
-		return;
+	if (firstCall) {
+		tcgetattr(STDIN_FILENO, &oldtty);
+		firstCall = 0;
+	}
+	if (mode == NONBLOCKING) {
+		newtty = oldtty;
+		newtty.c_lflag &= ~(ICANON | ECHO);
+		tcsetattr(STDIN_FILENO, TCSANOW, &newtty);
 	} else {
-		printf("move(%d) type not ABSOLUTE or RELATIVE\n", type);
+		tcsetattr(STDIN_FILENO, TCSANOW, &oldtty);
 	}
+
 }
 
 /*-------------------------------------------------------------------
 
-	int moveAbs(float, float) (LIBRARY)
+	int settleWait(struct guider *g, int axes, double moveEnd) (LIBRARY)
 
-	moveAbs positions the guider stage at coordinates (x,y) where
-	x and y are in inches.
-
-	The coordinates are positive numbers referenced to the
-	upper right hand corner of the guider patrol space (the
-	home position).
+	settleWait watches the X and Y encoders among "axes" after a
+	move that ended (motion complete) at hostSeconds() moveEnd,
+	sampling them every SETTLEPERIOD in one batched query, and
+	returns once every axis has stayed within SETTLEBAND counts for
+	SETTLEWINDOW seconds. The stage counts as settled from the
+	start of that window; g->settle records when, and how far
+	each axis ended from where the commanded step position puts
+	it (calibrated only, else 0). An exposure can start at
+	g->settle.settled rather than after a fixed delay.
 
-	A calibrate() operation must be done before this command.
+	Returns PASS, or FAIL if the stage was still moving after
+	SETTLETIMEOUT seconds of watching (g->settle.settled is 0).
 
-Minor changes; check it 2012-04-26
 -------------------------------------------------------------------*/
-int moveAbs(x, y)
-float x, y;
+int settleWait(g, axes, moveEnd)
+struct guider *g;
+int axes;
+double moveEnd;
 {
 
-	long xEncOld, yEncOld, xEncNew, yEncNew, xSteps, ySteps, temp;
-	float xPulsPerStep, yPulsPerStep;
-
-	if (!isCalibrated) {
-		if (debugFlag) {
-			printf(" not calibrated\n");
-			fflush(stdout);
+	char *operands[2 * LASTAXIS], names[2 * LASTAXIS][8];
+	int axis, n, first;
+	double vals[2 * LASTAXIS], ref[LASTAXIS + 1], t, start, windowStart;
+
+	axes &= (1 << XAXIS) | (1 << YAXIS);	// The axes with encoders
+	g->settle.axes = axes;
+	g->settle.moveEnd = moveEnd;
+	g->settle.settled = 0.0;
+	n = 0;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		g->settle.residual[axis] = 0.0;
+		if (axes & (1 << axis)) {
+			sprintf(names[n], "_TP%c", axisTable[axis].letter);
+			operands[n] = names[n];
+			n++;
+			sprintf(names[n], "_RP%c", axisTable[axis].letter);
+			operands[n] = names[n];
+			n++;
 		}
-		return(0);
 	}
-
-	if (x > xMaxInches || x < 0.0) {
-		return(0);
+	if (n == 0) {
+		return(PASS);
 	}
-	if (y > yMaxInches || y < 0.0) {
-		return(0);
+
+	first = 1;
+	start = windowStart = hostSeconds();
+	for (;;) {
+		if (askGalilForValues(g, operands, n, vals) != n) {
+			return(FAIL);
+		}
+		t = hostSeconds();
+		n = 0;
+		for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+			if (!(axes & (1 << axis))) {
+				continue;
+			}
+			if (first || fabs(vals[n] - ref[axis]) > SETTLEBAND) {
+				ref[axis] = vals[n];
+				windowStart = t;	// Moved: the window starts again
+			}
+			if (g->isCalibrated) {
+				g->settle.residual[axis] = vals[n] - (g->encOffset[axis] + vals[n + 1] * g->encPerStep[axis]);
+			}
+			estimateStep(g, axis, t, (long int) vals[n + 1]);
+			estimateEncoder(g, axis, t, (long int) vals[n]);
+			n += 2;
+		}
+		first = 0;
+		if (t - windowStart >= SETTLEWINDOW) {
+			g->settle.settled = windowStart;
+			LOG(g, LOGMOTION, LOGDEBUG, "settled %.3f s after the move, residual %.0f %.0f counts",
+				windowStart - moveEnd, g->settle.residual[XAXIS], g->settle.residual[YAXIS]);
+			return(PASS);
+		}
+		if (t - start > SETTLETIMEOUT) {
+			LOG(g, LOGMOTION, LOGWARN, "stage not settled %.1f s after the move", t - moveEnd);
+			return(FAIL);
+		}
+		usleep((useconds_t) (SETTLEPERIOD * 1.0e6));
 	}
-	xPulsPerStep = (float) XENCPULSPERTURN / (float) XSTEPSPERTURN;
-	yPulsPerStep = (float) YENCPULSPERTURN / (float) YSTEPSPERTURN;
 
-	// save current encoder position
-	xEncOld = encPosition(XAXIS);
-	yEncOld = encPosition(YAXIS);
+}
 
-	// compute target encoder position
-	xEncNew = xEncOffset - (long int) (x * ((float) XENCPULSPERTURN)/XSCREWPITCH);
-	yEncNew = yEncOffset - (long int) (y * ((float) YENCPULSPERTURN)/YSCREWPITCH);
+/*-------------------------------------------------------------------
+
+	int replayFind(struct replay *r, char *cmd, int len) (LIBRARY)
+
+	Finds the recorded exchange to answer cmd with. Normally it
+	is the next one. If not (timing changed how often something
+	was polled), the next REPLAYWINDOW entries are searched and
+	any passed over are skipped; failing that the latest earlier
+	entry with the same command is used again. Returns the entry
+	index, or -1 if cmd was never recorded.
+
+-------------------------------------------------------------------*/
+int replayFind(r, cmd, len)
+struct replay *r;
+char *cmd;
+int len;
+{
+
+	int i;
 
-	if ((xEncNew > xEncOffset) || (xEncNew < xEncMin)) {
-		if (debugFlag) {
-			printf("xEncNew out of range (%ld)\n", yEncNew);
+	for (i = r->next; i < r->n && i <= r->next + REPLAYWINDOW; i++) {
+		if (r->e[i].cmdLen == len && memcmp(r->e[i].cmd, cmd, len) == 0) {
+			if (i == r->next) {
+				r->inOrder++;
+			}
+			r->skipped += i - r->next;
+			r->next = i + 1;
+			return(i);
 		}
-		return(0);
 	}
-	if ((yEncNew > yEncOffset) || (yEncNew < yEncMin)) {
-		if (debugFlag) {
-			printf("yEncNew out of range (%ld)\n", yEncNew);
+	for (i = r->next - 1; i >= 0; i--) {
+		if (r->e[i].cmdLen == len && memcmp(r->e[i].cmd, cmd, len) == 0) {
+			r->reused++;
+			return(i);
 		}
-		return(0);
 	}
-
-	// compute motor steps
-	temp = (xEncNew - xEncOld);
-	xSteps = (temp >= 0) ? (long int) (((double) (temp + 0.5)) / xPulsPerStep) : (long int) (((double) (temp - 0.5)) / xPulsPerStep);
-	temp = (yEncNew - yEncOld);
-	ySteps = (temp >= 0) ? (long int) (((double) (temp + 0.5)) / yPulsPerStep) : (long int) (((double) (temp - 0.5)) / yPulsPerStep);
-
-	moveRel(xSteps, ySteps);
-	return(1);
+	r->unknown++;
+	return(-1);
 
 }
 
 /*-------------------------------------------------------------------
 
-	void moveOneAxis(int, int, int) (LIBRARY)
-
-	moveOneAxis commands a single-axis motion with the selected
-	number of motor steps and speed. Acceleration and deceleration
-	values are defaults.
+	int replayLoad(struct replay *r) (LIBRARY)
 
-	IMPORTANT NOTE: moveOneAxis turns on the motor power and
-	releases the brakes (if any) but does not turn off the motor
-	or set the brakes. This must be done after with a call to
-	motorPower(axis, onOffStatus), which waits for motion to
-	stop, then turns on the brake (if any) and turns off the
-	motor.
+	Reads the transcript r->file (see transcriptAdd() for the
+	format) into r->e. Returns the number of exchanges, or -1 if
+	the file can't be read.
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-void moveOneAxis(axis, steps, speed)
-int axis, steps, speed;
+int replayLoad(r)
+struct replay *r;
 {
 
-	char axischar, buf[20];
-	long int acceleration, deceleration;
+	char *line, *data, *cp, *out, **field;
+	int size, len, *fieldLen;
+	double t, sent;
+	struct replayEntry *e;
+	FILE *fp;
 
-	acceleration = XYACCEL;
-	deceleration = XYDECEL;
-
-	switch (axis) {
-		case XAXIS:
-			axischar = 'A';
-			motorPower(XAXIS, ON);
-			break;
-
-		case YAXIS:
-			axischar = 'B';
-			motorPower(YAXIS, ON);
-			break;
-
-		case ZAXIS:
-			axischar = 'C';
-			acceleration = ZACCEL;
-			deceleration = ZDECEL;
-			motorPower(ZAXIS, ON);
-			break;
-
-		default:
-			return;
+	if (!(fp = fopen(r->file, "r")) || !(line = (char *) malloc(REPLAYLINE))) {
+		return(-1);
 	}
+	size = 0;
+	r->n = 0;
+	r->e = NULL;
+	e = NULL;
+	sent = 0.0;
+	while (fgets(line, REPLAYLINE, fp)) {
+		if ((line[0] != '>' && line[0] != '<') || sscanf(line + 1, "%lf", &t) != 1) {
+			continue;			// Comment or damage
+		}
+		if (!(data = strchr(line + 2, ' '))) {
+			continue;
+		}
+		data++;
+		data[strcspn(data, "\n")] = '\0';
+		if (line[0] == '>') {
+			if (r->n == size) {
+				size = size ? 2 * size : 1024;
+				r->e = (struct replayEntry *) realloc(r->e, size * sizeof(struct replayEntry));
+			}
+			e = &r->e[r->n++];
+			memset(e, 0, sizeof(*e));
+			sent = t;
+			field = &e->cmd;
+			fieldLen = &e->cmdLen;
+		} else if (e) {
+			if (e->replyLen == 0) {
+				e->latency = t - sent;
+			}
+			field = &e->reply;
+			fieldLen = &e->replyLen;
+		} else {
+			continue;			// A reply before any command
+		}
 
-	sprintf(buf, "SP%c=%d", axischar, speed);
-	tellGalil(buf);
-	sprintf(buf, "AC%c=%ld", axischar, acceleration);
-	tellGalil(buf);
-	sprintf(buf, "DC%c=%ld", axischar, deceleration);
-	tellGalil(buf);
-	sprintf(buf, "PR%c=%d", axischar, steps);
-	tellGalil(buf);
-	sprintf(buf, "BG%c", axischar);
-	tellGalil(buf);
+		*field = (char *) realloc(*field, *fieldLen + strlen(data) + 1);
+		out = *field + *fieldLen;
+		for (cp = data; *cp; cp++) {	// Undo transcriptAdd()'s escapes
+			if (*cp != '\\' || !cp[1]) {
+				*out++ = *cp;
+			} else if (*++cp == 'r') {
+				*out++ = '\r';
+			} else if (*cp == 'n') {
+				*out++ = '\n';
+			} else if (*cp == 'x' && sscanf(cp + 1, "%2x", &len) == 1) {
+				*out++ = (char) len;
+				cp += 2;
+			} else {
+				*out++ = *cp;
+			}
+		}
+		*fieldLen = out - *field;
+	}
+	free(line);
+	fclose(fp);
+	return(r->n);
 
 }
 
 /*-------------------------------------------------------------------
 
-	void moveRel(long int, long int) (LIBRARY)
+	int replayOpen(char *spec) (LIBRARY)
 
-	Moves the X-Y stage to the new position, relative motor
-	steps. This could be more elegant, but it works.
+	Plays a transcript back as if it were the controller, so a
+	recorded session can be rerun offline. spec is "file" or
+	"file@speed": each reply comes after its recorded latency
+	divided by speed (default 1, real time; @0 for none).
+	Returns a socket to use as the controller's, from
+	telnetToGalil(), or -4 if the transcript can't be read. The
+	commands answered and how well they matched are reported at
+	exit (transcriptReport()).
 
-Checked 2012-04-30
 -------------------------------------------------------------------*/
-void moveRel(x, y)
-long int x, y;
+int replayOpen(spec)
+char *spec;
 {
 
-	if (x) {
-		moveOneAxis(XAXIS, x, XYSPEED);
+	static int reporting = 0;
+	struct replay *r;
+	pthread_t tid;
+	char *cp;
+	int fds[2];
+
+	if (!(r = (struct replay *) calloc(1, sizeof(struct replay)))) {
+		return(-4);
 	}
-	if (y) {
-		moveOneAxis(YAXIS, y, XYSPEED);
+	strncpy(r->file, spec, sizeof(r->file) - 1);
+	r->speed = 1.0;
+	if ((cp = strrchr(r->file, '@'))) {
+		*cp = '\0';
+		r->speed = atof(cp + 1);
 	}
-	while (isMoving(XAXIS)) {
+	if (replayLoad(r) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+		free(r);
+		return(-4);
 	}
-	while (isMoving(YAXIS)) {
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	r->fd = fds[1];
+	r->start = hostSeconds();
+	r->link = replays;
+	replays = r;
+	if (!reporting) {
+		atexit(transcriptReport);
+		reporting = 1;
 	}
-	motorPower(XAXIS, OFF);
-	motorPower(YAXIS, OFF);
-}
+	pthread_create(&tid, NULL, replayThread, r);
+	pthread_detach(tid);
+	return(fds[0]);
 
+}
 
 /*-------------------------------------------------------------------
 
-	void passthru() (USER)
+	void *replayThread(void *r) (LIBRARY)
 
-	Talk directly to the Galil controller.
+	Thread for replayOpen(): takes each write from aoguider as one
+	command, finds its reply (replayFind()), waits the scaled
+	recorded latency and sends it. A command never recorded gets
+	"?", except the bare carriage return telnetToGalil() sends,
+	which gets ":".
 
-Checked 2012-04-26 (increased string sizes)
 -------------------------------------------------------------------*/
-void passthru()
+void *replayThread(arg)
+void *arg;
 {
 
-	char cmd[128], buf[128];
+	char buf[2048];
+	int i, got;
+	struct replay *r;
 
-	printf("Galil command\n:");
-	fflush(stdout);
-	gets(cmd);
-	askGalil(cmd, buf, 128);
-	printf("%s\n", buf);
-	if (buf[strlen(buf) - 1] == '?') {	// Error message from Galil?
-		askGalil("TC1", buf, 128);
-		printf("%s\n", buf);		// Print TC1 error message
+	r = (struct replay *) arg;
+	while ((got = read(r->fd, buf, sizeof(buf))) > 0) {
+		if ((i = replayFind(r, buf, got)) < 0) {
+			write(r->fd, (got == 1 && buf[0] == '\r') ? ":" : "?", 1);
+			continue;
+		}
+		if (r->speed > 0.0 && r->e[i].latency > 0.0) {
+			usleep((useconds_t) (r->e[i].latency / r->speed * 1.0e6));
+		}
+		r->recorded += r->e[i].latency;
+		if (r->e[i].replyLen > 0) {
+			write(r->fd, r->e[i].reply, r->e[i].replyLen);
+		}
 	}
-	fflush(stdout);
+	return(NULL);
 
 }
 
 /*-------------------------------------------------------------------
 
-	int selfCheck() (USER)
+	resetGalil(struct guider *g) (LIBRARY)
 
-	selfCheck does a few sanity checks on the guider. It moves
-	the three pneumatic cyinders and notices if the GMR sensors
-	are correctly triggered and it moves the X-Y axis motors
-	to see if the axis encoders report position changes of about
-	the correct amount.
+	resetGalil sends the RS command to the Galil. This resets
+	the controller to its power-on state.
+	The Galil sends a character that's not a ':' or '?' so
+	tellGalil() reports it as not accepted.
+	This is normal. It then pings the controller every RESETPOLL
+	seconds until it answers, for up to RESETTIMEOUT. If the reset
+	drops the connection, the ping reconnects (galilReconnect()).
 
 Checked 2012-04-26
 -------------------------------------------------------------------*/
-int selfCheck()
+void resetGalil(g)
+struct guider *g;
 {
 
-	int i, testVal, retVal;
-	long int oldEnc;
-	float encScale;
+	double t0;
+
+	g->link.resetting = 1;
+	tellGalil(g, "RS");
+	forgetConfig(g);				// RS restores power-on values
+	g->clock.loaded = 0;				// and restarts TIME
+	g->clock.nSyncs = 0;
+	g->cmdKnown = 0;
+	g->poweredAxes = 0;
+	estimateReset(g);
+
+	// The ping also sets the marker galilResync() looks for
+	t0 = hostSeconds();
+	while (!tellGalil(g, "aolive=1") && hostSeconds() - t0 < RESETTIMEOUT) {
+		usleep((useconds_t) (RESETPOLL * 1.0e6));
+	}
+	LOG(g, LOGIO, LOGINFO, "controller answered %.2f s after RS", hostSeconds() - t0);
+	g->link.resetting = 0;
+	softLimits(g, OFF);				// RS cleared them; forget them here too
 
-	retVal = PASS;
-	for (i = 0; i < 2; i++) {
-		testVal = cylinder(Y1AXIS, EXTEND);
-		if (testVal != 1) {
-			retVal = FAIL;
-		} 
-		testVal = cylinder(Y1AXIS, RETRACT);
-		if (testVal != 0) {
-			retVal = FAIL;
+}
+
+/*-------------------------------------------------------------------
+
+	int saveCalibration(struct guider *g, char *filename) (LIBRARY)
+
+	saveCalibration writes the values loadCalibration() reads.
+	Returns 1 on success, 0 if the file could not be written.
+
+-------------------------------------------------------------------*/
+int saveCalibration(g, filename)
+struct guider *g;
+char *filename;
+{
+
+	int i, axis;
+	FILE *fp;
+
+	if ((fp = fopen(filename, "w")) == NULL) {
+		return(0);
+	}
+	fprintf(fp, "# aoguider calibration\n");
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		fprintf(fp, "profile %c %ld %ld %ld\n", axisTable[axis].name, g->axisProfile[axis].speed,
+			g->axisProfile[axis].accel, g->axisProfile[axis].decel);
+	}
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (axisTable[axis].brakeOut) {
+			fprintf(fp, "brake %c %.3f %.3f\n", axisTable[axis].name, g->brakeEngage[axis],
+				g->brakeRelease[axis]);
 		}
-		testVal = cylinder(Y2AXIS, EXTEND);
-		if (testVal != 1) {
-			retVal = FAIL;
+	}
+	for (i = 0; i < g->nFocusSamples; i++) {
+		fprintf(fp, "focussample %.4f %.4f %ld\n", g->focusSamples[i].x,
+			g->focusSamples[i].y, g->focusSamples[i].z);
+	}
+	if (g->focusMapTerms) {
+		fprintf(fp, "focusmap %d", g->focusMapTerms);
+		for (i = 0; i < FOCUSTERMS; i++) {
+			fprintf(fp, " %.9g", g->focusMap[i]);
 		}
-		testVal = cylinder(Y2AXIS, RETRACT);
-		if (testVal != 0) {
-			retVal = FAIL;
+		fprintf(fp, "\n");
+	}
+	for (i = 0; i < g->nPixelSamples; i++) {
+		fprintf(fp, "pixelsample %.3f %.3f %.4f %.4f\n", g->pixelSamples[i].px,
+			g->pixelSamples[i].py, g->pixelSamples[i].x, g->pixelSamples[i].y);
+	}
+	if (g->pixelMapTerms) {
+		fprintf(fp, "pixelmap %d %.9g %.9g %.9g", g->pixelMapTerms, g->pixelMapCenter[0],
+			g->pixelMapCenter[1], g->pixelMapCenter[2]);
+		for (i = 0; i < PIXELTERMS; i++) {
+			fprintf(fp, " %.9g", g->pixelMapX[i]);
 		}
+		for (i = 0; i < PIXELTERMS; i++) {
+			fprintf(fp, " %.9g", g->pixelMapY[i]);
+		}
+		fprintf(fp, "\n");
 	}
+	fclose(fp);
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int scheduleAxes(g, when, axes, out, val) (LIBRARY)
+
+	scheduleAxes has the controller begin the moves prepareMove()
+	set up on "axes" (a bit mask as for beginAxes()) when its TIME
+	reaches "when", and at the same moment set digital output
+	"out" to val (out 0 for none). The wait runs in controller
+	thread 1 (ttagProgram[]), so the start doesn't depend on host
+	or network timing; use hostToGalil() to turn a host time,
+	such as the end of a camera exposure, into "when".
 
+	The clock is synced first if the last sync is more than
+	CLOCKPERIOD seconds old. Only one schedule can be pending per
+	guider. Returns 1 if scheduled, 0 if "when" is less than
+	TTAGLEAD counts away, one is already pending, or the
+	controller refused.
 
-	if (limitSwitch(XAXIS) || limitSwitch(YAXIS)) {
-		backOff();
+-------------------------------------------------------------------*/
+int scheduleAxes(g, when, axes, out, val)
+struct guider *g;
+double when;
+int axes, out, val;
+{
+
+	char buf[128], reply[64], *operands[1];
+	int axis, bits, n;
+	double done;
+
+	if (g->job.cancel) {
+		return(0);
 	}
-	oldEnc = encPosition(XAXIS);
-	moveRel(200,0);
-	encScale = (float) (encPosition(XAXIS) - oldEnc) / 200.0;
-	if (fabs(encScale - 4.0) > 0.02) {
-		printf("Fail X encoder scale (%7.5f)\n", encScale);
-		retVal = FAIL;
+	if (!g->clock.loaded && !clockProgram(g)) {
+		return(0);
 	}
-	oldEnc = encPosition(YAXIS);
-	moveRel(0,200);
-	encScale = (float) (encPosition(YAXIS) - oldEnc) / 200.0;
-	if (fabs(encScale - 4.0) > 0.02) {
-		printf("Fail Y encoder scale (%7.5f)\n", encScale);
-		retVal = FAIL;
+	if (g->clock.nSyncs == 0 || hostSeconds() - g->clock.host0 > CLOCKPERIOD) {
+		if (!clockSync(g)) {
+			return(0);
+		}
 	}
-	if (retVal == PASS) {
-		printf("passed\n");
-	} else {
-		printf("failed\n");
+	if (when - hostToGalil(g, hostSeconds()) < TTAGLEAD) {
+		return(0);
 	}
-	fflush(stdout);
-	return(retVal);
+	operands[0] = "ttdone";
+	if (askGalilForValues(g, operands, 1, &done) != 1 || done == 0.0) {
+		return(0);
+	}
+
+	bits = 0;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (axes & (1 << axis)) {
+			bits |= 1 << (axis - XAXIS);
+		}
+	}
+	sprintf(buf, "ttime=%.0f;ttbg=%d;ttout=%d;ttval=%d;ttdone=0;XQ #TTAG,1\r",
+		when, bits, out, val ? 1 : 0);
+	galilLock(g);
+	galilSend(g, buf, strlen(buf));
+	n = readGalil(g, reply, sizeof(reply), 6);
+	galilUnlock(g);
+	if (n < 6 || strchr(reply, '?')) {
+		return(0);
+	}
+	noteBegin(g, axes, galilToHost(g, when));
+	return(1);
+
 }
 
 /*-------------------------------------------------------------------
 
-	setMode(mode) (USER)
+	int scheduleMoveRel(g, when, x, y, out, val) (LIBRARY)
 
-	setMode switches between ICANON and ~ICANON tty modes. This
-	is used for the command keys. mode is either NONBLOCKING
-	(for one-key command mode) or BLOCKING (for line oriented
-	input).
+	Prepares a relative X-Y move of (x, y) motor steps and has it
+	begin at controller TIME "when", with output out set to val
+	then (see scheduleAxes()). The brakes are released now, not at
+	"when". Returns the axes scheduled, or -1 if scheduleAxes()
+	refused, in which case the axes are powered down again, or if
+	the move would end past a soft limit (softLimitCheck()). The
+	caller waits for the move and powers down as after moveRel().
 
-Checked 2012-04-26
 -------------------------------------------------------------------*/
-void setMode(mode)
-int mode;
+int scheduleMoveRel(g, when, x, y, out, val)
+struct guider *g;
+double when;
+long int x, y;
+int out, val;
 {
 
-	static int firstCall = 1;
-	static struct termios oldtty, newtty;
+	int axes;
 
-	if (firstCall) {
-		tcgetattr(STDIN_FILENO, &oldtty);
-		firstCall = 0;
+	if (!softLimitCheck(g, XAXIS, x) || !softLimitCheck(g, YAXIS, y)) {
+		return(-1);
 	}
-	if (mode == NONBLOCKING) {
-		newtty = oldtty;
-		newtty.c_lflag &= ~(ICANON | ECHO);
-		tcsetattr(STDIN_FILENO, TCSANOW, &newtty);
-	} else {
-		tcsetattr(STDIN_FILENO, TCSANOW, &oldtty);
+	axes = 0;
+	if (x) {
+		prepareMove(g, XAXIS, x, g->axisProfile[XAXIS].speed);
+		axes |= (1 << XAXIS);
+	}
+	if (y) {
+		prepareMove(g, YAXIS, y, g->axisProfile[YAXIS].speed);
+		axes |= (1 << YAXIS);
+	}
+	if (!scheduleAxes(g, when, axes, out, val)) {
+		if (axes & (1 << XAXIS)) {
+			motorPower(g, XAXIS, OFF);
+		}
+		if (axes & (1 << YAXIS)) {
+			motorPower(g, YAXIS, OFF);
+		}
+		return(-1);
 	}
+	return(axes);
 
 }
 
 /*-------------------------------------------------------------------
 
-	resetGalil() (LIBRARY)
+	void scheduleUser(struct guider *g) (USER)
 
-	resetGalil sends the RS command to the Galil. This resets
-	the controller to its power-on state.
-	The Galil sends a character that's not a ':' or '?' so
-	the tellGalil() function will return an error message.
-	This is normal.
+	Syncs the controller clock, or schedules a relative X-Y move
+	(and optionally an output change) "seconds" from now, waits
+	for it and reports how late the controller started it.
 
-Checked 2012-04-26
 -------------------------------------------------------------------*/
-void resetGalil()
+void scheduleUser(g)
+struct guider *g;
 {
 
-	tellGalil("RS");
-	sleep(4);
+	char buf[80], *operands[1];
+	int axes, out, val;
+	long int dx, dy;
+	double seconds, when, fired, wait;
+
+	printf("time-tagged: s)ync clock, m)ove dx dy seconds [output value]: ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return;
+	}
+	if (buf[0] == 's') {
+		if (!clockSync(g)) {
+			printf("can't read TIME\n");
+		} else {
+			printf("TIME %.0f at host %.3f s, %.3f counts/s, round trip %.2f ms, %d syncs\n",
+				g->clock.time0, g->clock.host0, g->clock.rate,
+				1000.0 * g->clock.roundTrip, g->clock.nSyncs);
+		}
+	} else if (buf[0] == 'm') {
+		out = val = 0;
+		if (sscanf(buf + 1, "%ld %ld %lf %d %d", &dx, &dy, &seconds, &out, &val) < 3) {
+			printf("m dx dy seconds [output value]\n");
+			fflush(stdout);
+			return;
+		}
+		if (!clockSync(g)) {
+			printf("can't read TIME\n");
+			fflush(stdout);
+			return;
+		}
+		when = hostToGalil(g, hostSeconds() + seconds);
+		axes = scheduleMoveRel(g, when, dx, dy, out, val);
+		if (axes < 0) {
+			printf("not scheduled (too soon, or one is pending)\n");
+			fflush(stdout);
+			return;
+		}
+		printf("scheduled for TIME %.0f\n", when);
+		fflush(stdout);
+		wait = galilToHost(g, when) - hostSeconds();
+		if (wait > 0.0) {
+			usleep((useconds_t) (wait * 1.0e6));
+		}
+		operands[0] = "ttdone";
+		while (askGalilForValues(g, operands, 1, &fired) == 1 && fired == 0.0) {
+			usleep(1000);
+		}
+		superviseMove(g, axes);
+		if (axes & (1 << XAXIS)) {
+			motorPower(g, XAXIS, OFF);
+		}
+		if (axes & (1 << YAXIS)) {
+			motorPower(g, YAXIS, OFF);
+		}
+		operands[0] = "ttfired";
+		if (askGalilForValues(g, operands, 1, &fired) == 1) {
+			printf("started at TIME %.0f (%+.0f counts)\n", fired, fired - when);
+		}
+	}
+	fflush(stdout);
 
 }
 
 /*-------------------------------------------------------------------
 
-	int shCam(void) (LIBRARY)
+	int shCam(struct guider *g) (LIBRARY)
 
 	shCam inserts the Shack-Hartmann lenslet array into the beam.
 	shCam inserts the Shack-Hartmann lenslet array into the
@@ -1882,12 +7966,13 @@ void resetGalil()
 
 Checked 2012-04-30
 -------------------------------------------------------------------*/
-int shCam()
+int shCam(g)
+struct guider *g;
 {
 
 	int status;
 
-	status = cylinder(Y1AXIS, EXTEND);
+	status = cylinder(g, Y1AXIS, EXTEND);
 	if (status == EXTEND) {
 		return(IN);
 	} else {
@@ -1898,7 +7983,7 @@ int shCam()
 
 /*-------------------------------------------------------------------
 
-	int smallAp(void) (LIBRARY)
+	int smallAp(struct guider *g) (LIBRARY)
 
 	smallAp inserts the small aperture into the camera beam by
 	extending the Y2 cylinder. It has the opposite action of
@@ -1909,12 +7994,13 @@ int shCam()
 
 Checked 2012-04-30
 -------------------------------------------------------------------*/
-int smallAp()
+int smallAp(g)
+struct guider *g;
 {
 
 	int status;
 
-	status = cylinder(Y2AXIS, EXTEND);
+	status = cylinder(g, Y2AXIS, EXTEND);
 	if (status == EXTEND) {
 		return(IN);
 	} else {
@@ -1925,129 +8011,393 @@ int smallAp()
 
 /*-------------------------------------------------------------------
 
-	void statusPrint(void) (USER)
+	int softLimitCheck(struct guider *g, int axis, long int steps) (LIBRARY)
+
+	The host's check of a relative move of "steps" on axis against
+	the soft limits softLimits() gave the controller, made from
+	the cached commanded position without asking the controller.
+	Returns 0, and logs why, if the move would end past a limit;
+	1 if it wouldn't, if the axis has no soft limits, or if its
+	commanded position isn't known (the controller still stops
+	it).
+
+-------------------------------------------------------------------*/
+int softLimitCheck(g, axis, steps)
+struct guider *g;
+int axis;
+long int steps;
+{
+
+	double target, fwd, rev;
+
+	if (steps == 0 || !(g->softLimited & (1 << axis)) || !(g->cmdKnown & (1 << axis))) {
+		return(1);
+	}
+	target = (double) (g->cmdPosition[axis] + steps);
+	fwd = findParam(g, "FL")->value[axis - XAXIS];
+	rev = findParam(g, "BL")->value[axis - XAXIS];
+	if (target > fwd || target < rev) {
+		LOG(g, LOGMOTION, LOGWARN, "%c move of %ld steps to %.0f is past the soft limits (%.0f..%.0f)",
+			axisTable[axis].name, steps, target, rev, fwd);
+		return(0);
+	}
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void softLimits(struct guider *g, int onOff) (LIBRARY)
+
+	Turns the controller's soft limits (FL and BL) on each axis on
+	(ON) or off (OFF). The ends of travel calibrate() found, home
+	at step 0 and stepMin at the reverse end, are each one motor
+	turn back from a limit switch (homeAxes() and calibrate() back
+	off that far). On, the limits sit SOFTMARGIN of that back-off
+	beyond the ends: FL at +SOFTMARGIN turns, BL at stepMin minus
+	SOFTMARGIN turns. So the whole calibrated travel can be
+	reached, and the controller still stops any move before the
+	switches, so moves can run at full speed without ever needing
+	backOff(). SOFTMARGIN must be less than one turn. The values
+	are kept in galilConfig[], so applyConfig() restores them.
+
+-------------------------------------------------------------------*/
+void softLimits(g, onOff)
+struct guider *g;
+int onOff;
+{
+
+	struct galilParam *fwd, *rev;
+	double backOff, margin;
+	int axis, i;
+
+	assert(SOFTMARGIN < 1.0);		// Or the limits are past the switches
+	fwd = findParam(g, "FL");
+	rev = findParam(g, "BL");
+	g->softLimited = 0;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		i = axis - XAXIS;
+		backOff = (double) axisTable[axis].stepsPerTurn;	// Switch to end of travel
+		margin = SOFTMARGIN * backOff;
+		if (onOff == ON && g->stepMin[axis] < -2.0 * margin) {
+			fwd->value[i] = margin;
+			rev->value[i] = (double) g->stepMin[axis] - margin;
+			g->softLimited |= (1 << axis);
+		} else {
+			fwd->value[i] = SOFTFWDOFF;
+			rev->value[i] = SOFTREVOFF;
+		}
+		sendParam(g, fwd, i, fwd->value[i]);
+		sendParam(g, rev, i, rev->value[i]);
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	int solveLinear(int n, double *a, double *b) (LIBRARY)
+
+	solveLinear solves the n x n linear system a x = b by Gaussian
+	elimination with partial pivoting. a is stored by rows and is
+	destroyed; the solution replaces b. Returns 1 on success,
+	0 if the system is singular.
+
+-------------------------------------------------------------------*/
+int solveLinear(n, a, b)
+int n;
+double *a, *b;
+{
+
+	int i, j, k, pivot;
+	double f, tmp;
+
+	for (k = 0; k < n; k++) {
+		pivot = k;
+		for (i = k + 1; i < n; i++) {
+			if (fabs(a[i * n + k]) > fabs(a[pivot * n + k])) {
+				pivot = i;
+			}
+		}
+		if (fabs(a[pivot * n + k]) < 1.0e-12) {
+			return(0);
+		}
+		if (pivot != k) {
+			for (j = 0; j < n; j++) {
+				tmp = a[k * n + j];
+				a[k * n + j] = a[pivot * n + j];
+				a[pivot * n + j] = tmp;
+			}
+			tmp = b[k];
+			b[k] = b[pivot];
+			b[pivot] = tmp;
+		}
+		for (i = k + 1; i < n; i++) {
+			f = a[i * n + k] / a[k * n + k];
+			for (j = k; j < n; j++) {
+				a[i * n + j] -= f * a[k * n + j];
+			}
+			b[i] -= f * b[k];
+		}
+	}
+	for (k = n - 1; k >= 0; k--) {
+		for (j = k + 1; j < n; j++) {
+			b[k] -= a[k * n + j] * b[j];
+		}
+		b[k] /= a[k * n + k];
+	}
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void statusPrint(struct guider *g) (USER)
 
 	statusPrint prints status information. Most values are
 	from direct queries to the Galil controller, although some
 	items (SAXIS position, for example) no not have a sensor.
 
 -------------------------------------------------------------------*/
-void statusPrint()
+void statusPrint(g)
+struct guider *g;
 {
 
+	int axis, status;
+	double est, sigma;
+
 	printf("Status:\n");
-	printf("homeTime (local, remote): %ld %ld\n", homeTime, askGalilForLong("MG homeTime"));
+	printf("homeTime (local, remote): %ld %ld\n", g->homeTime, askGalilForLong(g, "MG homeTime"));
 
 	printf("motors homed? ");
-	if (isHomed()) {
+	if (isHomed(g)) {
 		printf("YES\n");
 	} else {
 		printf("NO\n");
 	}
 
-	printf("X-brake ");
-	if (brake(XAXIS, STATUS) == ON) {
-		printf("ON\n");
-	} else if (brake(XAXIS, STATUS) == OFF) {
-		printf("OFF\n");
-	} else {
-		printf("UNKNOWN\n");
-	}
-
-	printf("Y-brake ");
-	if (brake(YAXIS, STATUS) == ON) {
-		printf("ON\n");
-	} else if (brake(YAXIS, STATUS) == OFF) {
-		printf("OFF\n");
-	} else {
-		printf("UNKNOWN\n");
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (!axisTable[axis].brakeOut) {
+			continue;
+		}
+		printf("%c-brake ", axisTable[axis].name);
+		status = brake(g, axis, STATUS);
+		if (status == ON) {
+			printf("ON\n");
+		} else if (status == OFF) {
+			printf("OFF\n");
+		} else {
+			printf("UNKNOWN\n");
+		}
 	}
 
 	// Print the motor step position (RP)
-	printf("Motors (X,Y,Z) = (%ld, %ld, %ld)\n", stepPosition(XAXIS), stepPosition(YAXIS), stepPosition(ZAXIS));
+	printf("Motors (X,Y,Z) = (%ld, %ld, %ld)\n", stepPosition(g, XAXIS), stepPosition(g, YAXIS), stepPosition(g, ZAXIS));
 
 	// Print the encoder counts (TP)
-	printf("Encoder: (X,Y) = (%ld, %ld)\n", encPosition(XAXIS), encPosition(YAXIS));
+	printf("Encoder: (X,Y) = (%ld, %ld)\n", encPosition(g, XAXIS), encPosition(g, YAXIS));
 
 	// Print encoder offsets
-	printf("Encoder offsets: (X,Y) = (%ld, %ld)\n", xEncOffset, yEncOffset);
+	printf("Encoder offsets: (X,Y) = (%ld, %ld)\n", g->encOffset[XAXIS], g->encOffset[YAXIS]);
 
 	// Print encoder minvals
-	printf("Encoder minvals: (X,Y) = (%ld, %ld)\n", xEncMin, yEncMin);
+	printf("Encoder minvals: (X,Y) = (%ld, %ld)\n", g->encMin[XAXIS], g->encMin[YAXIS]);
 
-	if (isCalibrated) {
-		printf("Stage position (x,y) %7.3f %7.3f (inches)\n", inchPosition(XAXIS), inchPosition(YAXIS));
+	if (g->isCalibrated) {
+		printf("Stage position (x,y) %7.3f %7.3f (inches)\n", inchPosition(g, XAXIS), inchPosition(g, YAXIS));
+	}
+	printf("Estimate (steps):");
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		if (positionEstimate(g, axis, hostSeconds(), &est, &sigma)) {
+			printf(" %c %.1f +/- %.1f", axisTable[axis].name, est, sigma);
+		} else {
+			printf(" %c unknown", axisTable[axis].name);
+		}
+	}
+	printf("\n");
+	if (g->softLimited) {
+		printf("Soft limits (steps):");
+		for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+			printf(" %c %.0f..%.0f", axisTable[axis].name, findParam(g, "BL")->value[axis - XAXIS],
+				findParam(g, "FL")->value[axis - XAXIS]);
+		}
+		printf("\n");
+	}
+	if (g->stalledAxes) {
+		printf("Stalled:%s%s (calibrate again)\n", (g->stalledAxes & (1 << XAXIS)) ? " X" : "",
+			(g->stalledAxes & (1 << YAXIS)) ? " Y" : "");
+	}
+	if (g->settle.axes && g->settle.settled > 0.0) {
+		printf("Last move settled %.3f s after it ended, residual (X,Y) %.0f %.0f counts\n",
+			g->settle.settled - g->settle.moveEnd, g->settle.residual[XAXIS], g->settle.residual[YAXIS]);
+	} else if (g->settle.axes) {
+		printf("Last move never settled\n");
+	}
+	if (g->link.drops) {
+		printf("Connection: lost %d times, restored %d (%d found the controller reset)\n",
+			g->link.drops, g->link.reconnects, g->link.resets);
 	}
 
 	// Print the sensor states
 	printf("Cylinders:\n");
-	if (cylinder(Y1AXIS, STATUS) == EXTEND) {
+	if (cylinder(g, Y1AXIS, STATUS) == EXTEND) {
 		printf("Y1 EXTENDED\n");
-	} else if (cylinder(Y1AXIS, STATUS) == RETRACT) {
+	} else if (cylinder(g, Y1AXIS, STATUS) == RETRACT) {
 		printf("Y1 RETRACTED\n");
 	} else {
 		printf("Y1 UNKNOWN\n");
 	}
-	if (cylinder(Y2AXIS, STATUS) == EXTEND) {
+	if (cylinder(g, Y2AXIS, STATUS) == EXTEND) {
 		printf("Y2 EXTENDED\n");
-	} else if (cylinder(Y1AXIS, STATUS) == RETRACT) {
+	} else if (cylinder(g, Y1AXIS, STATUS) == RETRACT) {
 		printf("Y2 RETRACTED\n");
 	} else {
 		printf("Y2 UNKNOWN\n");
 	}
-	if (cylinder(SAXIS, STATUS) == EXTEND) {
+	if (cylinder(g, SAXIS, STATUS) == EXTEND) {
 		printf("S EXTENDED\n");
-	} else if (cylinder(SAXIS, STATUS) == RETRACT) {
+	} else if (cylinder(g, SAXIS, STATUS) == RETRACT) {
 		printf("S RETRACTED\n");
 	} else {
 		printf("S UNKNOWN\n");
 	}
 
 	// Print the limit switch states
-	printf("X Limits: ");
-	if (limitSwitch(XAXIS)) {
-		if (limitSwitch(XAXIS) & 0x01) {
-			printf("Reverse ");
-		}
-		if ((limitSwitch(XAXIS)>>1) & 0x01) {
-			printf("Forward");
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		printf("%c Limits: ", axisTable[axis].name);
+		status = limitSwitch(g, axis);
+		if (status) {
+			if (status & 0x01) {
+				printf("Reverse ");
+			}
+			if ((status>>1) & 0x01) {
+				printf("Forward ");
+			}
+		} else {
+			printf("Neither active");
 		}
-	} else {
-		printf("Neither active");
+		printf("\n");
 	}
-	printf("\n");
+}
 
-	printf("Y Limits: ");
-	if (limitSwitch(YAXIS)) {
-		if (limitSwitch(YAXIS) & 0x01) {
-			printf("Reverse ");
-		}
-		if ((limitSwitch(YAXIS)>>1) & 0x01) {
-			printf("Forward ");
-		}
-	} else {
-		printf("Neither active");
+
+/*-------------------------------------------------------------------
+
+	int startRelXYZ(struct guider *g, long int x, long int y, long int z) (LIBRARY)
+
+	startRelXYZ starts relative moves of the X-Y stage and the
+	focus stage and returns without waiting, giving the bit mask
+	of axes that were started. The focus motor has no brake, so it
+	is started first and runs while the X-Y brakes are released;
+	X and Y then start with one BG. Wait with superviseMove() or
+	waitAxes() and power down with motorPower().
+
+	As in focusRel(), the focus move is skipped if the X reverse
+	limit is engaged. A move that softLimitCheck() says would end
+	past an axis's soft limit is skipped too.
+
+-------------------------------------------------------------------*/
+int startRelXYZ(g, x, y, z)
+struct guider *g;
+long int x, y, z;
+{
+
+	int axes;
+
+	if (!softLimitCheck(g, XAXIS, x)) {
+		x = 0;
 	}
-	printf("\n");
+	if (!softLimitCheck(g, YAXIS, y)) {
+		y = 0;
+	}
+	if (!softLimitCheck(g, ZAXIS, z)) {
+		z = 0;
+	}
+	axes = 0;
+	if (z && !(limitSwitch(g, XAXIS) & 0x01)) {
+		prepareMove(g, ZAXIS, z, g->axisProfile[ZAXIS].speed);
+		beginAxes(g, 1 << ZAXIS);
+		axes |= (1 << ZAXIS);
+	}
+	if (x) {
+		prepareMove(g, XAXIS, x, g->axisProfile[XAXIS].speed);
+		axes |= (1 << XAXIS);
+	}
+	if (y) {
+		prepareMove(g, YAXIS, y, g->axisProfile[YAXIS].speed);
+		axes |= (1 << YAXIS);
+	}
+	beginAxes(g, axes & ~(1 << ZAXIS));
+	return(axes);
 
-	printf("Z Limits: ");
-	if (limitSwitch(ZAXIS)) {
-		if (limitSwitch(ZAXIS) & 0x01) {
-			printf("Reverse ");
-		}
-		if ((limitSwitch(ZAXIS)>>1) & 0x01) {
-			printf("Forward ");
-		}
-	} else {
-		printf("Neither active");
+}
+
+/*-------------------------------------------------------------------
+
+	void statAdd(struct latencyStats *st, double t) (LIBRARY)
+
+	Adds the latency t seconds to st. Doesn't allocate or block,
+	so the guide thread can use it.
+
+-------------------------------------------------------------------*/
+void statAdd(st, t)
+struct latencyStats *st;
+double t;
+{
+
+	int bin;
+
+	if (t < 0.0) {
+		t = 0.0;
 	}
-	printf("\n");
+	st->n++;
+	st->sum += t;
+	if (t > st->max) {
+		st->max = t;
+	}
+	bin = (int) (t / STATBINWIDTH);
+	st->hist[(bin < STATBINS) ? bin : STATBINS - 1]++;
+
 }
 
+/*-------------------------------------------------------------------
+
+	void statPrint(char *label, struct latencyStats *st) (USER)
+
+	Prints the count, mean and maximum of st, and the fraction of
+	samples under each STATBINWIDTH multiple (microseconds).
+
+-------------------------------------------------------------------*/
+void statPrint(label, st)
+char *label;
+struct latencyStats *st;
+{
+
+	int i;
+	long int sum;
+
+	printf("%s: n %ld", label, st->n);
+	if (st->n == 0) {
+		printf("\n");
+		return;
+	}
+	printf(" mean %.0f us max %.0f us\n", 1.0e6 * st->sum / st->n, 1.0e6 * st->max);
+	sum = 0;
+	for (i = 0; i < STATBINS - 1; i++) {
+		sum += st->hist[i];
+		if (st->hist[i]) {
+			printf("  < %4.0f us %6.2f%%\n", 1.0e6 * STATBINWIDTH * (i + 1), 100.0 * sum / st->n);
+		}
+	}
+	if (st->hist[STATBINS - 1]) {
+		printf(" >= %4.0f us %6.2f%%\n", 1.0e6 * STATBINWIDTH * (STATBINS - 1),
+			100.0 * st->hist[STATBINS - 1] / st->n);
+	}
+
+}
 
 /*-------------------------------------------------------------------
 
-	stepPosition(axis) (LIBRARY)
+	stepPosition(g, axis) (LIBRARY)
 
 	stepPosition returns the motor step position of the selected
 	axis. Axis may be XAXIS, YAXIS, or ZAXIS.
@@ -2062,68 +8412,319 @@ void statusPrint()
 
 Checked 2012-04-26
 -------------------------------------------------------------------*/
-long int stepPosition(axis)
+long int stepPosition(g, axis)
+struct guider *g;
 int axis;
 
 {
 
-	switch (axis) {
+	char buf[8];
+
+	if (axis < XAXIS || axis > LASTAXIS) {
+		return(BADAXIS);
+	}
+	sprintf(buf, "RP%c", axisTable[axis].letter);
+	return(askGalilForLong(g, buf));
+}
+	
+void stopMotors(g)
+struct guider *g;
+{
+
+	if (g->clock.loaded) {			// Cancel a scheduleAxes() move
+		tellGalil(g, "HX1");
+		tellGalil(g, "ttdone=1");
+	}
+	tellGalil(g, "ST");
+}
+
+
+/*-------------------------------------------------------------------
+
+	int superviseMove(g, axes) (LIBRARY)
+
+	superviseMove waits for the moves on the selected axes to
+	finish while comparing encoder travel to the commanded
+	(reference) position. "axes" is a bit mask, (1 << XAXIS) |
+	(1 << YAXIS) for example. Each sample is one batched query
+	of _BG, _RP and (for X and Y) _TP. Samples are SUPPERIOD apart
+	and stop just before the predicted end of the move, after
+	which the controller is polled until the axes stop.
+
+	An axis is stopped at once if its encoder stops following
+	while steps are still being sent (SUPSTALLN samples with less
+	than SUPSTALLFRAC of the commanded travel) or if the total
+	encoder travel diverges from the commanded travel by more
+	than SUPERRCOUNTS plus SUPLAG seconds of motion. The same
+	divergence test is applied when the move ends, which catches
+	steps lost during deceleration.
+
+	A stalled or diverged axis is added to stalledAxes and
+	isCalibrated is cleared, since positions derived from step
+	counts are no longer trustworthy. The Z axis has no encoder
+	and is only waited for. Returns PASS or FAIL; FAIL too if
+	SUPMAXFAIL queries in a row, SUPPERIOD apart, go unanswered.
 
-		case XAXIS:
-			return(askGalilForLong("RPA"));
+-------------------------------------------------------------------*/
+int superviseMove(g, axes)
+struct guider *g;
+int axes;
+{
 
-		case YAXIS:
-			return(askGalilForLong("RPB"));
+	char *operands[3 * LASTAXIS], names[3 * LASTAXIS][8], cmd[8];
+	int axis, n, first, moving, stopped, failed, retVal, slow[LASTAXIS + 1];
+	long int rp0[LASTAXIS + 1], enc0[LASTAXIS + 1], lastRp[LASTAXIS + 1], lastEnc[LASTAXIS + 1], rp, enc;
+	double vals[3 * LASTAXIS], encPerStep[LASTAXIS + 1], t, lastT, dCmd, dEnc, err, allowed, eta;
 
-		case ZAXIS:
-			return(askGalilForLong("RPC"));
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		encPerStep[axis] = (g->isCalibrated && g->encPerStep[axis]) ? g->encPerStep[axis] :
+			(double) axisTable[axis].encPerTurn / axisTable[axis].stepsPerTurn;
+	}
 
-		default:
-			return(BADAXIS);
+	retVal = PASS;
+	stopped = 0;
+	failed = 0;
+	first = 1;
+	moving = 1;
+	lastT = hostSeconds();
+	do {
+		// One query for all supervised axes: _BG, _RP, and _TP if there's an encoder
+		n = 0;
+		for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+			if (!(axes & (1 << axis))) {
+				continue;
+			}
+			sprintf(names[n++], "_BG%c", axisTable[axis].letter);
+			sprintf(names[n++], "_RP%c", axisTable[axis].letter);
+			if (axisTable[axis].encPerTurn) {
+				sprintf(names[n++], "_TP%c", axisTable[axis].letter);
+			}
+		}
+		for (axis = 0; axis < n; axis++) {
+			operands[axis] = names[axis];
+		}
+		if (askGalilForValues(g, operands, n, vals) != n) {
+			if (++failed >= SUPMAXFAIL) {
+				LOG(g, LOGMOTION, LOGWARN, "can't read the axes to supervise the move");
+				return(FAIL);
+			}
+			usleep((useconds_t) (SUPPERIOD * 1.0e6));
+			continue;
+		}
+		failed = 0;
+		t = hostSeconds();
+
+		moving = 0;
+		n = 0;
+		for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+			if (!(axes & (1 << axis))) {
+				continue;
+			}
+			if (vals[n]) {
+				moving = 1;
+			}
+			if (axisTable[axis].encPerTurn == 0) {
+				estimateStep(g, axis, t, (long int) vals[n + 1]);
+				n += 2;
+				continue;
+			}
+			rp = (long int) vals[n + 1];
+			enc = (long int) vals[n + 2];
+			estimateStep(g, axis, t, rp);
+			estimateEncoder(g, axis, t, enc);
+			if (first) {
+				rp0[axis] = lastRp[axis] = rp;
+				enc0[axis] = lastEnc[axis] = enc;
+				slow[axis] = 0;
+				n += 3;
+				continue;
+			}
+
+			dCmd = (double) (rp - lastRp[axis]) * encPerStep[axis];
+			dEnc = (double) (enc - lastEnc[axis]);
+			if (fabs(dCmd) > SUPMINCOUNTS && fabs(dEnc) < SUPSTALLFRAC * fabs(dCmd)) {
+				slow[axis]++;
+			} else {
+				slow[axis] = 0;
+			}
+			err = (double) (enc - enc0[axis]) - (double) (rp - rp0[axis]) * encPerStep[axis];
+			allowed = SUPERRCOUNTS;
+			if (vals[n] && t > lastT) {
+				allowed += fabs(dCmd) / (t - lastT) * SUPLAG;
+			}
+			if (slow[axis] >= SUPSTALLN || fabs(err) > allowed) {
+				sprintf(cmd, "ST%c", axisTable[axis].letter);
+				tellGalil(g, cmd);
+				g->stalledAxes |= (1 << axis);
+				stopped |= (1 << axis);
+				g->isCalibrated = 0;
+				retVal = FAIL;
+				LOG(g, LOGMOTION, LOGWARN, "%c axis stalled (error %.0f counts)", axisTable[axis].name, err);
+			}
+			lastRp[axis] = rp;
+			lastEnc[axis] = enc;
+			if (!vals[n]) {
+				g->cmdPosition[axis] = rp;	// Where it really stopped
+				g->cmdKnown |= (1 << axis);
+			}
+			n += 3;
+		}
+		axes &= ~stopped;
+		first = 0;
+		lastT = t;
+
+		// Sleep until the next sample, or until just before the end
+		if (moving && axes) {
+			eta = 0.0;
+			for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+				if ((axes & (1 << axis)) && moveETA(g, axis) > eta) {
+					eta = moveETA(g, axis);
+				}
+			}
+			if (eta - WAITGUARD > SUPPERIOD) {
+				usleep((useconds_t) (SUPPERIOD * 1.0e6));
+			} else if (eta > WAITGUARD) {
+				usleep((useconds_t) ((eta - WAITGUARD) * 1.0e6));
+			}
+		}
+	} while (moving && axes);
+
+	// Let any stopped axes finish decelerating
+	if (stopped) {
+		waitAxes(g, stopped);
 	}
+	return(retVal);
+
 }
-	
-void stopMotors()
+
+/*-------------------------------------------------------------------
+
+	void targetListUser(struct guider *g) (USER)
+
+	Reads a file of "x y" stage positions (inches, one per line)
+	and visits them all with acquireTargets(), printing the order
+	and the time taken.
+
+-------------------------------------------------------------------*/
+void targetListUser(g)
+struct guider *g;
 {
 
-	tellGalil("ST");
+	char buf[256];
+	int n, visited;
+	float x[MAXTARGETS], y[MAXTARGETS];
+	double t0, predicted;
+	int order[MAXTARGETS];
+	FILE *fp;
+
+	if (!g->isCalibrated) {
+		printf("Calibrate first\n");
+		return;
+	}
+	printf("Target list file: ");
+	fflush(stdout);
+	if (getLine(buf, sizeof(buf)) == NULL) {
+		return;
+	}
+	if ((fp = fopen(buf, "r")) == NULL) {
+		printf("can't open %s\n", buf);
+		return;
+	}
+	n = 0;
+	while (n < MAXTARGETS && fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "%f %f", &x[n], &y[n]) == 2) {
+			n++;
+		}
+	}
+	fclose(fp);
+
+	predicted = planTargets(g, n, x, y, order);
+	printf("%d targets, predicted move time %.1f s\n", n, predicted);
+	t0 = hostSeconds();
+	visited = acquireTargets(g, n, x, y, order, targetVisitUser);
+	printf("%d targets visited in %.1f s\n", visited, hostSeconds() - t0);
+	fflush(stdout);
+
+}
+
+/*-------------------------------------------------------------------
+
+	double targetTime(g, dx, dy, dz) (LIBRARY)
+
+	Returns the predicted time in seconds to move the stage by
+	(dx, dy) inches and the focus by dz mils with the current
+	axis profiles. The axes move at the same time, so this is the
+	longest of the three.
+
+-------------------------------------------------------------------*/
+double targetTime(g, dx, dy, dz)
+struct guider *g;
+double dx, dy, dz;
+{
+
+	int axis;
+	double d[LASTAXIS + 1], t, tmax;
+
+	d[XAXIS] = dx;
+	d[YAXIS] = dy;
+	d[ZAXIS] = dz / 1000.0;			// Mils
+	tmax = 0.0;
+	for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+		t = moveDuration(g, axis, (long int) (d[axis] * axisTable[axis].stepsPerTurn / axisTable[axis].pitch));
+		if (t > tmax) {
+			tmax = t;
+		}
+	}
+	return(tmax);
+
 }
 
+int targetVisitUser(i, x, y)
+int i;
+float x, y;
+{
+
+	printf("target %d at %7.3f %7.3f\n", i, x, y);
+	fflush(stdout);
+	return(1);
+
+}
 
 /*-------------------------------------------------------------------
 
-	char *tellGalil(char *cmd) (LIBRARY)
+	int tellGalil(struct guider *g, char *cmd) (LIBRARY)
 
 	Send a command to the Galil controller. cmd is a NUL
-	terminated string containing the Galil command. If the
-	Galil returns a '?' instead of a ':' as the first character,
-	then this function returns a pointer to a string containing
-	the TC1 error message. If it returns neither a '?' or a ':'
-	then it returns an error message with the character showing.
-	Otherwise, it returns a pointer to a zero length string
-	(first byte is '\0').
+	terminated string containing the Galil command. Returns 1 if
+	the Galil accepts it (':'), 0 if not. A '?' is followed by
+	TC1, and the error message, or the unexpected first character
+	of the reply, is logged (LOGIO, debug). The reply lives on the
+	caller's stack, so other threads sharing the guider can't
+	overwrite it.
 
 Checked 2012-04-30
 -------------------------------------------------------------------*/
-char *tellGalil(cmd)
+int tellGalil(g, cmd)
+struct guider *g;
 char *cmd;
 {
 
-	uint8_t code;
-	static char buf[512];
-
-	askGalil(cmd, buf, 512);
-	if (buf[0] == ':') {
-		memset(buf, 0, 512);
-		return(buf);
-	} else if (buf[0] == '?') {
-		askGalil("TC1", buf, 512);
-		return(buf);
-	} else {
-		code = (uint8_t) buf[0];
-		sprintf(buf, "Unexpected response from Galil (first char = %X)\n", code);
-		return(buf);
+	char reply[512];
+	int ok;
+
+	galilLock(g);				// So TC1 follows its own '?'
+	askGalil(g, cmd, reply, sizeof(reply));
+	ok = (reply[0] == ':');
+	if (reply[0] == '?') {
+		askGalil(g, "TC1", reply, sizeof(reply));
+		reply[strcspn(reply, "\r\n")] = '\0';
+		LOG(g, LOGIO, LOGDEBUG, "%s: %s", cmd, reply);
+	} else if (!ok) {
+		LOG(g, LOGIO, LOGDEBUG, "%s: unexpected response from Galil (first char = %X)",
+			cmd, (uint8_t) reply[0]);
 	}
+	galilUnlock(g);
+	return(ok);
 }
 
 /*-------------------------------------------------------------------
@@ -2137,7 +8738,10 @@ char *cmd;
 	an error code.
 
 	The ipaddress string must be an IPv4 quartet, not a host name
-	(e.g., "192.168.1.2").
+	(e.g., "192.168.1.2"). It may end in ":port" to reach something
+	other than the controller on GALILPORT, such as galilproxy
+	("127.0.0.1:9079"). "replay:file[@speed]" plays back a
+	recorded transcript instead (replayOpen()).
 
 	The Galil controller doesn't care about port numbers.
 	This routine uses the #define GALILPORT value. The standard
@@ -2151,7 +8755,12 @@ char *cmd;
 
 	-1 inet_pton() failed.
 	-2 socket() failed.
-	-3 connect() failed.
+	-3 connect() failed or took longer than CONNECTTIMEOUT.
+	-4 the transcript to replay couldn't be read.
+
+	The connection uses TCP keepalive (KEEPIDLE, KEEPINTVL,
+	KEEPCNT), so a controller that goes away while the link is
+	idle is noticed too; see galilReconnect().
 
 Checked 2012-04-26
 -------------------------------------------------------------------*/
@@ -2159,34 +8768,279 @@ int telnetToGalil(ipaddress)
 char *ipaddress;
 {
 
-	char buf[256];
-	int i, fd;
+	char buf[256], host[80], *cp;
+	int fd, on, err;
+	socklen_t len;
 	struct sockaddr_in sockGalil;
+	struct pollfd pfd;
 
+	if (strncmp(ipaddress, "replay:", 7) == 0) {
+		return(replayOpen(ipaddress + 7));
+	}
 	memset(buf, 0, 80);
 	memset((char *) &sockGalil, 0, sizeof(sockGalil));
 	sockGalil.sin_family = AF_INET;
 	sockGalil.sin_port = htons(GALILPORT);
-	if (inet_pton(AF_INET, ipaddress, &(sockGalil.sin_addr)) <= 0) {
+	strncpy(host, ipaddress, sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+	if ((cp = strchr(host, ':'))) {
+		*cp = '\0';
+		sockGalil.sin_port = htons(atoi(cp + 1));
+	}
+	if (inet_pton(AF_INET, host, &(sockGalil.sin_addr)) <= 0) {
 		return(-1);
 	}
 
 	if ((fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
 		return(-2);
 	}
-
-	if (connect(fd, (struct sockaddr *) &sockGalil, sizeof(sockGalil))) {
+	fcntl(fd, F_SETFD, FD_CLOEXEC);		// Not inherited by pipeHookOpen() programs
+
+	// Connect without blocking, so a missing controller costs CONNECTTIMEOUT
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	err = 0;
+	len = sizeof(err);
+	if (connect(fd, (struct sockaddr *) &sockGalil, sizeof(sockGalil)) &&
+		(errno != EINPROGRESS || poll(&pfd, 1, (int) (CONNECTTIMEOUT * 1000.0)) <= 0 ||
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err)) {
+		close(fd);
 		return(-3);
 	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+	on = KEEPIDLE;
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &on, sizeof(on));
+	on = KEEPINTVL;
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &on, sizeof(on));
+	on = KEEPCNT;
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &on, sizeof(on));
+#endif
 
 	// Clear the Galil output buffer (it's always been empty when I've looked)
-	i = write(fd, "\r", 1);
-	i = read(fd, buf, 255);
+	pfd.events = POLLIN;
+	if (write(fd, "\r", 1) == 1 && poll(&pfd, 1, (int) (READTIMEOUT * 1000.0)) > 0) {
+		read(fd, buf, 255);
+	}
 	return(fd);
 
 }
 
-void testFunction()
+/*-------------------------------------------------------------------
+
+	void transcriptAdd(struct guider *g, int dir, char *buf, int n) (LIBRARY)
+
+	Appends one write ('>') or read ('<') of n bytes to g's
+	transcript as a line "dir seconds data", seconds from the
+	start of the recording and data with \r, \n, \\ and other
+	unprintable bytes escaped (\xHH). Called by galilSend() and
+	galilRecv() with ioLock held.
+
+-------------------------------------------------------------------*/
+void transcriptAdd(g, dir, buf, n)
+struct guider *g;
+int dir;
+char *buf;
+int n;
+{
+
+	int i;
+	unsigned char c;
+
+	fprintf(g->log.fp, "%c %.6f ", dir, hostSeconds() - g->log.start);
+	for (i = 0; i < n; i++) {
+		c = (unsigned char) buf[i];
+		if (c == '\r') {
+			fputs("\\r", g->log.fp);
+		} else if (c == '\n') {
+			fputs("\\n", g->log.fp);
+		} else if (c == '\\') {
+			fputs("\\\\", g->log.fp);
+		} else if (c < ' ' || c > '~') {
+			fprintf(g->log.fp, "\\x%02x", c);
+		} else {
+			putc(c, g->log.fp);
+		}
+	}
+	putc('\n', g->log.fp);
+	if (dir == '>') {
+		g->log.nSends++;
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	int transcriptOpen(struct guider *g, char *file) (LIBRARY)
+
+	Starts recording every command sent to g's controller and
+	every reply, with times, in "file" (aoguider -t). The file can
+	be played back with replayOpen(). Returns 1, or 0 if the file
+	can't be written.
+
+-------------------------------------------------------------------*/
+int transcriptOpen(g, file)
+struct guider *g;
+char *file;
+{
+
+	static int reporting = 0;
+	FILE *fp;
+
+	if (!(fp = fopen(file, "w"))) {
+		return(0);
+	}
+	fprintf(fp, "# aoguider transcript, %s at %s\n", g->name, g->ipaddress);
+	pthread_mutex_lock(&g->ioLock);
+	strncpy(g->log.file, file, sizeof(g->log.file) - 1);
+	g->log.start = hostSeconds();
+	g->log.nSends = 0;
+	g->log.fp = fp;
+	pthread_mutex_unlock(&g->ioLock);
+	if (!reporting) {
+		atexit(transcriptReport);
+		reporting = 1;
+	}
+	return(1);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void transcriptReport(void) (LIBRARY)
+
+	Run at exit: finishes the transcripts being recorded and says
+	how many commands each holds, and for each replayed transcript
+	how many commands were answered and how well they followed
+	the recording, with the controller time the recording spent
+	on them against the time the replay ran.
+
+-------------------------------------------------------------------*/
+void transcriptReport()
+{
+
+	static int done = 0;
+	struct replay *r;
+	int i;
+
+	if (done++) {
+		return;				// Registered twice
+	}
+	for (i = 0; i < nGuiders; i++) {
+		if (guiders[i].log.fp) {
+			fflush(guiders[i].log.fp);
+			printf("%s transcript %s: %ld commands in %.3f s\n", guiders[i].name,
+				guiders[i].log.file, guiders[i].log.nSends,
+				hostSeconds() - guiders[i].log.start);
+		}
+	}
+	for (r = replays; r; r = r->link) {
+		printf("replay %s: %ld commands (%ld in order, %ld reused, %ld unknown, %ld skipped)"
+			", %.3f s recorded latency, %.3f s run\n", r->file,
+			r->inOrder + (r->next - r->inOrder - r->skipped) + r->reused + r->unknown,
+			r->inOrder, r->reused, r->unknown, r->skipped, r->recorded,
+			hostSeconds() - r->start);
+	}
+	fflush(stdout);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int transformCheck(struct guider *g) (LIBRARY)
+
+	Checks inchesToEncoder() against encoderTarget(), the
+	arithmetic moveAbs() uses, on a grid covering the calibrated
+	travel in 0.001 inch steps near the ends and coarser steps in
+	between. Returns the number of positions where they differ.
+
+-------------------------------------------------------------------*/
+int transformCheck(g)
+struct guider *g;
+{
+
+	int i, n, bad;
+	float x[1000], y[1000];
+	long int xEnc[1000], yEnc[1000];
+
+	n = 0;
+	for (i = 0; i < 300; i++) {
+		x[n] = 0.001 * i;
+		y[n++] = 0.001 * i;
+		x[n] = g->maxInches[XAXIS] - 0.001 * i;
+		y[n++] = g->maxInches[YAXIS] - 0.001 * i;
+	}
+	while (n < 1000) {
+		x[n] = g->maxInches[XAXIS] * (n - 600) / 400.0;
+		y[n] = g->maxInches[YAXIS] * (n - 600) / 400.0;
+		n++;
+	}
+	inchesToEncoder(g, n, x, y, xEnc, yEnc);
+	bad = 0;
+	for (i = 0; i < n; i++) {
+		if (xEnc[i] != encoderTarget(g, XAXIS, x[i]) ||
+		    yEnc[i] != encoderTarget(g, YAXIS, y[i])) {
+			bad++;
+		}
+	}
+	return(bad);
+
+}
+
+/*-------------------------------------------------------------------
+
+	int waitAxes(g, axes) (LIBRARY)
+
+	waitAxes waits for the moves on the selected axes ("axes" is a
+	bit mask of (1 << XAXIS) etc.) to finish. Rather than polling
+	the controller for the whole move it sleeps until WAITGUARD
+	seconds before the predicted end (moveETA()) and only then
+	polls. Sleeps are capped at WAITMAXSLEEP so a move that stops
+	early (limit switch, ST) is noticed promptly.
+
+	Returns 0 when none of the axes are moving.
+
+-------------------------------------------------------------------*/
+int waitAxes(g, axes)
+struct guider *g;
+int axes;
+{
+
+	int axis;
+	double eta, wait;
+
+	for (;;) {
+		eta = 0.0;
+		for (axis = XAXIS; axis <= LASTAXIS; axis++) {
+			if ((axes & (1 << axis)) && moveETA(g, axis) > eta) {
+				eta = moveETA(g, axis);
+			}
+		}
+		if (eta <= WAITGUARD) {
+			break;
+		}
+		wait = eta - WAITGUARD;
+		if (wait > WAITMAXSLEEP) {
+			usleep((useconds_t) (WAITMAXSLEEP * 1.0e6));
+			if (!axesMoving(g, axes)) {
+				return(0);
+			}
+		} else {
+			usleep((useconds_t) (wait * 1.0e6));
+		}
+	}
+	while (axesMoving(g, axes)) {
+	}
+	return(0);
+
+}
+
+void testFunction(g)
+struct guider *g;
 {
 
 	int i, speed;
@@ -2194,16 +9048,14 @@ void testFunction()
 	for (i = 2; i < 9; i++) {
 		speed = 500 * i + 250;
 		printf("speed = %d\n", speed);
-		moveOneAxis(YAXIS, -3000, speed);
-		while (isMoving(YAXIS)) {
-		}
+		moveOneAxis(g, YAXIS, -3000, speed);
+		waitAxes(g, 1 << YAXIS);
 		sleep(1);
-		moveOneAxis(YAXIS, 3000, speed);
-		while (isMoving(YAXIS)) {
-		}
+		moveOneAxis(g, YAXIS, 3000, speed);
+		waitAxes(g, 1 << YAXIS);
 		sleep(1);
 	}
-	motorPower(YAXIS, OFF);
+	motorPower(g, YAXIS, OFF);
 
 }
 
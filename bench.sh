@@ -0,0 +1,87 @@
+#!/bin/sh
+# bench.sh - how long aoguider's operations take over a bad network
+#
+#	sh bench.sh controller[:port] [profile ...]
+#
+# For each profile (all of them if none are named) galilproxy is put
+# between aoguider and the controller with the profile's options, and
+# this batch script (aoguider -b) is run through it:
+#
+#	init, home, calibrate, move to the field center, status
+#
+# One line per profile gives the seconds homeAxes(), calibrate(),
+# moveAbs() (the move and the wait for it) and statusPrint() took.
+# FAIL means the command failed, e.g. the connection was dropped, and
+# "-" that it never ran. Each run's output is left in bench-<profile>.log
+# and the proxy's in bench-<profile>-proxy.log.
+#
+# This moves the stage over its whole travel.
+
+PROFILES="lan wan jitter fragment coalesce flaky"
+PORT=9079
+
+profile() {
+	case $1 in
+	lan)		echo "" ;;			# Proxy overhead only
+	wan)		echo "-d 20" ;;			# 40 ms more round trip
+	jitter)		echo "-d 5 -j 30" ;;
+	fragment)	echo "-f 1" ;;			# Replies a byte at a time
+	coalesce)	echo "-c 20" ;;			# Replies held and merged
+	flaky)		echo "-d 5 -x 60" ;;		# Dropped about once a minute
+	*)		return 1 ;;
+	esac
+}
+
+if [ $# -lt 1 ]; then
+	echo "usage: sh bench.sh controller[:port] [profile ...]"
+	exit 1
+fi
+controller=$1
+shift
+if [ $# -ge 1 ]; then
+	PROFILES="$*"
+fi
+
+cc -o aoguider aoguider.c -lm -lpthread || exit 1
+cc -o galilproxy galilproxy.c -lpthread -lm || exit 1
+
+printf "%-10s %10s %10s %10s %10s\n" profile home calibrate move status
+for p in $PROFILES; do
+	if ! opts=$(profile $p); then
+		echo "$p: no such profile"
+		continue
+	fi
+	./galilproxy -l $PORT $opts $controller > bench-$p-proxy.log 2>&1 &
+	proxy=$!
+	sleep 1
+	printf 'init\nhome\ncalibrate\nmove 3.5 7.5\nwait\nstatus\n' |
+		./aoguider -b - 127.0.0.1:$PORT > bench-$p.log 2>&1
+	kill $proxy
+	wait $proxy 2> /dev/null
+
+	# batchRun() lines: line number, command, seconds, "s", maybe FAILED
+	awk -v p=$p '
+	$1 ~ /^[0-9]+$/ && ($NF == "s" || $NF == "FAILED") {
+		failed = ($NF == "FAILED")
+		v = ($2 == "wait") ? "move" : $2
+		t[v] += failed ? $(NF - 2) : $(NF - 1)
+		ran[v] = 1
+		if (failed) {
+			bad[v] = 1
+		}
+	}
+	END {
+		printf "%-10s", p
+		n = split("home calibrate move status", k, " ")
+		for (i = 1; i <= n; i++) {
+			if (bad[k[i]]) {
+				printf " %10s", "FAIL"
+			} else if (ran[k[i]]) {
+				printf " %10.3f", t[k[i]]
+			} else {
+				printf " %10s", "-"
+			}
+		}
+		printf "\n"
+	}' bench-$p.log
+done
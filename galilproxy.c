@@ -0,0 +1,549 @@
+/* galilproxy
+
+	A TCP proxy to put between aoguider and a Galil controller (or
+	a stand-in for one) that makes the network worse on purpose, to
+	see how aoguider copes: added delay and jitter, replies split
+	into fragments or held back and merged, and dropped connections.
+	bench.sh runs aoguider through it with a set of profiles.
+
+	galilproxy [-l port] [-d ms] [-j ms] [-f bytes] [-c ms]
+		[-x seconds] [-s seed] host[:port]
+
+	-l port		Port to listen on (PROXYPORT)
+	-d ms		Delay added to everything, each direction
+	-j ms		Further random delay, 0 to ms, per read; the byte
+			order is kept, as TCP would
+	-f bytes	Send replies (controller to aoguider) in pieces of
+			at most this many bytes, FRAGGAP apart
+	-c ms		Hold replies this long and send all that has
+			arrived in one write (reply coalescing)
+	-x seconds	Drop each connection after a random time that
+			averages this many seconds
+	-s seed		Random number seed, to repeat a run
+
+	host is an IPv4 address; port defaults to GALILPORT. Several
+	connections can be open at once, each proxied separately.
+
+	cc -o galilproxy galilproxy.c -lpthread -lm
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define GALILPORT	8079		// As aoguider
+#define PROXYPORT	9079		// Default listening port
+#define CHUNKSIZE	1024		// Largest read forwarded as one piece
+#define FRAGGAP		0.001		// Seconds between reply fragments
+
+#define UPSTREAM	0		// Direction, aoguider to controller
+#define DOWNSTREAM	1		// Controller to aoguider (replies)
+
+/*
+	Data read from one side, waiting to be written to the other
+	at "due" (hostSeconds()).
+*/
+struct chunk {
+	struct chunk *next;
+	double	due;
+	int	len;
+	char	data[CHUNKSIZE];
+};
+
+/*
+	One direction of a proxied connection. The reader thread
+	queues chunks, the writer thread sends them when due.
+*/
+struct pipeline {
+	struct session *s;
+	int	dir;			// UPSTREAM or DOWNSTREAM
+	int	from;			// Socket read
+	int	to;			// Socket written
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct chunk *head;		// Oldest queued chunk
+	struct chunk *tail;
+	double	lastDue;		// Keeps the byte order under jitter
+	int	eof;			// Reader is done
+	long int bytes;
+};
+
+/*
+	A proxied connection: aoguider's socket, the controller's and
+	the two directions between them.
+*/
+struct session {
+	int	id;
+	int	client;
+	int	server;
+	volatile int dead;		// Set once either side closes
+	pthread_mutex_t lock;
+	int	running;		// Threads still using the session
+	struct pipeline pipe[2];
+};
+
+// Function prototypes
+void	closeSession(struct session *, char *);
+void	*dropTimer(void *);
+double	hostSeconds(void);
+void	*pipeReader(void *);
+void	*pipeWriter(void *);
+void	releaseSession(struct session *);
+void	sleepUntil(double);
+void	startSession(int, int);
+double	uniform(void);
+void	usage(void);
+
+/* Globals */
+double delay = 0.0;			// -d, seconds
+double jitter = 0.0;			// -j, seconds
+int fragment = 0;			// -f, bytes, 0 for no fragmenting
+double coalesce = 0.0;			// -c, seconds
+double dropMean = 0.0;			// -x, seconds, 0 for never
+struct sockaddr_in upstream;		// The controller
+pthread_mutex_t randLock = PTHREAD_MUTEX_INITIALIZER;	// rand() isn't thread safe
+
+/*=================================================================*/
+int main(argc, argv)
+int argc;
+char *argv[];
+{
+
+	char host[80], *cp;
+	int c, lfd, fd, sfd, port, one;
+	unsigned int seed;
+	struct sockaddr_in addr;
+
+	port = PROXYPORT;
+	seed = (unsigned int) time(NULL);
+	while ((c = getopt(argc, argv, "l:d:j:f:c:x:s:")) != -1) {
+		switch (c) {
+		case 'l':
+			port = atoi(optarg);
+			break;
+		case 'd':
+			delay = atof(optarg) / 1000.0;
+			break;
+		case 'j':
+			jitter = atof(optarg) / 1000.0;
+			break;
+		case 'f':
+			fragment = atoi(optarg);
+			break;
+		case 'c':
+			coalesce = atof(optarg) / 1000.0;
+			break;
+		case 'x':
+			dropMean = atof(optarg);
+			break;
+		case 's':
+			seed = (unsigned int) atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+	}
+	srand(seed);
+
+	strncpy(host, argv[optind], sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+	memset(&upstream, 0, sizeof(upstream));
+	upstream.sin_family = AF_INET;
+	upstream.sin_port = htons(GALILPORT);
+	if ((cp = strchr(host, ':'))) {
+		*cp = '\0';
+		upstream.sin_port = htons(atoi(cp + 1));
+	}
+	if (inet_pton(AF_INET, host, &upstream.sin_addr) <= 0) {
+		printf("bad address %s\n", host);
+		return(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	one = 1;
+	if ((lfd = socket(PF_INET, SOCK_STREAM, 0)) < 0
+		|| setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+		|| bind(lfd, (struct sockaddr *) &addr, sizeof(addr))
+		|| listen(lfd, 8)) {
+		printf("can't listen on port %d\n", port);
+		return(1);
+	}
+	printf("port %d -> %s: delay %.1f ms, jitter %.1f ms, fragments %d, coalesce %.1f ms, drop %.1f s, seed %u\n",
+		port, argv[optind], 1000.0 * delay, 1000.0 * jitter, fragment,
+		1000.0 * coalesce, dropMean, seed);
+	fflush(stdout);
+
+	for (;;) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			continue;
+		}
+		if ((sfd = socket(PF_INET, SOCK_STREAM, 0)) < 0
+			|| connect(sfd, (struct sockaddr *) &upstream, sizeof(upstream))) {
+			printf("can't connect to %s\n", argv[optind]);
+			fflush(stdout);
+			if (sfd >= 0) {
+				close(sfd);
+			}
+			close(fd);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));	// Our delays only
+		setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		startSession(fd, sfd);
+	}
+	return(0);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void closeSession(struct session *s, char *why)
+
+	Marks the session dead and shuts both sockets down, which
+	wakes its threads so they finish. Only the first call reports.
+
+-------------------------------------------------------------------*/
+void closeSession(s, why)
+struct session *s;
+char *why;
+{
+
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	if (!s->dead) {
+		s->dead = 1;
+		shutdown(s->client, SHUT_RDWR);
+		shutdown(s->server, SHUT_RDWR);
+		printf("connection %d %s: %ld bytes up, %ld down\n", s->id, why,
+			s->pipe[UPSTREAM].bytes, s->pipe[DOWNSTREAM].bytes);
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&s->lock);
+	for (i = UPSTREAM; i <= DOWNSTREAM; i++) {
+		pthread_mutex_lock(&s->pipe[i].lock);
+		pthread_cond_broadcast(&s->pipe[i].ready);
+		pthread_mutex_unlock(&s->pipe[i].lock);
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	void *dropTimer(void *s)
+
+	Drops session s after an exponentially distributed time with
+	mean dropMean seconds, unless it has closed by then.
+
+-------------------------------------------------------------------*/
+void *dropTimer(arg)
+void *arg;
+{
+
+	struct session *s;
+	double until;
+
+	s = (struct session *) arg;
+	until = hostSeconds() - dropMean * log(1.0 - uniform());
+	while (!s->dead && hostSeconds() < until) {
+		usleep(10000);
+	}
+	if (!s->dead) {
+		closeSession(s, "dropped");
+	}
+	releaseSession(s);
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	double hostSeconds(void)
+
+	Monotonic clock in seconds.
+
+-------------------------------------------------------------------*/
+double hostSeconds()
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void *pipeReader(void *p)
+
+	Reads one side of the connection and queues what it gets to
+	be written delay (plus jitter) later. The due times never go
+	backwards, so jitter delays data but can't reorder it.
+
+-------------------------------------------------------------------*/
+void *pipeReader(arg)
+void *arg;
+{
+
+	struct pipeline *p;
+	struct chunk *c;
+	double due;
+
+	p = (struct pipeline *) arg;
+	for (;;) {
+		c = (struct chunk *) malloc(sizeof(struct chunk));
+		if (!c || (c->len = read(p->from, c->data, CHUNKSIZE)) <= 0) {
+			free(c);
+			break;
+		}
+		due = hostSeconds() + delay + jitter * uniform();
+		c->next = NULL;
+		pthread_mutex_lock(&p->lock);
+		c->due = (due > p->lastDue) ? due : p->lastDue;
+		p->lastDue = c->due;
+		if (p->tail) {
+			p->tail->next = c;
+		} else {
+			p->head = c;
+		}
+		p->tail = c;
+		pthread_cond_signal(&p->ready);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->eof = 1;
+	pthread_cond_signal(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	releaseSession(p->s);
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void *pipeWriter(void *p)
+
+	Writes queued chunks to the other side once they are due.
+	Replies (DOWNSTREAM) are held a further "coalesce" seconds
+	and everything due by then is sent together, then split into
+	"fragment" byte pieces if asked. Closes the session when the
+	reader has hit end of file and the queue is empty, or the
+	write fails.
+
+-------------------------------------------------------------------*/
+void *pipeWriter(arg)
+void *arg;
+{
+
+	char buf[16 * CHUNKSIZE];
+	struct pipeline *p;
+	struct chunk *c;
+	int len, n, piece;
+	double now;
+
+	p = (struct pipeline *) arg;
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (!p->head && !p->eof && !p->s->dead) {
+			pthread_cond_wait(&p->ready, &p->lock);
+		}
+		if (!p->head || p->s->dead) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		now = p->head->due;
+		pthread_mutex_unlock(&p->lock);
+
+		if (p->dir == DOWNSTREAM) {
+			now += coalesce;
+		}
+		sleepUntil(now);
+
+		len = 0;			// Take everything due by now
+		pthread_mutex_lock(&p->lock);
+		while ((c = p->head) && c->due <= now && len + c->len <= (int) sizeof(buf)) {
+			memcpy(buf + len, c->data, c->len);
+			len += c->len;
+			p->head = c->next;
+			if (!p->head) {
+				p->tail = NULL;
+			}
+			free(c);
+			if (p->dir == UPSTREAM || coalesce == 0.0) {
+				break;
+			}
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		piece = (p->dir == DOWNSTREAM && fragment > 0) ? fragment : len;
+		for (n = 0; n < len; n += piece) {
+			if (n > 0) {
+				usleep((useconds_t) (FRAGGAP * 1.0e6));
+			}
+			if (write(p->to, buf + n, (len - n < piece) ? len - n : piece) <= 0) {
+				len = -1;
+				break;
+			}
+		}
+		if (len < 0) {
+			break;
+		}
+		p->bytes += len;
+	}
+
+	closeSession(p->s, (p->dir == UPSTREAM) ? "closed by aoguider" : "closed by controller");
+	releaseSession(p->s);
+	return(NULL);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void releaseSession(struct session *s)
+
+	Called by each of a session's threads as it finishes; the last
+	one closes the sockets and frees the queues and the session.
+
+-------------------------------------------------------------------*/
+void releaseSession(s)
+struct session *s;
+{
+
+	struct chunk *c;
+	int i, last;
+
+	pthread_mutex_lock(&s->lock);
+	last = (--s->running == 0);
+	pthread_mutex_unlock(&s->lock);
+	if (!last) {
+		return;
+	}
+	close(s->client);
+	close(s->server);
+	for (i = UPSTREAM; i <= DOWNSTREAM; i++) {
+		while ((c = s->pipe[i].head)) {
+			s->pipe[i].head = c->next;
+			free(c);
+		}
+	}
+	free(s);
+
+}
+
+/*-------------------------------------------------------------------
+
+	void sleepUntil(double t)
+
+	Sleeps until hostSeconds() reaches t.
+
+-------------------------------------------------------------------*/
+void sleepUntil(t)
+double t;
+{
+
+	double wait;
+
+	if ((wait = t - hostSeconds()) > 0.0) {
+		usleep((useconds_t) (wait * 1.0e6));
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	void startSession(int client, int server)
+
+	Sets up a session between aoguider's socket and the
+	controller's and starts a reader and a writer thread for each
+	direction, plus dropTimer() if -x was given.
+
+-------------------------------------------------------------------*/
+void startSession(client, server)
+int client, server;
+{
+
+	static int nextId = 1;
+	struct session *s;
+	struct pipeline *p;
+	pthread_t tid;
+	int i;
+
+	if (!(s = (struct session *) calloc(1, sizeof(struct session)))) {
+		close(client);
+		close(server);
+		return;
+	}
+	s->id = nextId++;
+	s->client = client;
+	s->server = server;
+	pthread_mutex_init(&s->lock, NULL);
+	s->running = (dropMean > 0.0) ? 5 : 4;
+	for (i = UPSTREAM; i <= DOWNSTREAM; i++) {
+		p = &s->pipe[i];
+		p->s = s;
+		p->dir = i;
+		p->from = (i == UPSTREAM) ? client : server;
+		p->to = (i == UPSTREAM) ? server : client;
+		pthread_mutex_init(&p->lock, NULL);
+		pthread_cond_init(&p->ready, NULL);
+	}
+	printf("connection %d open\n", s->id);
+	fflush(stdout);
+	for (i = UPSTREAM; i <= DOWNSTREAM; i++) {
+		pthread_create(&tid, NULL, pipeReader, &s->pipe[i]);
+		pthread_detach(tid);
+		pthread_create(&tid, NULL, pipeWriter, &s->pipe[i]);
+		pthread_detach(tid);
+	}
+	if (dropMean > 0.0) {
+		pthread_create(&tid, NULL, dropTimer, s);
+		pthread_detach(tid);
+	}
+
+}
+
+/*-------------------------------------------------------------------
+
+	double uniform(void)
+
+	Random number in [0, 1).
+
+-------------------------------------------------------------------*/
+double uniform()
+{
+
+	double u;
+
+	pthread_mutex_lock(&randLock);
+	u = (double) rand() / ((double) RAND_MAX + 1.0);
+	pthread_mutex_unlock(&randLock);
+	return(u);
+
+}
+
+void usage()
+{
+
+	printf("usage: galilproxy [-l port] [-d ms] [-j ms] [-f bytes] [-c ms] [-x seconds] [-s seed] host[:port]\n");
+	exit(1);
+
+}